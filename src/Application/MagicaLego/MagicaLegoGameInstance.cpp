@@ -571,7 +571,7 @@ void MagicaLegoGameInstance::SwitchBasePlane(EBasePlane type)
         break;
     }
 
-    GetEngine().GetScene().MarkDirty();
+    GetEngine().GetScene().MarkDirtyForCpuAS();
 }
 
 void MagicaLegoGameInstance::CleanUp()
@@ -697,7 +697,7 @@ void MagicaLegoGameInstance::RebuildScene(std::unordered_map<uint32_t, FPlacedBl
         }
     }
 
-    GetEngine().GetScene().MarkDirty();
+    GetEngine().GetScene().MarkDirtyForCpuAS();
     GetEngine().GetScene().GetCPUAccelerationStructure().UpdateBVH(GetEngine().GetScene());
 }
 
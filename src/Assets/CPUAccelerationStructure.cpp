@@ -5,8 +5,18 @@
 #include "TextureImage.hpp"
 #include "Runtime/Engine.hpp"
 #include "Assets/Scene.hpp"
-
+#include "Options.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstddef>
 #include <chrono>
+#include <numeric>
+#include <random>
+#include <spdlog/spdlog.h>
 #include <xxhash.h>
 
 #define TINYBVH_IMPLEMENTATION
@@ -14,6 +24,8 @@
 
 
 static tinybvh::BVH GCpuBvh;
+// false until the first TLAS build and while the scene has no instances, GCpuBvh may point at stale instances then
+static bool GCpuBvhReady = false;
 static std::vector<tinybvh::BLASInstance>* GbvhInstanceList;
 static std::vector<FCPUTLASInstanceInfo>* GbvhTlasContexts;
 static std::vector<FCPUBLASContext>* GbvhBlasContexts;
@@ -41,116 +53,107 @@ uint FetchMaterialId(uint materialIdx, uint instanceId)
     return (*GbvhTlasContexts)[instanceId].matIdxs[materialIdx];
 }
 
+void ResolveHit(const tinybvh::Ray& ray, vec3& outNormal, uint& outMaterialId, uint& outInstanceId)
+{
+    uint32_t primIdx = ray.hit.prim;
+    tinybvh::BLASInstance& instance = (*GbvhInstanceList)[ray.hit.inst];
+    FCPUTLASInstanceInfo& instContext = (*GbvhTlasContexts)[ray.hit.inst];
+    FCPUBLASContext& context = (*GbvhBlasContexts)[instance.blasIdx];
+    mat4* worldTS = (mat4*)instance.transform;
+    vec4 normalWS = vec4( context.extinfos[primIdx].normal, 0.0f) * *worldTS;
+
+    outNormal = vec3(normalWS.x, normalWS.y, normalWS.z);
+    outMaterialId =  FetchMaterialId( context.extinfos[primIdx].matIdx, ray.hit.inst );
+    outInstanceId = instContext.nodeId;
+}
+
 bool TraceRay(vec3 origin, vec3 rayDir, float dist, vec3& outNormal, uint& outMaterialId, float& outRayDist, uint& outInstanceId )
 {
     tinybvh::Ray ray(tinybvh::bvhvec3(origin.x, origin.y, origin.z), tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z), dist);
-    GCpuBvh.Intersect(ray);
+    if (GCpuBvhReady)
+    {
+        GCpuBvh.Intersect(ray);
+    }
 
     if (ray.hit.t < dist)
     {
-        uint32_t primIdx = ray.hit.prim;
-        tinybvh::BLASInstance& instance = (*GbvhInstanceList)[ray.hit.inst];
-        FCPUTLASInstanceInfo& instContext = (*GbvhTlasContexts)[ray.hit.inst];
-        FCPUBLASContext& context = (*GbvhBlasContexts)[instance.blasIdx];
-        mat4* worldTS = (mat4*)instance.transform;
-        vec4 normalWS = vec4( context.extinfos[primIdx].normal, 0.0f) * *worldTS;
-
         outRayDist = ray.hit.t;
-        outNormal = vec3(normalWS.x, normalWS.y, normalWS.z);
-        outMaterialId =  FetchMaterialId( context.extinfos[primIdx].matIdx, ray.hit.inst );
-        outInstanceId = instContext.nodeId;
+        ResolveHit(ray, outNormal, outMaterialId, outInstanceId);
         return true;
     }
     
     return false;
 }
 
-#define FLOAT2 vec2
-#define FLOAT3 vec3
-#define FLOAT4 vec4
-
-float DetectDistance( FLOAT3 origin, FLOAT3 rayDir)
+// tinybvh的256-ray packet要求所有光线共享原点，且只能走单层BVH，穿不过TLAS
+// 所以这里用stream：同方向、原点相邻的光线连续遍历，TLAS和BLAS的节点基本都留在cache里
+void TraceRayStream(tinybvh::Ray* rays, uint32_t count)
 {
-    vec3 outNormal;
-    float outRayDist;
-    uint tempMaterialId;
-    uint tempInstanceId;
-    if( TraceRay(origin, rayDir, CUBE_UNIT * 64, outNormal, tempMaterialId, outRayDist, tempInstanceId))
+    if (!GCpuBvhReady)
     {
-        return outRayDist;
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        GCpuBvh.Intersect(rays[i]);
     }
-    return 255;
 }
 
-bool InsideGeometry( FLOAT3& origin, FLOAT3 rayDir, VoxelData& outCube, float& distance)
+// any-hit：只要知道dist以内有没有东西，TLAS和BLAS都在第一个命中的三角形处停下
+bool OccludedRay(vec3 origin, vec3 rayDir, float dist)
 {
-    // 求交测试
-    vec3 outNormal;
-    float outRayDist;
-    uint tempMaterialId;
-    uint tempInstanceId;
-
-    if (TraceRay(origin, rayDir, CUBE_UNIT * 64, outNormal, tempMaterialId, outRayDist, tempInstanceId))
+    if (!GCpuBvhReady)
     {
-        distance = outRayDist;
-        if( distance <= CUBE_UNIT)
-        {
-            FMaterial hitMaterial = FetchMaterial(tempMaterialId);
-            outCube.matId = tempMaterialId;
+        return false;
+    }
+    tinybvh::Ray ray(tinybvh::bvhvec3(origin.x, origin.y, origin.z), tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z), dist);
+    return GCpuBvh.IsOccluded(ray);
+}
 
-            // 命中反面，识别为固体，并将lightprobe推出体外
-            if (dot(outNormal, rayDir) > 0.0 || ((hitMaterial.gpuMaterial_.MaterialModel == Material::Enum::DiffuseLight)))// && OutRayDist < 0.02f))
-            {
-                distance = 0;
-                return true;
-            }
-        }
+// rays[i].hit.t is the length of each query
+void OccludedRayStream(const tinybvh::Ray* rays, uint32_t count, uint8_t* outOccluded)
+{
+    if (!GCpuBvhReady)
+    {
+        std::fill_n(outOccluded, count, uint8_t(0));
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        outOccluded[i] = GCpuBvh.IsOccluded(rays[i]) ? 1 : 0;
     }
-    return false;
 }
 
-void VoxelizeCube(VoxelData& cube, FLOAT3 origin)
+#define FLOAT2 vec2
+#define FLOAT3 vec3
+#define FLOAT4 vec4
+
+// only hits closer than maxDist count, a tight bound lets the traversal skip everything behind it
+float DetectDistance( FLOAT3 origin, FLOAT3 rayDir, float maxDist = CUBE_UNIT * 64)
 {
-    // just write matid and solid status
-    cube.age = 0;
-    cube.matId = 0;
-
-    float distPY = 255.0f;
-    float distNY = 255.0f;
-    float distPX = 255.0f;
-    float distNX = 255.0f;
-    float distPZ = 255.0f;
-    float distNZ = 255.0f;
-
-    // 现在是向轴向上发射了6根光线，记录下距离，并用于后续采样判断
-    InsideGeometry(origin, FLOAT3(0, 1, 0), cube, distPY);
-    InsideGeometry(origin, FLOAT3(0, -1, 0), cube, distNY);
-    InsideGeometry(origin, FLOAT3(1, 0, 0), cube, distPX);
-    InsideGeometry(origin, FLOAT3(-1, 0, 0), cube, distNX);
-    InsideGeometry(origin, FLOAT3(0, 0, 1), cube, distPZ);
-    InsideGeometry(origin, FLOAT3(0, 0, -1), cube, distNZ);
-
-    // get the min dist of each direction
-    float minDist = std::min({distPY, distNY, distPX, distNX, distPZ, distNZ});
-    if( minDist > 254.0f )
-    {
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(1, 1, 1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, 1, 1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, -1, 1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, 1, 1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(1, 1, -1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, 1, -1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, -1, -1))});
-        minDist = std::min( { minDist, DetectDistance(origin, FLOAT3(-1, 1, -1))});
+    // distance only, the hit is never resolved
+    tinybvh::Ray ray(tinybvh::bvhvec3(origin.x, origin.y, origin.z), tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z), maxDist);
+    if (GCpuBvhReady)
+    {
+        GCpuBvh.Intersect(ray);
     }
+    return ray.hit.t < maxDist ? ray.hit.t : 255.0f;
+}
 
+// +Y -Y +X -X +Z -Z, the order the distances get packed in
+static const FLOAT3 GAxisDirs[6] = { FLOAT3(0, 1, 0), FLOAT3(0, -1, 0), FLOAT3(1, 0, 0), FLOAT3(-1, 0, 0), FLOAT3(0, 0, 1), FLOAT3(0, 0, -1) };
+// 原来的列表里(-1,1,1)和(-1,1,-1)各出现了两次，去重后最小距离不变
+static const FLOAT3 GDiagonalDirs[6] = { FLOAT3(1, 1, 1), FLOAT3(-1, 1, 1), FLOAT3(-1, -1, 1), FLOAT3(1, 1, -1), FLOAT3(-1, 1, -1), FLOAT3(-1, -1, -1) };
+
+void PackVoxelDistances(VoxelData& cube, const float* axisDist, float minDist)
+{
     // 现在，相当于每一个体素，都有了一个距离场，通过判断这个，可以快速跳过？
-    distPY = glm::fclamp(distPY / CUBE_UNIT, 0.0f, 1.0f);
-    distNY = glm::fclamp(distNY / CUBE_UNIT, 0.0f, 1.0f);
-    distPX = glm::fclamp(distPX / CUBE_UNIT, 0.0f, 1.0f);
-    distNX = glm::fclamp(distNX / CUBE_UNIT, 0.0f, 1.0f);
-    distPZ = glm::fclamp(distPZ / CUBE_UNIT, 0.0f, 1.0f);
-    distNZ = glm::fclamp(distNZ / CUBE_UNIT, 0.0f, 1.0f);
+    float distPY = glm::fclamp(axisDist[0] / CUBE_UNIT, 0.0f, 1.0f);
+    float distNY = glm::fclamp(axisDist[1] / CUBE_UNIT, 0.0f, 1.0f);
+    float distPX = glm::fclamp(axisDist[2] / CUBE_UNIT, 0.0f, 1.0f);
+    float distNX = glm::fclamp(axisDist[3] / CUBE_UNIT, 0.0f, 1.0f);
+    float distPZ = glm::fclamp(axisDist[4] / CUBE_UNIT, 0.0f, 1.0f);
+    float distNZ = glm::fclamp(axisDist[5] / CUBE_UNIT, 0.0f, 1.0f);
 
     float inside = distPY * distNY * distPX * distNX * distPZ * distNZ;
 
@@ -158,380 +161,1870 @@ void VoxelizeCube(VoxelData& cube, FLOAT3 origin)
     cube.distanceToSolid_x01_y01 = PackBytes(glm::u32vec4(uint(distPX * 255.0f), uint(distNX * 255.0f), uint(distPY * 255.0f), uint(distNY * 255.0f)));
 }
 
-#undef float2
-#undef float3
-#undef float4
-
-void FCPUProbeBaker::Init(float unitSize, vec3 offset)
-{
-    UNIT_SIZE = unitSize;
-    CUBE_OFFSET = offset;
-    voxels.resize( CUBE_SIZE_XY * CUBE_SIZE_XY * CUBE_SIZE_Z );
-}
-
-void FCPUAccelerationStructure::InitBVH(Scene& scene)
+// separating axis test of a triangle against an axis aligned box (Akenine-Moller)
+static bool TriangleBoxOverlap(FLOAT3 center, FLOAT3 halfSize, FLOAT3 a, FLOAT3 b, FLOAT3 c)
 {
-    auto& hdr = GlobalTexturePool::GetInstance()->GetHDRSphericalHarmonics();
-    std::memcpy(HdrsHs, hdr.data(), hdr.size() * sizeof(SphericalHarmonics));
-    
-    const auto timer = std::chrono::high_resolution_clock::now();
+    const FLOAT3 v[3] = { a - center, b - center, c - center };
+    const FLOAT3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
 
-    bvhBLASList.clear();
-    bvhBLASContexts.clear();
-
-    bvhBLASContexts.resize(scene.Models().size());
-    for ( size_t m = 0; m < scene.Models().size(); ++m )
+    // box faces
+    if (any(greaterThan(min(min(v[0], v[1]), v[2]), halfSize)) || any(lessThan(max(max(v[0], v[1]), v[2]), -halfSize)))
     {
-        const Model& model = scene.Models()[m];
-        for (size_t i = 0; i < model.CPUIndices().size(); i += 3)
-        {
-            // Get the three vertices of the triangle
-            const Vertex& v0 = model.CPUVertices()[model.CPUIndices()[i]];
-            const Vertex& v1 = model.CPUVertices()[model.CPUIndices()[i + 1]];
-            const Vertex& v2 = model.CPUVertices()[model.CPUIndices()[i + 2]];
-            
-            // Calculate face normal
-            vec3 edge1 = vec3(v1.Position) - vec3(v0.Position);
-            vec3 edge2 = vec3(v2.Position) - vec3(v1.Position);
-            vec3 normal = normalize(cross(edge1, edge2));
-            
-            // Add triangle vertices to BVH
-            bvhBLASContexts[m].triangles.push_back(tinybvh::bvhvec4(v0.Position.x, v0.Position.y, v0.Position.z, 0));
-            bvhBLASContexts[m].triangles.push_back(tinybvh::bvhvec4(v1.Position.x, v1.Position.y, v1.Position.z, 0));
-            bvhBLASContexts[m].triangles.push_back(tinybvh::bvhvec4(v2.Position.x, v2.Position.y, v2.Position.z, 0));
+        return false;
+    }
 
-            // Store additional triangle information
-            bvhBLASContexts[m].extinfos.push_back({normal, v0.MaterialIndex});
-        }
+    // triangle plane
+    FLOAT3 normal = cross(edges[0], edges[1]);
+    if (std::abs(dot(normal, v[0])) > dot(halfSize, abs(normal)))
+    {
+        return false;
+    }
 
-        // here we can cache the blas to disk if its big enough
-        if (bvhBLASContexts[m].triangles.size() > 16384 * 3)
+    // edge x box axis
+    for (const FLOAT3& edge : edges)
+    {
+        for (int axisIdx = 0; axisIdx < 3; ++axisIdx)
         {
-            XXH64_hash_t vhash = XXH64(bvhBLASContexts[m].triangles.data(), bvhBLASContexts[m].triangles.size() * sizeof(tinybvh::bvhvec4), 0);
-            std::string cacheFileName = Utilities::CookHelper::GetCookedFileName(fmt::format("{:016x}", vhash), "cpubvh");
-
-            if (!std::filesystem::exists(cacheFileName))
+            FLOAT3 unitAxis(0.0f);
+            unitAxis[axisIdx] = 1.0f;
+            FLOAT3 axis = cross(unitAxis, edge);
+            float p0 = dot(v[0], axis);
+            float p1 = dot(v[1], axis);
+            float p2 = dot(v[2], axis);
+            float r = dot(halfSize, abs(axis));
+            if (std::min(std::min(p0, p1), p2) > r || std::max(std::max(p0, p1), p2) < -r)
             {
-                bvhBLASContexts[m].bvh.Build( bvhBLASContexts[m].triangles.data(), static_cast<int>(bvhBLASContexts[m].triangles.size()) / 3 );
-                bvhBLASContexts[m].bvh.Save(cacheFileName.c_str());
+                return false;
             }
-            else
-            {
-                bvhBLASContexts[m].bvh.Load(cacheFileName.c_str(), bvhBLASContexts[m].triangles.data(), static_cast<int>(bvhBLASContexts[m].triangles.size()) / 3 );
-            }
-        }
-        else
-        {
-            bvhBLASContexts[m].bvh.Build( bvhBLASContexts[m].triangles.data(), static_cast<int>(bvhBLASContexts[m].triangles.size()) / 3 );
         }
-
-        bvhBLASList.push_back( &bvhBLASContexts[m].bvh );
     }
-    
-    probeBaker.Init( CUBE_UNIT, CUBE_OFFSET );
-    cpuPageIndex.Init();
-
-    UpdateBVH(scene);
+    return true;
 }
 
-void FCPUAccelerationStructure::UpdateBVH(Scene& scene)
+// 三角形体素化：每个voxel取中心±unit的盒子，和盒子相交的三角形里离中心平面最近的那个决定材质，
+// 覆盖了轴向光线在CUBE_UNIT以内能打到的所有表面。只走和区域相交的BLAS节点，代价和三角形数相关而不是体素数 x 光线数
+// 中心在这个三角形背面，或者它是面光源，就算固体，和原来轴向光线CUBE_UNIT内打到反面的规则一致
+// voxelMax is exclusive, outMatIds[((z - min.z) * size.y + y - min.y) * size.x + x - min.x], 0 where nothing overlaps
+static void VoxelizeTriangles(ivec3 voxelMin, ivec3 voxelMax, FLOAT3 offset, float unit, uint32_t* outMatIds, uint8_t* outInside)
 {
-    std::vector<tinybvh::BLASInstance> tmpbvhInstanceList;
-    std::vector<FCPUTLASInstanceInfo> tmpbvhTLASContexts;
-
-    for (auto& node : scene.Nodes())
+    const ivec3 size = voxelMax - voxelMin;
+    const uint32_t count = size.x * size.y * size.z;
+    std::fill_n(outMatIds, count, 0u);
+    std::fill_n(outInside, count, uint8_t(0));
+    if (!GCpuBvhReady)
     {
-        node->RecalcTransform(true);
-
-        uint32_t modelId = node->GetModel();
-        if (modelId == -1) continue;
-        if (!node->IsVisible()) continue;
+        return;
+    }
 
-        mat4 worldTS = node->WorldTransform();
-        worldTS = transpose(worldTS);
+    thread_local std::vector<float> planeDists;
+    thread_local std::vector<uint32_t> nodeStack;
+    planeDists.assign(count, FLT_MAX);
 
-        tinybvh::BLASInstance instance;
-        instance.blasIdx = modelId;
-        std::memcpy( (float*)instance.transform, &(worldTS[0]), sizeof(float) * 16);
+    const FLOAT3 halfSize(unit);
+    const FLOAT3 boundsMin = FLOAT3(voxelMin) * unit + offset - halfSize;
+    const FLOAT3 boundsMax = FLOAT3(voxelMax - 1) * unit + offset + halfSize;
+    for (uint32_t slot = 0; slot < GbvhInstanceList->size(); ++slot)
+    {
+        const tinybvh::BLASInstance& instance = (*GbvhInstanceList)[slot];
+        if ((*GbvhTlasContexts)[slot].parked || any(greaterThan(boundsMin, FLOAT3(instance.aabbMax.x, instance.aabbMax.y, instance.aabbMax.z))) ||
+            any(lessThan(boundsMax, FLOAT3(instance.aabbMin.x, instance.aabbMin.y, instance.aabbMin.z))))
+        {
+            continue;
+        }
+        const FCPUBLASContext& context = (*GbvhBlasContexts)[instance.blasIdx];
+        if (context.triangles.empty())
+        {
+            continue;
+        }
 
-        tmpbvhInstanceList.push_back(instance);
-        FCPUTLASInstanceInfo info;
-        info.nodeId = node->GetInstanceId();
-        for ( int i = 0; i < node->Materials().size(); ++i )
+        // the region's box in the blas space, row major like ResolveHit reads it
+        const mat4& worldTS = *reinterpret_cast<const mat4*>(instance.transform);
+        const mat4& localTS = *reinterpret_cast<const mat4*>(instance.invTransform);
+        FLOAT3 localMin(FLT_MAX);
+        FLOAT3 localMax(-FLT_MAX);
+        for (int corner = 0; corner < 8; ++corner)
         {
-            uint32_t matId = node->Materials()[i];
-            FMaterial& mat = scene.Materials()[matId];
-            info.matIdxs[i] = matId;
-            
+            FLOAT3 p = FLOAT3(corner & 1 ? boundsMax.x : boundsMin.x, corner & 2 ? boundsMax.y : boundsMin.y, corner & 4 ? boundsMax.z : boundsMin.z);
+            FLOAT3 local = FLOAT3(vec4(p, 1.0f) * localTS);
+            localMin = min(localMin, local);
+            localMax = max(localMax, local);
         }
-        tmpbvhTLASContexts.push_back( info );
-    }
+        const tinybvh::bvhvec3 queryMin(localMin.x, localMin.y, localMin.z);
+        const tinybvh::bvhvec3 queryMax(localMax.x, localMax.y, localMax.z);
 
-    if (tmpbvhInstanceList.size() > 0)
-    {
-        GCpuBvh.Build( tmpbvhInstanceList.data(), static_cast<int>(tmpbvhInstanceList.size()), bvhBLASList.data(), static_cast<int>(bvhBLASList.size()) );
-    }
+        nodeStack.clear();
+        nodeStack.push_back(0);
+        while (!nodeStack.empty())
+        {
+            const tinybvh::BVH::BVHNode& node = context.bvh.bvhNode[nodeStack.back()];
+            nodeStack.pop_back();
+            if (!node.Intersect(queryMin, queryMax))
+            {
+                continue;
+            }
+            if (!node.isLeaf())
+            {
+                nodeStack.push_back(node.leftFirst);
+                nodeStack.push_back(node.leftFirst + 1);
+                continue;
+            }
 
-    TaskCoordinator::GetInstance()->WaitForAllParralledTask();
+            for (uint32_t k = node.leftFirst; k < node.leftFirst + node.triCount; ++k)
+            {
+                const uint32_t primIdx = context.bvh.primIdx[k];
+                FLOAT3 v[3];
+                for (int j = 0; j < 3; ++j)
+                {
+                    const tinybvh::bvhvec4& vert = context.triangles[primIdx * 3 + j];
+                    v[j] = FLOAT3(vec4(vert.x, vert.y, vert.z, 1.0f) * worldTS);
+                }
 
-    bvhInstanceList.swap(tmpbvhInstanceList);
-    bvhTLASContexts.swap(tmpbvhTLASContexts);
-    
-    // rebind with new address
-    GbvhInstanceList = &bvhInstanceList;
-    GbvhTlasContexts = &bvhTLASContexts;
-    GbvhBlasContexts = &bvhBLASContexts;
+                // voxels whose box can touch the triangle's bounds
+                ivec3 first = max(ivec3(ceil((min(min(v[0], v[1]), v[2]) - halfSize - offset) / unit)), voxelMin);
+                ivec3 last = min(ivec3(floor((max(max(v[0], v[1]), v[2]) + halfSize - offset) / unit)), voxelMax - 1);
+                if (any(greaterThan(first, last)))
+                {
+                    continue;
+                }
+
+                // the shading normal like ResolveHit reports it, its side decides inside
+                FLOAT3 normal = FLOAT3(vec4(context.extinfos[primIdx].normal, 0.0f) * worldTS);
+                float normalLength = length(normal);
+                normal = normalLength > 0.0f ? normal / normalLength : FLOAT3(0.0f);
+                uint32_t materialId = UINT32_MAX;
+                bool emissive = false;
+                for (int z = first.z; z <= last.z; ++z)
+                    for (int y = first.y; y <= last.y; ++y)
+                        for (int x = first.x; x <= last.x; ++x)
+                        {
+                            FLOAT3 center = FLOAT3(x, y, z) * unit + offset;
+                            uint32_t idx = ((z - voxelMin.z) * size.y + y - voxelMin.y) * size.x + x - voxelMin.x;
+                            float signedDist = dot(normal, center - v[0]);
+                            float planeDist = std::abs(signedDist);
+                            if (planeDist >= planeDists[idx] || !TriangleBoxOverlap(center, halfSize, v[0], v[1], v[2]))
+                            {
+                                continue;
+                            }
+                            if (materialId == UINT32_MAX)
+                            {
+                                materialId = FetchMaterialId(context.extinfos[primIdx].matIdx, slot);
+                                emissive = FetchMaterial(materialId).gpuMaterial_.MaterialModel == Material::Enum::DiffuseLight;
+                            }
+                            planeDists[idx] = planeDist;
+                            outMatIds[idx] = materialId;
+                            outInside[idx] = signedDist < 0.0f || emissive;
+                        }
+            }
+        }
+    }
 }
 
-RayCastResult FCPUAccelerationStructure::RayCastInCPU(vec3 rayOrigin, vec3 rayDir)
+// single voxel version of ProcessGroup: the voxelizer classifies it, rays only measure the distances of a voxel outside geometry
+void VoxelizeCube(VoxelData& cube, ivec3 voxel, FLOAT3 offset, float unit)
 {
-    RayCastResult result {};
+    cube.age = 0;
+    uint8_t inside = 0;
+    VoxelizeTriangles(voxel, voxel + 1, offset, unit, &cube.matId, &inside);
 
-    if (GCpuBvh.blasCount > 0)
+    // 体内的voxel不发射光线，距离全是0
+    float axisDist[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    float minDist = 0.0f;
+    if (!inside)
     {
-        tinybvh::Ray ray(tinybvh::bvhvec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z), 2000.0f);
-        GCpuBvh.Intersect(ray);
-    
-        if (ray.hit.t < 2000.f)
+        const FLOAT3 origin = FLOAT3(voxel) * unit + offset;
+        for (int d = 0; d < 6; ++d)
         {
-            vec3 hitPos = rayOrigin + rayDir * ray.hit.t;
-            uint32_t primIdx = ray.hit.prim;
-            tinybvh::BLASInstance& instance = (*GbvhInstanceList)[ray.hit.inst];
-            FCPUTLASInstanceInfo& instContext = (*GbvhTlasContexts)[ray.hit.inst];
-            FCPUBLASContext& context = (*GbvhBlasContexts)[instance.blasIdx];
-            mat4* worldTS = (mat4*)instance.transform;
-            vec4 normalWS = vec4( context.extinfos[primIdx].normal, 0.0f) * *worldTS;
-            result.HitPoint = vec4(hitPos, 0);
-            result.Normal = normalWS;
-            result.Hitted = true;
-            result.T = ray.hit.t;
-            result.InstanceId = instContext.nodeId;
+            axisDist[d] = DetectDistance(origin, GAxisDirs[d]);
+        }
+
+        minDist = *std::min_element(axisDist, axisDist + 6);
+        if( minDist > 254.0f )
+        {
+            // a diagonal only matters when it is closer than the best one so far
+            for (const FLOAT3& dir : GDiagonalDirs)
+            {
+                minDist = std::min(minDist, DetectDistance(origin, dir, std::min(minDist, CUBE_UNIT * 64)));
+            }
         }
     }
 
-    return result;
+    PackVoxelDistances(cube, axisDist, minDist);
 }
 
-void FCPUProbeBaker::ProcessCube(int x, int y, int z, ECubeProcType procType)
+#undef float2
+#undef float3
+#undef float4
+
+const char* GetCPUBVHLayoutName(ECPUBVHLayout layout)
 {
-    auto& ubo = NextEngine::GetInstance()->GetUniformBufferObject();
-    vec3 probePos = vec3(x, y, z) * UNIT_SIZE + CUBE_OFFSET;
-    uint32_t addressIdx = y * CUBE_SIZE_XY * CUBE_SIZE_XY + z * CUBE_SIZE_XY + x;
-    VoxelData& voxel = voxels[addressIdx];
-        
-    switch (procType)
+    switch (layout)
     {
-        case ECubeProcType::ECPT_Clear:
-        case ECubeProcType::ECPT_Fence:
-            break;
-        case ECubeProcType::ECPT_Voxelize:
-            VoxelizeCube(voxel, probePos);
-            break;
+    case ECPUBVHLayout::ECBL_Binary: return "binary";
+    case ECPUBVHLayout::ECBL_SoA: return "soa";
+    case ECPUBVHLayout::ECBL_Wide4: return "wide4";
+    default: return "unknown";
     }
 }
 
-void FCPUProbeBaker::UploadGPU(Vulkan::DeviceMemory& voxelGpuMemory)
+// cached blas file: header, then bvh nodes and primitive indices exactly as tinybvh keeps them in memory,
+// so a mapped file is traversed in place. the nodes start 64 bytes in, the mapping itself is page aligned
+static constexpr uint32_t GCpuBvhCacheMagic = 0x48564247; // "GBVH"
+// bump when the file layout changes
+static constexpr uint32_t GCpuBvhCacheFormat = 1;
+// bump when the builder or its settings change, BVH::Build is the binned sah reference builder
+static constexpr uint32_t GCpuBvhCacheBuilder = 1;
+static constexpr uint32_t GCpuBvhCacheTinyBvh = TINY_BVH_VERSION_SUB + (TINY_BVH_VERSION_MINOR << 8) + (TINY_BVH_VERSION_MAJOR << 16);
+
+struct FCPUBVHCacheHeader
 {
-    VoxelData* data = reinterpret_cast<VoxelData*>(voxelGpuMemory.Map(0, sizeof(VoxelData) * voxels.size()));
-    std::memcpy(data, voxels.data(), voxels.size() * sizeof(VoxelData));
-    voxelGpuMemory.Unmap();
+    uint32_t magic;
+    uint32_t format;
+    uint32_t tinybvhVersion;
+    uint32_t builder;
+    uint64_t geometryHash;
+    uint32_t nodeSize;
+    uint32_t triCount;
+    uint32_t usedNodes;
+    uint32_t idxCount;
+    uint32_t padding[6];
+};
+static_assert(sizeof(FCPUBVHCacheHeader) == 64, "cached nodes must stay 64 byte aligned");
+
+static bool SaveCachedBLAS(const tinybvh::BVH& bvh, const std::string& fileName, uint64_t geometryHash)
+{
+    std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    FCPUBVHCacheHeader header {};
+    header.magic = GCpuBvhCacheMagic;
+    header.format = GCpuBvhCacheFormat;
+    header.tinybvhVersion = GCpuBvhCacheTinyBvh;
+    header.builder = GCpuBvhCacheBuilder;
+    header.geometryHash = geometryHash;
+    header.nodeSize = sizeof(tinybvh::BVH::BVHNode);
+    header.triCount = bvh.triCount;
+    header.usedNodes = bvh.usedNodes;
+    header.idxCount = bvh.idxCount;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(bvh.bvhNode), sizeof(tinybvh::BVH::BVHNode) * bvh.usedNodes);
+    file.write(reinterpret_cast<const char*>(bvh.primIdx), sizeof(uint32_t) * bvh.idxCount);
+    return file.good();
 }
 
-bool FCPUAccelerationStructure::AsyncProcessFull(Assets::Scene& scene, Vulkan::DeviceMemory* voxelGpuMemory, bool incremental)
+// maps the cache and points context.bvh into it. a cache that does not match the geometry or could send
+// traversal out of bounds is rejected and gets rebuilt
+static bool MapCachedBLAS(FCPUBLASContext& context, const std::string& fileName, uint64_t geometryHash)
 {
-    if ( !TaskCoordinator::GetInstance()->IsAllParralledTaskComplete() )
+    auto cacheFile = std::make_shared<Utilities::FileHelper::FMappedFile>();
+    if (!cacheFile->Open(fileName) || cacheFile->Size() < sizeof(FCPUBVHCacheHeader))
     {
         return false;
     }
-    // clean
-    while (!needUpdateGroups.empty())
-        needUpdateGroups.pop();
-    lastBatchTasks.clear();
 
-    if (!incremental)
+    FCPUBVHCacheHeader header;
+    std::memcpy(&header, cacheFile->Data(), sizeof(header));
+    const uint32_t triCount = static_cast<uint32_t>(context.extinfos.size());
+    if (header.magic != GCpuBvhCacheMagic || header.format != GCpuBvhCacheFormat || header.tinybvhVersion != GCpuBvhCacheTinyBvh ||
+        header.builder != GCpuBvhCacheBuilder || header.geometryHash != geometryHash || header.nodeSize != sizeof(tinybvh::BVH::BVHNode) ||
+        header.triCount != triCount || header.usedNodes == 0 || header.idxCount < triCount)
     {
-        probeBaker.ClearAmbientCubes();
-        probeBaker.UploadGPU(*voxelGpuMemory);
+        return false;
     }
-    else
+    const uint64_t nodeBytes = uint64_t(header.usedNodes) * sizeof(tinybvh::BVH::BVHNode);
+    if (cacheFile->Size() != sizeof(FCPUBVHCacheHeader) + nodeBytes + uint64_t(header.idxCount) * sizeof(uint32_t))
     {
-        UpdateBVH(scene);
+        SPDLOG_WARN("cpu bvh cache {} is truncated, rebuilding", fileName);
+        return false;
     }
-    
-    const int groupSize = 16;
-    const int lengthX = CUBE_SIZE_XY / groupSize;
-    const int lengthZ = CUBE_SIZE_XY / groupSize;
 
-    // far probe gen
-    // for (int x = 0; x < lengthX; x++)
-    //     for (int z = 0; z < lengthZ; z++)
-    //         needUpdateGroups.push({ivec3(x, 0, z), ECubeProcType::ECPT_Voxelize, EBakerType::EBT_FarProbe});
-    
-    // 2 pass near probe iterate
-    for(int pass = 0; pass < 1; ++pass)
+    auto* nodes = reinterpret_cast<tinybvh::BVH::BVHNode*>(cacheFile->Data() + sizeof(FCPUBVHCacheHeader));
+    auto* primIdx = reinterpret_cast<uint32_t*>(cacheFile->Data() + sizeof(FCPUBVHCacheHeader) + nodeBytes);
+    // node 1 is padding, children always come after their parent
+    for (uint32_t i = 0; i < header.usedNodes; ++i)
     {
-        // shuffle
-        std::vector<std::pair<int, int>> coordinates;
-        for (int x = 0; x < lengthX; x++)
-            for (int z = 0; z < lengthZ; z++)
-                coordinates.push_back({x, z});
-        
-        std::random_device rd;
-        std::mt19937 g(rd());
-        std::shuffle(coordinates.begin(), coordinates.end(), g);
-
-        // dispatch
-        for (const auto& [x, z] : coordinates)
-            needUpdateGroups.push({ivec3(x, 0, z), ECubeProcType::ECPT_Voxelize, EBakerType::EBT_Probe});
-        // add fence
-        needUpdateGroups.push({ivec3(0), ECubeProcType::ECPT_Fence, EBakerType::EBT_Probe});
+        if (i == 1)
+        {
+            continue;
+        }
+        const tinybvh::BVH::BVHNode& node = nodes[i];
+        const bool valid = node.isLeaf()
+            ? uint64_t(node.leftFirst) + node.triCount <= header.idxCount
+            : node.leftFirst > i && uint64_t(node.leftFirst) + 1 < header.usedNodes;
+        if (!valid)
+        {
+            SPDLOG_WARN("cpu bvh cache {} is corrupt, rebuilding", fileName);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header.idxCount; ++i)
+    {
+        if (primIdx[i] >= triCount)
+        {
+            SPDLOG_WARN("cpu bvh cache {} is corrupt, rebuilding", fileName);
+            return false;
+        }
     }
 
+    tinybvh::BVH& bvh = context.bvh;
+    bvh.verts = tinybvh::bvhvec4slice{ context.triangles.data(), triCount * 3, sizeof(tinybvh::bvhvec4) };
+    bvh.bvhNode = nodes;
+    bvh.primIdx = primIdx;
+    bvh.allocatedNodes = header.usedNodes;
+    bvh.usedNodes = header.usedNodes;
+    bvh.triCount = header.triCount;
+    bvh.idxCount = header.idxCount;
+    bvh.aabbMin = nodes[0].aabbMin;
+    bvh.aabbMax = nodes[0].aabbMax;
+    // the nodes are not ours, tinybvh must not rebuild into them
+    bvh.rebuildable = false;
+    context.cacheFile = std::move(cacheFile);
     return true;
 }
 
-void FCPUAccelerationStructure::AsyncProcessGroup(int xInMeter, int zInMeter, Scene& scene, ECubeProcType procType, EBakerType bakerType)
+FCPUBLASContext::~FCPUBLASContext()
 {
-    if (bvhInstanceList.empty())
+    // mapped memory goes away with cacheFile, keep ~BVH from freeing it
+    if (cacheFile)
     {
-        return;
+        bvh.bvhNode = nullptr;
+        bvh.primIdx = nullptr;
     }
-    
-    int groupSize = 16; // 4 x 4 x 40 a group
-    
-    int actualX = xInMeter * groupSize;
-    int actualZ = zInMeter * groupSize;
+}
 
-    std::vector<vec3> lightPos;
-    std::vector<vec3> sunDir;
-    for( auto& light : scene.Lights() )
+tinybvh::BVHBase* FCPUBLASContext::GetTraversalBVH(ECPUBVHLayout layout)
+{
+    // conversion of an empty bvh is not supported by tinybvh
+    if (bvh.triCount == 0)
     {
-        lightPos.push_back(mix(light.p1, light.p3, 0.5f));
+        return &bvh;
     }
 
-    if (scene.HasSun())
+    const uint32_t layoutBit = 1u << static_cast<uint32_t>(layout);
+    const bool converted = (convertedLayouts & layoutBit) != 0;
+    convertedLayouts |= layoutBit;
+    switch (layout)
     {
-        sunDir.push_back( scene.GetSunDir() );
+    case ECPUBVHLayout::ECBL_SoA:
+        if (!converted)
+        {
+            bvhSoA.ConvertFrom(bvh);
+        }
+        return &bvhSoA;
+    case ECPUBVHLayout::ECBL_Wide4:
+        if (!converted)
+        {
+            // the intermediate 4-wide tree lives inside bvh4, so bvh4 owns it
+            bvh4.bvh4.ConvertFrom(bvh);
+            bvh4.ConvertFrom(bvh4.bvh4);
+        }
+        return &bvh4;
+    default:
+        return &bvh;
     }
+}
 
-    uint32_t taskId = TaskCoordinator::GetInstance()->AddParralledTask(
-                [this, actualX, actualZ, groupSize, procType](ResTask& task)
-            {
-                for (int z = actualZ; z < actualZ + groupSize; z++)
-                    for (int y = 0; y < CUBE_SIZE_Z; y++)
-                        for (int x = actualX; x < actualX + groupSize; x++)
-                        {
-                            probeBaker.ProcessCube(x, y, z, procType);
-                        }
-            },
-            [this](ResTask& task)
-            {
-                // flush here
-                //bakerType == EBakerType::EBT_Probe ? probeBaker.UploadGPU(*GPUMemory) : farProbeBaker.UploadGPU(*FarGPUMemory);
-                needFlush = true;
-            });
+// probe grid origin in voxels from the page grid origin, a multiple of the brick size so bricks never straddle pages
+static const ivec2 GCubeToPageVoxels = ivec2((vec2(CUBE_OFFSET.x, CUBE_OFFSET.z) - vec2(ACGI_PAGE_OFFSET.x, ACGI_PAGE_OFFSET.z)) / CUBE_UNIT);
 
-    lastBatchTasks.push_back(taskId);
+// page of a grid brick and its xz inside the page's brick table, same math as FetchBrick in AmbientCube.slang
+static uint32_t GetBrickPage(int bx, int bz, ivec2& outLocal)
+{
+    const int pageVoxels = ACGI_PAGE_BRICKS_XZ * CUBE_BRICK_SIZE;
+    ivec2 pageVoxel = ivec2(bx, bz) * CUBE_BRICK_SIZE + GCubeToPageVoxels;
+    ivec2 page = pageVoxel / pageVoxels;
+    outLocal = (pageVoxel - page * pageVoxels) / CUBE_BRICK_SIZE;
+    return static_cast<uint32_t>(page.y * ACGI_PAGE_COUNT + page.x);
 }
 
-void FCPUAccelerationStructure::Tick(Scene& scene, Vulkan::DeviceMemory* gpuMemory, Vulkan::DeviceMemory* voxelGpuMemory, Vulkan::DeviceMemory* pageIndexMemory)
+template<size_t N>
+static std::vector<uint64_t> TakeDirtyBits(std::array<std::atomic<uint64_t>, N>& words)
 {
-    if (needFlush)
+    std::vector<uint64_t> bits(N);
+    for (size_t i = 0; i < N; ++i)
     {
-        // Upload to GPU, now entire range, optimize to partial upload later
-        probeBaker.UploadGPU(*voxelGpuMemory);
-        cpuPageIndex.UpdateData(probeBaker);
-        cpuPageIndex.UploadGPU(*pageIndexMemory);
-        needFlush = false;
+        bits[i] = words[i].exchange(0, std::memory_order_acquire);
     }
+    return bits;
+}
 
-    if (!lastBatchTasks.empty())
+// every run of set bits as (first, count)
+static void ForEachDirtyRun(const std::vector<uint64_t>& bits, const std::function<void(uint32_t, uint32_t)>& func)
+{
+    const uint32_t bitCount = static_cast<uint32_t>(bits.size() * 64);
+    auto isSet = [&bits](uint32_t i) { return (bits[i / 64] >> (i % 64)) & 1; };
+    uint32_t i = 0;
+    while (i < bitCount)
     {
-        if (TaskCoordinator::GetInstance()->IsAllTaskComplete(lastBatchTasks))
+        if (i % 64 == 0 && bits[i / 64] == 0)
         {
-            lastBatchTasks.clear();
+            i += 64;
+            continue;
         }
-    }
-    else
-    {
-        while (!needUpdateGroups.empty())
+        if (!isSet(i))
         {
-            auto& group = needUpdateGroups.front();
-            ECubeProcType type = std::get<1>(group);
-            if (type == ECubeProcType::ECPT_Fence)
-            {
-                if (!TaskCoordinator::GetInstance()->IsAllTaskComplete(lastBatchTasks))
-                {
-                    break; 
-                }
-                needUpdateGroups.pop();
-                continue;
-            }
-            AsyncProcessGroup(std::get<0>(group).x, std::get<0>(group).z, scene, std::get<1>(group), std::get<2>(group));
-            needUpdateGroups.pop();
+            ++i;
+            continue;
         }
+        uint32_t first = i;
+        while (i < bitCount && isSet(i))
+        {
+            ++i;
+        }
+        func(first, i - first);
+    }
+}
+
+static uint32_t BrickLocalIdx(int x, int y, int z)
+{
+    return ((y % CUBE_BRICK_SIZE) * CUBE_BRICK_SIZE + z % CUBE_BRICK_SIZE) * CUBE_BRICK_SIZE + x % CUBE_BRICK_SIZE;
+}
+
+void FCPUProbeBaker::Init(float unitSize, vec3 offset, const FCPUPageIndex& pageIndex)
+{
+    UNIT_SIZE = unitSize;
+    CUBE_OFFSET = offset;
+
+    brickExt.resize(CUBE_BRICK_CAPACITY + CUBE_BRICK_TABLE_PAGES * CUBE_BRICK_TABLE_SIZE);
+    brickTableIdx.resize(CUBE_BRICKS_XY * CUBE_BRICKS_XY * CUBE_BRICKS_Z);
+    brickSolidCounts.resize(brickTableIdx.size());
+    voxelSolid.resize(CUBE_SDF_BYTES);
+    ivec2 local;
+    for (int by = 0; by < CUBE_BRICKS_Z; by++)
+        for (int bz = 0; bz < CUBE_BRICKS_XY; bz++)
+            for (int bx = 0; bx < CUBE_BRICKS_XY; bx++)
+            {
+                uint32_t tableOffset = pageIndex.pageIndex[GetBrickPage(bx, bz, local)].voxelDataIdx;
+                brickTableIdx[(by * CUBE_BRICKS_XY + bz) * CUBE_BRICKS_XY + bx] = tableOffset + (by * ACGI_PAGE_BRICKS_XZ + local.y) * ACGI_PAGE_BRICKS_XZ + local.x;
+            }
+
+    ClearAmbientCubes();
+}
+
+void FCPUProbeBaker::LoadBrick(int bx, int by, int bz, VoxelData* outVoxels)
+{
+    uint32_t entry = BrickEntry(bx, by, bz);
+    if ((entry & CUBE_BRICK_EMPTY) == 0)
+    {
+        std::memcpy(outVoxels, BrickVoxels(entry), sizeof(VoxelData) * CUBE_BRICK_VOXELS);
+        return;
+    }
+
+    // same as FetchVoxelV2, distance 0 is a cleared brick that reads as zeroed voxels
+    VoxelData air{};
+    if ((entry & 0xFF) != 0)
+    {
+        air.distanceToSolid_gg_z01 = (entry & 0xFF) | 0xFFFFFF00;
+        air.distanceToSolid_x01_y01 = 0xFFFFFFFF;
+    }
+    std::fill_n(outVoxels, CUBE_BRICK_VOXELS, air);
+}
+
+void FCPUProbeBaker::StoreBrick(int bx, int by, int bz, const VoxelData* voxels)
+{
+    uint32_t minDist = 0xFF;
+    uint32_t solidCount = 0;
+    bool air = true;
+    for (int i = 0; i < CUBE_BRICK_VOXELS; ++i)
+    {
+        const VoxelData& voxel = voxels[i];
+        uint32_t dist = voxel.distanceToSolid_gg_z01 & 0xFF;
+        minDist = std::min(minDist, dist);
+        solidCount += voxel.matId != 0;
+        // gpu probe gen lights voxels closer than 8, those need a real slot. the rest must match the synthesized air voxel
+        air = air && voxel.matId == 0 && dist >= 8 && (voxel.distanceToSolid_gg_z01 >> 8) == 0xFFFFFF && voxel.distanceToSolid_x01_y01 == 0xFFFFFFFF;
+    }
+
+    uint32_t& entry = BrickEntry(bx, by, bz);
+    if (air)
+    {
+        if ((entry & CUBE_BRICK_EMPTY) == 0)
+        {
+            FreeBrickSlot(entry);
+        }
+        if (entry != (CUBE_BRICK_EMPTY | minDist))
+        {
+            entry = CUBE_BRICK_EMPTY | minDist;
+            MarkExtDirty(BrickEntryIdx(bx, by, bz));
+        }
+        SetBrickSolidCount(bx, by, bz, 0);
+        SetBrickOccupancy(bx, by, bz, nullptr);
+        return;
+    }
+
+    if ((entry & CUBE_BRICK_EMPTY) != 0)
+    {
+        uint32_t slot = AllocBrickSlot(bx, by, bz);
+        if (slot == CUBE_BRICK_FREE)
+        {
+            // pool is full, the brick loses its detail but lookups stay valid
+            brickOverflow.fetch_add(1, std::memory_order_relaxed);
+            entry = CUBE_BRICK_EMPTY | minDist;
+            MarkExtDirty(BrickEntryIdx(bx, by, bz));
+            SetBrickSolidCount(bx, by, bz, 0);
+            SetBrickOccupancy(bx, by, bz, nullptr);
+            return;
+        }
+        entry = slot;
+        MarkExtDirty(BrickEntryIdx(bx, by, bz));
+    }
+    std::memcpy(BrickVoxels(entry), voxels, sizeof(VoxelData) * CUBE_BRICK_VOXELS);
+    dirtySlots[entry / 64].fetch_or(1ull << (entry % 64), std::memory_order_release);
+    SetBrickSolidCount(bx, by, bz, solidCount);
+    SetBrickOccupancy(bx, by, bz, voxels);
+}
+
+void FCPUProbeBaker::SetBrickSolidCount(int bx, int by, int bz, uint32_t solidCount)
+{
+    // a brick belongs to one group, only the page total is shared between workers
+    uint8_t& stored = brickSolidCounts[(by * CUBE_BRICKS_XY + bz) * CUBE_BRICKS_XY + bx];
+    if (stored != solidCount)
+    {
+        ivec2 local;
+        pageSolidCounts[GetBrickPage(bx, bz, local)].fetch_add(solidCount - stored, std::memory_order_relaxed);
+        stored = static_cast<uint8_t>(solidCount);
+    }
+}
+
+void FCPUProbeBaker::SetBrickOccupancy(int bx, int by, int bz, const VoxelData* voxels)
+{
+    bool changed = false;
+    for (int ly = 0; ly < CUBE_BRICK_SIZE; ++ly)
+        for (int lz = 0; lz < CUBE_BRICK_SIZE; ++lz)
+            for (int lx = 0; lx < CUBE_BRICK_SIZE; ++lx)
+            {
+                int x = bx * CUBE_BRICK_SIZE + lx;
+                int y = by * CUBE_BRICK_SIZE + ly;
+                int z = bz * CUBE_BRICK_SIZE + lz;
+                uint8_t solid = voxels != nullptr && voxels[BrickLocalIdx(x, y, z)].matId != 0;
+                uint8_t& stored = voxelSolid[(y * CUBE_SIZE_XY + z) * CUBE_SIZE_XY + x];
+                changed = changed || stored != solid;
+                stored = solid;
+            }
+
+    if (changed)
+    {
+        uint32_t group = (bz * CUBE_BRICK_SIZE / CUBE_SDF_GROUP_SIZE) * CUBE_SDF_GROUPS + bx * CUBE_BRICK_SIZE / CUBE_SDF_GROUP_SIZE;
+        solidDirtyGroups[group / 64].fetch_or(1ull << (group % 64), std::memory_order_release);
+    }
+}
+
+uint32_t FCPUProbeBaker::AllocBrickSlot(int bx, int by, int bz)
+{
+    std::lock_guard<std::mutex> lock(brickMutex);
+    if (freeBrickSlots.empty())
+    {
+        return CUBE_BRICK_FREE;
+    }
+
+    uint32_t slot = freeBrickSlots.back();
+    freeBrickSlots.pop_back();
+    std::unique_ptr<VoxelData[]>& chunk = brickChunks[slot / BrickChunkSlots];
+    if (!chunk)
+    {
+        chunk = std::make_unique<VoxelData[]>(BrickChunkSlots * CUBE_BRICK_VOXELS);
+    }
+    // read back by GetPoolProbePos in AmbientCube.slang
+    brickExt[slot] = uint32_t(bx) | (uint32_t(bz) << 10) | (uint32_t(by) << 20);
+    MarkExtDirty(slot);
+    return slot;
+}
+
+void FCPUProbeBaker::FreeBrickSlot(uint32_t slot)
+{
+    std::lock_guard<std::mutex> lock(brickMutex);
+    brickExt[slot] = CUBE_BRICK_FREE;
+    MarkExtDirty(slot);
+    freeBrickSlots.push_back(slot);
+}
+
+void FCPUProbeBaker::MarkExtDirty(uint32_t extIdx)
+{
+    const uint32_t block = extIdx / DirtyExtBlock;
+    dirtyExtBlocks[block / 64].fetch_or(1ull << (block % 64), std::memory_order_release);
+}
+
+bool FCPUAccelerationStructure::BuildBLAS(FCPUBLASContext& context, const Model& model, uint32_t modelIdx)
+{
+    const auto& indices = model.CPUIndices();
+    const auto& vertices = model.CPUVertices();
+    const size_t triangleCount = indices.size() / 3;
+
+    context.triangles.resize(triangleCount * 3);
+    context.extinfos.resize(triangleCount);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        // Get the three vertices of the triangle
+        const Vertex& v0 = vertices[indices[t * 3]];
+        const Vertex& v1 = vertices[indices[t * 3 + 1]];
+        const Vertex& v2 = vertices[indices[t * 3 + 2]];
+        
+        // Calculate face normal
+        vec3 edge1 = vec3(v1.Position) - vec3(v0.Position);
+        vec3 edge2 = vec3(v2.Position) - vec3(v1.Position);
+        vec3 normal = normalize(cross(edge1, edge2));
+        
+        // Add triangle vertices to BVH
+        context.triangles[t * 3] = tinybvh::bvhvec4(v0.Position.x, v0.Position.y, v0.Position.z, 0);
+        context.triangles[t * 3 + 1] = tinybvh::bvhvec4(v1.Position.x, v1.Position.y, v1.Position.z, 0);
+        context.triangles[t * 3 + 2] = tinybvh::bvhvec4(v2.Position.x, v2.Position.y, v2.Position.z, 0);
+
+        // Store additional triangle information
+        context.extinfos[t] = {normal, v0.MaterialIndex};
+    }
+
+    if (triangleCount == 0)
+    {
+        context.bvh.Build( context.triangles.data(), 0 );
+        return false;
+    }
+
+    // every blas is cached, the key covers the geometry, the builder and the file layout
+    XXH64_hash_t vhash = XXH64(context.triangles.data(), context.triangles.size() * sizeof(tinybvh::bvhvec4), 0);
+    std::string cacheFileName = Utilities::CookHelper::GetCookedFileName(fmt::format("{:016x}_b{}_f{}", vhash, GCpuBvhCacheBuilder, GCpuBvhCacheFormat), "cpubvh");
+
+    if (MapCachedBLAS(context, cacheFileName, vhash))
+    {
+        return true;
+    }
+
+    context.bvh.Build( context.triangles.data(), static_cast<uint32_t>(triangleCount) );
+    // models with identical geometry build in parallel and share the cache file, each writes its own
+    // temp file and moves it over, readers never see a half written cache
+    std::string tempFileName = fmt::format("{}.{}.tmp", cacheFileName, modelIdx);
+    std::error_code ec;
+    if (SaveCachedBLAS(context.bvh, tempFileName, vhash))
+    {
+        std::filesystem::rename(tempFileName, cacheFileName, ec);
+    }
+    if (ec || std::filesystem::exists(tempFileName))
+    {
+        std::filesystem::remove(tempFileName, ec);
+    }
+    return false;
+}
+
+void FCPUAccelerationStructure::InitBVH(Scene& scene)
+{
+    auto& hdr = GlobalTexturePool::GetInstance()->GetHDRSphericalHarmonics();
+    std::memcpy(HdrsHs, hdr.data(), hdr.size() * sizeof(SphericalHarmonics));
+    
+    const auto timer = std::chrono::high_resolution_clock::now();
+
+    {
+        // nothing may traverse the old BLASes while they are destroyed, the gate opens again even if a build throws
+        FCPUTraversalGate::Closed closed(traversalGate);
+
+        // every instance gets added again and the TLAS is built from scratch
+        bvhInstanceList.clear();
+        bvhTLASContexts.clear();
+        instanceSlots.clear();
+        freeInstanceSlots.clear();
+        tlasBuildCost = 0.0f;
+        GCpuBvhReady = false;
+
+        bvhBLASList.clear();
+        bvhBLASContexts.clear();
+        if (GOption != nullptr)
+        {
+            bvhLayout = static_cast<ECPUBVHLayout>(std::min(GOption->CpuBvhLayout, static_cast<uint32_t>(ECPUBVHLayout::ECBL_Count) - 1));
+        }
+
+        const uint32_t modelCount = static_cast<uint32_t>(scene.Models().size());
+        bvhBLASContexts.resize(modelCount);
+        bvhBLASList.resize(modelCount);
+
+        // big meshes first, so the last chunk picked up by a worker is a small one and the pool drains evenly
+        std::vector<uint32_t> buildOrder(modelCount);
+        std::iota(buildOrder.begin(), buildOrder.end(), 0);
+        std::stable_sort(buildOrder.begin(), buildOrder.end(), [&scene](uint32_t a, uint32_t b)
+        {
+            return scene.Models()[a].CPUIndices().size() > scene.Models()[b].CPUIndices().size();
+        });
+
+        // every model writes only its own context and list entry, the vectors are sized up front and do not move
+        std::atomic<uint32_t> cachedCount{0};
+        TaskCoordinator::GetInstance()->ParallelFor(0, modelCount, 1, [this, &scene, &buildOrder, &cachedCount](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                const uint32_t m = buildOrder[i];
+                if (BuildBLAS(bvhBLASContexts[m], scene.Models()[m], m))
+                {
+                    cachedCount.fetch_add(1, std::memory_order_relaxed);
+                }
+                bvhBLASList[m] = bvhBLASContexts[m].GetTraversalBVH(bvhLayout);
+            }
+        });
+
+        SPDLOG_INFO("cpu blas build: {} models ({} from cache) in {:.2f}ms", modelCount, cachedCount.load(), std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - timer).count());
+    
+        // the baker's brick tables live in the pages, place them first
+        cpuPageIndex.Init();
+        probeBaker.Init( CUBE_UNIT, CUBE_OFFSET, cpuPageIndex );
+        distanceField.Init();
+
+        UpdateInstances(scene);
+    }
+    // a new scene always gets a full bake, nothing to re-bake incrementally yet
+    dirtyGroups.fill(0);
+    dirtyGroupCount = 0;
+
+    if (GOption != nullptr && GOption->BenchCpuBvh)
+    {
+        BenchmarkBVHLayouts(scene);
+    }
+}
+
+void FCPUAccelerationStructure::SetBVHLayout(Scene& scene, ECPUBVHLayout layout)
+{
+    // running bake tasks still traverse the old BLAS list
+    FCPUTraversalGate::Closed closed(traversalGate);
+
+    bvhLayout = layout;
+    TaskCoordinator::GetInstance()->ParallelFor(0, static_cast<uint32_t>(bvhBLASContexts.size()), 1, [this, layout](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t m = begin; m < end; ++m)
+        {
+            bvhBLASList[m] = bvhBLASContexts[m].GetTraversalBVH(layout);
+        }
+    });
+
+    // the TLAS looks BLASes up through bvhBLASList at traversal time and their bounds did not change, no rebuild needed
+}
+
+void FCPUAccelerationStructure::BenchmarkBVHLayouts(Scene& scene)
+{
+    if (bvhInstanceList.empty())
+    {
+        return;
+    }
+
+    // bake rays: the axis streams ProcessGroup traces, over a few groups around the grid center
+    std::vector<tinybvh::Ray> bakeRays;
+    const int groupSize = 16;
+    for (int group = 0; group < 4; ++group)
+    {
+        const int x0 = (CUBE_SIZE_XY / 2 - groupSize) + (group & 1) * groupSize;
+        const int z0 = (CUBE_SIZE_XY / 2 - groupSize) + (group >> 1) * groupSize;
+        for (const vec3& dir : GAxisDirs)
+            for (int z = z0; z < z0 + groupSize; z++)
+                for (int y = 0; y < CUBE_SIZE_Z; y++)
+                    for (int x = x0; x < x0 + groupSize; x++)
+                    {
+                        vec3 origin = vec3(x, y, z) * CUBE_UNIT + CUBE_OFFSET;
+                        bakeRays.emplace_back(tinybvh::bvhvec3(origin.x, origin.y, origin.z), tinybvh::bvhvec3(dir.x, dir.y, dir.z), CUBE_UNIT * 64);
+                    }
+    }
+
+    // random rays: incoherent origins and directions inside the scene bounds, like picking and shadow rays
+    std::vector<tinybvh::Ray> randomRays;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const tinybvh::bvhvec3 boundsMin = GCpuBvh.aabbMin;
+    const tinybvh::bvhvec3 boundsExtent = GCpuBvh.aabbMax - GCpuBvh.aabbMin;
+    for (int i = 0; i < 1 << 18; ++i)
+    {
+        tinybvh::bvhvec3 origin(boundsMin.x + unit(rng) * boundsExtent.x, boundsMin.y + unit(rng) * boundsExtent.y, boundsMin.z + unit(rng) * boundsExtent.z);
+        tinybvh::bvhvec3 dir(unit(rng) * 2.0f - 1.0f, unit(rng) * 2.0f - 1.0f, unit(rng) * 2.0f - 1.0f);
+        randomRays.emplace_back(origin, tinybvh::tinybvh_length(dir) > 0.0f ? dir : tinybvh::bvhvec3(0, -1, 0), 2000.0f);
+    }
+
+    // single thread, Mrays/s of the traversal only
+    auto measure = [](const std::vector<tinybvh::Ray>& source)
+    {
+        std::vector<tinybvh::Ray> rays = source;
+        const auto start = std::chrono::high_resolution_clock::now();
+        TraceRayStream(rays.data(), static_cast<uint32_t>(rays.size()));
+        const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return seconds > 0.0 ? static_cast<double>(rays.size()) / seconds / 1e6 : 0.0;
+    };
+
+    const ECPUBVHLayout currentLayout = bvhLayout;
+    SPDLOG_INFO("cpu bvh benchmark, {} blas, {} instances, {} bake rays, {} random rays, Mrays/s on one thread",
+        bvhBLASContexts.size(), bvhInstanceList.size(), bakeRays.size(), randomRays.size());
+    for (uint32_t layout = 0; layout < static_cast<uint32_t>(ECPUBVHLayout::ECBL_Count); ++layout)
+    {
+        const auto convertStart = std::chrono::high_resolution_clock::now();
+        SetBVHLayout(scene, static_cast<ECPUBVHLayout>(layout));
+        const double convertMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - convertStart).count();
+
+        // first pass warms the caches
+        measure(bakeRays);
+        const double bake = measure(bakeRays);
+        const double random = measure(randomRays);
+        SPDLOG_INFO("  {:>6}: bake {:7.2f}  random {:7.2f}  (switch {:.1f}ms)", GetCPUBVHLayoutName(static_cast<ECPUBVHLayout>(layout)), bake, random, convertMs);
+    }
+    SetBVHLayout(scene, currentLayout);
+}
+
+void FCPUTraversalGate::Enter()
+{
+    while (true)
+    {
+        closed_.wait(true);
+        active_.fetch_add(1);
+        if (!closed_.load())
+        {
+            return;
+        }
+        // closed between the check and the increment, step back out and wait for the edit
+        Leave();
+    }
+}
+
+void FCPUTraversalGate::Leave()
+{
+    if (active_.fetch_sub(1) == 1)
+    {
+        active_.notify_all();
+    }
+}
+
+void FCPUTraversalGate::Close()
+{
+    closed_.store(true);
+    for (uint32_t active = active_.load(); active != 0; active = active_.load())
+    {
+        active_.wait(active);
+    }
+}
+
+void FCPUTraversalGate::Open()
+{
+    closed_.store(false);
+    closed_.notify_all();
+}
+
+// parked instances sit this far away, no ray with a sane max distance reaches them
+static constexpr float GParkedInstanceOffset = 1e20f;
+// refits may lose this much sah quality against the last full build before the TLAS is rebuilt
+static constexpr float GTLASRefitCostLimit = 1.3f;
+// the probe gen lights voxels closer than 8 units to solid, an edit changes those around it
+static constexpr float GRebakeMargin = CUBE_UNIT * 8;
+
+static bool IsEmptyBounds(const tinybvh::bvhvec3& bmin, const tinybvh::bvhvec3& bmax)
+{
+    return bmin.x > bmax.x;
+}
+
+// tinybvh's Refit only knows triangle leaves, TLAS leaves take the bounds of their live instances
+static void RefitTLAS(tinybvh::BVH& tlas, const std::vector<tinybvh::BLASInstance>& instances, const std::vector<FCPUTLASInstanceInfo>& infos)
+{
+    // children always come after their parent, node 1 is unused padding
+    for (int32_t i = static_cast<int32_t>(tlas.usedNodes) - 1; i >= 0; --i)
+    {
+        if (i == 1)
+        {
+            continue;
+        }
+        tinybvh::BVH::BVHNode& node = tlas.bvhNode[i];
+        tinybvh::bvhvec3 bmin(BVH_FAR), bmax(-BVH_FAR);
+        if (node.isLeaf())
+        {
+            for (uint32_t j = 0; j < node.triCount; ++j)
+            {
+                const uint32_t instIdx = tlas.primIdx[node.leftFirst + j];
+                if (infos[instIdx].parked)
+                {
+                    continue;
+                }
+                bmin = tinybvh::tinybvh_min(bmin, instances[instIdx].aabbMin);
+                bmax = tinybvh::tinybvh_max(bmax, instances[instIdx].aabbMax);
+            }
+        }
+        else
+        {
+            const tinybvh::BVH::BVHNode& left = tlas.bvhNode[node.leftFirst];
+            const tinybvh::BVH::BVHNode& right = tlas.bvhNode[node.leftFirst + 1];
+            bmin = tinybvh::tinybvh_min(left.aabbMin, right.aabbMin);
+            bmax = tinybvh::tinybvh_max(left.aabbMax, right.aabbMax);
+        }
+        node.aabbMin = bmin;
+        node.aabbMax = bmax;
+    }
+    tlas.aabbMin = tlas.bvhNode[0].aabbMin;
+    tlas.aabbMax = tlas.bvhNode[0].aabbMax;
+}
+
+// sah cost like BVH::SAHCost, which overflows on the empty bounds of leaves holding only parked instances
+static float TLASCost(const tinybvh::BVH& tlas)
+{
+    const tinybvh::BVH::BVHNode& root = tlas.bvhNode[0];
+    if (IsEmptyBounds(root.aabbMin, root.aabbMax))
+    {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (uint32_t i = 0; i < tlas.usedNodes; ++i)
+    {
+        const tinybvh::BVH::BVHNode& node = tlas.bvhNode[i];
+        if (i == 1 || IsEmptyBounds(node.aabbMin, node.aabbMax))
+        {
+            continue;
+        }
+        cost += node.SurfaceArea() * (node.isLeaf() ? C_INT * node.triCount : C_TRAV);
+    }
+    return cost / root.SurfaceArea();
+}
+
+void FCPUAccelerationStructure::UpdateBVH(Scene& scene)
+{
+    // rays of bake groups already running finish on the current TLAS, queued groups start after the edit
+    FCPUTraversalGate::Closed closed(traversalGate);
+    UpdateInstances(scene);
+}
+
+void FCPUAccelerationStructure::FillInstance(uint32_t slot, Node& node)
+{
+    tinybvh::BLASInstance& instance = bvhInstanceList[slot];
+    FCPUTLASInstanceInfo& info = bvhTLASContexts[slot];
+
+    mat4 worldTS = transpose(node.WorldTransform());
+    instance.blasIdx = node.GetModel();
+    std::memcpy( (float*)instance.transform, &(worldTS[0]), sizeof(float) * 16);
+    instance.Update(bvhBLASList[instance.blasIdx]);
+
+    info.nodeId = node.GetInstanceId();
+    info.modelId = node.GetModel();
+    info.parked = false;
+    for ( int i = 0; i < node.Materials().size(); ++i )
+    {
+        info.matIdxs[i] = node.Materials()[i];
+    }
+    instanceSlots[info.nodeId] = slot;
+}
+
+void FCPUAccelerationStructure::ParkInstance(uint32_t slot)
+{
+    tinybvh::BLASInstance& instance = bvhInstanceList[slot];
+    FCPUTLASInstanceInfo& info = bvhTLASContexts[slot];
+
+    auto slotIt = instanceSlots.find(info.nodeId);
+    if (slotIt != instanceSlots.end() && slotIt->second == slot)
+    {
+        instanceSlots.erase(slotIt);
+    }
+
+    // identity moved far away, the leaf still lists it but refit leaves it out of the bounds
+    mat4 parked = transpose(translate(mat4(1.0f), vec3(GParkedInstanceOffset)));
+    std::memcpy( (float*)instance.transform, &(parked[0]), sizeof(float) * 16);
+    instance.Update(bvhBLASList[instance.blasIdx]);
+
+    info.parked = true;
+    freeInstanceSlots.push_back(slot);
+}
+
+void FCPUAccelerationStructure::UpdateInstances(Scene& scene)
+{
+    // world transforms are kept current where nodes are edited (editor, animation, physics), so no recalc here.
+    // MagicaLego recreates its nodes on every placement, changes are found by instance id instead of per node flags
+    bool rebuild = tlasBuildCost <= 0.0f;
+    bool refit = false;
+    std::vector<Node*> addedNodes;
+    instanceSeen.assign(bvhInstanceList.size(), 0);
+
+    for (auto& node : scene.Nodes())
+    {
+        uint32_t modelId = node->GetModel();
+        if (modelId == -1) continue;
+        if (!node->IsVisible()) continue;
+
+        auto slotIt = instanceSlots.find(node->GetInstanceId());
+        // a duplicated instance id or a model swap goes through remove + add
+        if (slotIt == instanceSlots.end() || instanceSeen[slotIt->second] || bvhTLASContexts[slotIt->second].modelId != modelId)
+        {
+            addedNodes.push_back(node.get());
+            continue;
+        }
+
+        const uint32_t slot = slotIt->second;
+        instanceSeen[slot] = 1;
+
+        FCPUTLASInstanceInfo& info = bvhTLASContexts[slot];
+        bool materialChanged = false;
+        for ( int i = 0; i < node->Materials().size(); ++i )
+        {
+            materialChanged |= info.matIdxs[i] != node->Materials()[i];
+            info.matIdxs[i] = node->Materials()[i];
+        }
+
+        mat4 worldTS = transpose(node->WorldTransform());
+        if (std::memcmp(bvhInstanceList[slot].transform, &(worldTS[0]), sizeof(float) * 16) != 0)
+        {
+            // both where it was and where it is now
+            InvalidateInstance(slot);
+            FillInstance(slot, *node);
+            InvalidateInstance(slot);
+            refit = true;
+        }
+        else if (materialChanged)
+        {
+            InvalidateInstance(slot);
+        }
+    }
+
+    for (uint32_t slot = 0; slot < static_cast<uint32_t>(bvhInstanceList.size()); ++slot)
+    {
+        if (!instanceSeen[slot] && !bvhTLASContexts[slot].parked)
+        {
+            InvalidateInstance(slot);
+            ParkInstance(slot);
+            refit = true;
+        }
+    }
+
+    for (Node* node : addedNodes)
+    {
+        uint32_t slot;
+        if (!freeInstanceSlots.empty())
+        {
+            slot = freeInstanceSlots.back();
+            freeInstanceSlots.pop_back();
+            refit = true;
+        }
+        else
+        {
+            // no free leaf to reuse, the TLAS has to grow
+            slot = static_cast<uint32_t>(bvhInstanceList.size());
+            bvhInstanceList.emplace_back();
+            bvhTLASContexts.emplace_back();
+            rebuild = true;
+        }
+        FillInstance(slot, *node);
+        InvalidateInstance(slot);
+    }
+
+    if (!rebuild && refit)
+    {
+        RefitTLAS(GCpuBvh, bvhInstanceList, bvhTLASContexts);
+        rebuild = TLASCost(GCpuBvh) > tlasBuildCost * GTLASRefitCostLimit;
+    }
+    if (rebuild)
+    {
+        RebuildTLAS();
+    }
+
+    // rebind with new address
+    GbvhInstanceList = &bvhInstanceList;
+    GbvhTlasContexts = &bvhTLASContexts;
+    GbvhBlasContexts = &bvhBLASContexts;
+}
+
+void FCPUAccelerationStructure::RebuildTLAS()
+{
+    // compact parked slots away, hit.inst indexes both lists so they move together
+    uint32_t count = 0;
+    for (uint32_t slot = 0; slot < static_cast<uint32_t>(bvhInstanceList.size()); ++slot)
+    {
+        if (bvhTLASContexts[slot].parked)
+        {
+            continue;
+        }
+        bvhInstanceList[count] = bvhInstanceList[slot];
+        bvhTLASContexts[count] = bvhTLASContexts[slot];
+        ++count;
+    }
+    bvhInstanceList.resize(count);
+    bvhTLASContexts.resize(count);
+
+    instanceSlots.clear();
+    freeInstanceSlots.clear();
+    for (uint32_t slot = 0; slot < count; ++slot)
+    {
+        instanceSlots[bvhTLASContexts[slot].nodeId] = slot;
+    }
+
+    if (count == 0)
+    {
+        tlasBuildCost = 0.0f;
+        GCpuBvhReady = false;
+        return;
+    }
+
+    // spare slots give later additions a leaf to go into without a rebuild. they are built in at the scene
+    // center, so a reused one only stretches the leaves around the middle, then parked right away
+    tinybvh::bvhvec3 boundsMin(BVH_FAR), boundsMax(-BVH_FAR);
+    for (uint32_t slot = 0; slot < count; ++slot)
+    {
+        bvhInstanceList[slot].Update(bvhBLASList[bvhInstanceList[slot].blasIdx]);
+        boundsMin = tinybvh::tinybvh_min(boundsMin, bvhInstanceList[slot].aabbMin);
+        boundsMax = tinybvh::tinybvh_max(boundsMax, bvhInstanceList[slot].aabbMax);
+    }
+    const tinybvh::bvhvec3 center = (boundsMin + boundsMax) * 0.5f;
+    const uint32_t spareCount = std::max(16u, count / 8);
+    mat4 spareTS = transpose(translate(mat4(1.0f), vec3(center.x, center.y, center.z)));
+    for (uint32_t spare = 0; spare < spareCount; ++spare)
+    {
+        tinybvh::BLASInstance instance;
+        instance.blasIdx = bvhInstanceList[0].blasIdx;
+        std::memcpy( (float*)instance.transform, &(spareTS[0]), sizeof(float) * 16);
+        bvhInstanceList.push_back(instance);
+        FCPUTLASInstanceInfo info;
+        info.nodeId = UINT32_MAX;
+        bvhTLASContexts.push_back(info);
+    }
+
+    GCpuBvh.Build( bvhInstanceList.data(), static_cast<uint32_t>(bvhInstanceList.size()), bvhBLASList.data(), static_cast<uint32_t>(bvhBLASList.size()) );
+    for (uint32_t slot = static_cast<uint32_t>(bvhInstanceList.size()); slot > count; --slot)
+    {
+        ParkInstance(slot - 1);
+    }
+    RefitTLAS(GCpuBvh, bvhInstanceList, bvhTLASContexts);
+    tlasBuildCost = std::max(TLASCost(GCpuBvh), 1e-6f);
+    GCpuBvhReady = true;
+}
+
+void FCPUAccelerationStructure::InvalidateInstance(uint32_t slot)
+{
+    const tinybvh::BLASInstance& instance = bvhInstanceList[slot];
+    InvalidateRegion(vec3(instance.aabbMin.x, instance.aabbMin.y, instance.aabbMin.z), vec3(instance.aabbMax.x, instance.aabbMax.y, instance.aabbMax.z));
+}
+
+RayCastResult FCPUAccelerationStructure::RayCastInCPU(vec3 rayOrigin, vec3 rayDir)
+{
+    RayCastResult result {};
+
+    if (GCpuBvhReady)
+    {
+        tinybvh::Ray ray(tinybvh::bvhvec3(rayOrigin.x, rayOrigin.y, rayOrigin.z), tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z), 2000.0f);
+        GCpuBvh.Intersect(ray);
+    
+        if (ray.hit.t < 2000.f)
+        {
+            vec3 hitPos = rayOrigin + rayDir * ray.hit.t;
+            uint32_t primIdx = ray.hit.prim;
+            tinybvh::BLASInstance& instance = (*GbvhInstanceList)[ray.hit.inst];
+            FCPUTLASInstanceInfo& instContext = (*GbvhTlasContexts)[ray.hit.inst];
+            FCPUBLASContext& context = (*GbvhBlasContexts)[instance.blasIdx];
+            mat4* worldTS = (mat4*)instance.transform;
+            vec4 normalWS = vec4( context.extinfos[primIdx].normal, 0.0f) * *worldTS;
+            result.HitPoint = vec4(hitPos, 0);
+            result.Normal = normalWS;
+            result.Hitted = true;
+            result.T = ray.hit.t;
+            result.InstanceId = instContext.nodeId;
+        }
+    }
+
+    return result;
+}
+
+void FCPUAccelerationStructure::TraceRays(tinybvh::Ray* rays, uint32_t count) const
+{
+    TraceRayStream(rays, count);
+}
+
+bool FCPUAccelerationStructure::IsOccluded(vec3 origin, vec3 dir, float maxDist) const
+{
+    return OccludedRay(origin, dir, maxDist);
+}
+
+void FCPUAccelerationStructure::OccludedRays(const tinybvh::Ray* rays, uint32_t count, uint8_t* outOccluded) const
+{
+    OccludedRayStream(rays, count, outOccluded);
+}
+
+FCPURayQueryHandle FCPUAccelerationStructure::SubmitRayQuery(const FCPURayQuery& query)
+{
+    return SubmitRayQueries(&query, 1);
+}
+
+FCPURayQueryHandle FCPUAccelerationStructure::SubmitRayQueries(const FCPURayQuery* queries, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(rayQueryMutex);
+    FCPURayQueryHandle first = nextRayQueryHandle;
+    queuedRayQueries.insert(queuedRayQueries.end(), queries, queries + count);
+    nextRayQueryHandle += count;
+    return first;
+}
+
+ECPURayQueryStatus FCPUAccelerationStructure::GetRayQueryResult(FCPURayQueryHandle handle, RayCastResult& outResult)
+{
+    std::lock_guard<std::mutex> lock(rayQueryMutex);
+    // unsigned distances survive the handle wrap
+    const FCPURayQueryHandle queuedFirst = nextRayQueryHandle - uint32_t(queuedRayQueries.size());
+    if (handle - queuedFirst < queuedRayQueries.size())
+    {
+        return ECPURayQueryStatus::ECRS_Pending;
+    }
+    for (const auto& batch : rayQueryBatches)
+    {
+        const uint32_t index = handle - batch->first;
+        if (index < batch->queries.size())
+        {
+            if (batch->cancelled)
+            {
+                return ECPURayQueryStatus::ECRS_Cancelled;
+            }
+            if (batch->readyFrame == 0)
+            {
+                return ECPURayQueryStatus::ECRS_Pending;
+            }
+            outResult = batch->results[index];
+            return ECPURayQueryStatus::ECRS_Ready;
+        }
+    }
+    return ECPURayQueryStatus::ECRS_Expired;
+}
+
+void FCPUAccelerationStructure::DispatchRayQueries()
+{
+    std::shared_ptr<FRayQueryBatch> batch;
+    {
+        std::lock_guard<std::mutex> lock(rayQueryMutex);
+        ++rayQueryFrame;
+        for (auto& tracing : rayQueryBatches)
+        {
+            // the join is gone but never landed the batch, CancelAllParralledTasks dropped it or skipped its completion
+            if (tracing->readyFrame == 0 && TaskCoordinator::GetInstance()->IsTaskComplete(tracing->joinTask))
+            {
+                tracing->cancelled = true;
+                tracing->readyFrame = rayQueryFrame;
+            }
+        }
+        // landed batches go once callers had RayQueryKeepFrames frames to pick them up, a batch still tracing holds back none of the others
+        std::erase_if(rayQueryBatches, [this](const std::shared_ptr<FRayQueryBatch>& landed)
+        {
+            return landed->readyFrame != 0 && rayQueryFrame - landed->readyFrame > RayQueryKeepFrames;
+        });
+        if (queuedRayQueries.empty())
+        {
+            return;
+        }
+        batch = std::make_shared<FRayQueryBatch>();
+        batch->first = nextRayQueryHandle - uint32_t(queuedRayQueries.size());
+        batch->queries.swap(queuedRayQueries);
+        batch->results.resize(batch->queries.size(), RayCastResult{});
+        rayQueryBatches.push_back(batch);
+    }
+
+    // one task per chunk, a chunk goes through the TLAS back to back like any other ray stream
+    constexpr uint32_t chunkSize = 256;
+    const uint32_t count = uint32_t(batch->queries.size());
+    std::vector<uint32_t> chunkTasks;
+    for (uint32_t chunkBegin = 0; chunkBegin < count; chunkBegin += chunkSize)
+    {
+        const uint32_t chunkEnd = std::min(count, chunkBegin + chunkSize);
+        chunkTasks.push_back(TaskCoordinator::GetInstance()->AddParralledTask(
+            [this, batch, chunkBegin, chunkEnd](ResTask& task)
+            {
+                FCPUTraversalGate::Scope traversal(traversalGate);
+                if (!GCpuBvhReady)
+                {
+                    return;
+                }
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    const FCPURayQuery& query = batch->queries[i];
+                    RayCastResult& result = batch->results[i];
+                    if (query.type == ECPURayQueryType::ECRQ_AnyHit)
+                    {
+                        result.Hitted = OccludedRay(query.origin, query.dir, query.maxDist);
+                        continue;
+                    }
+
+                    tinybvh::Ray ray(tinybvh::bvhvec3(query.origin.x, query.origin.y, query.origin.z), tinybvh::bvhvec3(query.dir.x, query.dir.y, query.dir.z), query.maxDist);
+
+                    GCpuBvh.Intersect(ray);
+                    if (ray.hit.t < query.maxDist)
+                    {
+                        vec3 normal;
+                        ResolveHit(ray, normal, result.MaterialId, result.InstanceId);
+                        // the ray direction is normalized, t is in world units
+                        result.HitPoint = vec4(query.origin + normalize(query.dir) * ray.hit.t, 0);
+                        result.Normal = vec4(normal, 0);
+                        result.T = ray.hit.t;
+                        result.Hitted = true;
+                    }
+                }
+            },
+            nullptr, std::vector<uint32_t>{}, ETaskPriority::FrameCritical));
+    }
+
+    uint32_t joinTask = TaskCoordinator::GetInstance()->AddJoinTask(chunkTasks, [this, batch](ResTask& task)
+    {
+        std::lock_guard<std::mutex> lock(rayQueryMutex);
+        batch->readyFrame = rayQueryFrame;
+    }, ETaskPriority::FrameCritical);
+    std::lock_guard<std::mutex> lock(rayQueryMutex);
+    batch->joinTask = joinTask;
+}
+
+void FCPUProbeBaker::ProcessCube(int x, int y, int z, ECubeProcType procType)
+{
+    auto& ubo = NextEngine::GetInstance()->GetUniformBufferObject();
+    VoxelData brick[CUBE_BRICK_VOXELS];
+    LoadBrick(x / CUBE_BRICK_SIZE, y / CUBE_BRICK_SIZE, z / CUBE_BRICK_SIZE, brick);
+    VoxelData& voxel = brick[BrickLocalIdx(x, y, z)];
+        
+    switch (procType)
+    {
+        case ECubeProcType::ECPT_Clear:
+        case ECubeProcType::ECPT_Fence:
+            return;
+        case ECubeProcType::ECPT_Voxelize:
+            VoxelizeCube(voxel, ivec3(x, y, z), CUBE_OFFSET, UNIT_SIZE);
+            break;
+    }
+    StoreBrick(x / CUBE_BRICK_SIZE, y / CUBE_BRICK_SIZE, z / CUBE_BRICK_SIZE, brick);
+}
+
+bool FCPUProbeBaker::ProcessGroup(int x0, int z0, int groupSize, ECubeProcType procType, ResTask& task)
+{
+    if (procType != ECubeProcType::ECPT_Voxelize)
+    {
+        return true;
+    }
+
+    // same result as ProcessCube per voxel, but every direction is one stream over the whole group.
+    // the triangle voxelizer decides material and inside, rays only measure the distances of voxels outside geometry
+    const uint32_t count = groupSize * groupSize * CUBE_SIZE_Z;
+    const float maxDist = CUBE_UNIT * 64;
+
+    // reused by every group this worker runs
+    thread_local std::vector<tinybvh::Ray> rays;
+    thread_local std::vector<vec3> origins;
+    thread_local std::vector<float> axisDists;
+    thread_local std::vector<float> minDists;
+    thread_local std::vector<uint32_t> matIds;
+    thread_local std::vector<uint8_t> insides;
+    thread_local std::vector<uint32_t> rayVoxels;
+    thread_local std::vector<uint32_t> openVoxels;
+    rays.resize(count);
+    origins.resize(count);
+    axisDists.resize(count * 6);
+    minDists.resize(count);
+    matIds.resize(count);
+    insides.resize(count);
+
+    VoxelizeTriangles(ivec3(x0, 0, z0), ivec3(x0 + groupSize, CUBE_SIZE_Z, z0 + groupSize), CUBE_OFFSET, UNIT_SIZE, matIds.data(), insides.data());
+
+    // z, y, x order, neighbouring rays start one voxel apart. 体内的voxel距离全是0，不发射光线
+    uint32_t i = 0;
+    rayVoxels.clear();
+    for (int z = z0; z < z0 + groupSize; z++)
+        for (int y = 0; y < CUBE_SIZE_Z; y++)
+            for (int x = x0; x < x0 + groupSize; x++, i++)
+            {
+                origins[i] = vec3(x, y, z) * UNIT_SIZE + CUBE_OFFSET;
+                std::fill_n(&axisDists[i * 6], 6, insides[i] ? 0.0f : 255.0f);
+                if (!insides[i])
+                {
+                    rayVoxels.push_back(i);
+                }
+            }
+
+    // axis pass, distances only, nothing is resolved
+    const uint32_t rayCount = static_cast<uint32_t>(rayVoxels.size());
+    for (int d = 0; d < 6; ++d)
+    {
+        // scene switch or engine shutdown, the rest of the group is not needed anymore
+        if (task.IsCancelled())
+        {
+            return false;
+        }
+
+        const vec3 dir = GAxisDirs[d];
+        const tinybvh::bvhvec3 rayDir(dir.x, dir.y, dir.z);
+        for (uint32_t j = 0; j < rayCount; ++j)
+        {
+            const vec3& origin = origins[rayVoxels[j]];
+            rays[j] = tinybvh::Ray(tinybvh::bvhvec3(origin.x, origin.y, origin.z), rayDir, maxDist);
+        }
+        TraceRayStream(rays.data(), rayCount);
+
+        for (uint32_t j = 0; j < rayCount; ++j)
+        {
+            if (rays[j].hit.t < maxDist)
+            {
+                axisDists[rayVoxels[j] * 6 + d] = rays[j].hit.t;
+            }
+        }
+    }
+
+    // diagonal pass only for voxels whose axis rays all missed
+    openVoxels.clear();
+    for (i = 0; i < count; ++i)
+    {
+        minDists[i] = *std::min_element(&axisDists[i * 6], &axisDists[i * 6] + 6);
+        if (minDists[i] > 254.0f)
+        {
+            openVoxels.push_back(i);
+        }
+    }
+
+    const uint32_t openCount = static_cast<uint32_t>(openVoxels.size());
+    for (const vec3& dir : GDiagonalDirs)
+    {
+        if (openCount == 0)
+        {
+            break;
+        }
+        if (task.IsCancelled())
+        {
+            return false;
+        }
+
+        // only a hit closer than the voxel's current minimum changes anything, cap each ray there
+        const tinybvh::bvhvec3 rayDir(dir.x, dir.y, dir.z);
+        for (uint32_t j = 0; j < openCount; ++j)
+        {
+            const vec3& origin = origins[openVoxels[j]];
+            rays[j] = tinybvh::Ray(tinybvh::bvhvec3(origin.x, origin.y, origin.z), rayDir, std::min(maxDist, minDists[openVoxels[j]]));
+        }
+        TraceRayStream(rays.data(), openCount);
+
+        for (uint32_t j = 0; j < openCount; ++j)
+        {
+            float& minDist = minDists[openVoxels[j]];
+            if (rays[j].hit.t < std::min(maxDist, minDist))
+            {
+                minDist = rays[j].hit.t;
+            }
+        }
+    }
+
+    // the group covers whole brick columns, gather each brick and store it at once
+    VoxelData brick[CUBE_BRICK_VOXELS];
+    for (int by = 0; by < CUBE_BRICKS_Z; by++)
+        for (int bz = z0 / CUBE_BRICK_SIZE; bz < (z0 + groupSize) / CUBE_BRICK_SIZE; bz++)
+            for (int bx = x0 / CUBE_BRICK_SIZE; bx < (x0 + groupSize) / CUBE_BRICK_SIZE; bx++)
+            {
+                for (int y = by * CUBE_BRICK_SIZE; y < (by + 1) * CUBE_BRICK_SIZE; y++)
+                    for (int z = bz * CUBE_BRICK_SIZE; z < (bz + 1) * CUBE_BRICK_SIZE; z++)
+                        for (int x = bx * CUBE_BRICK_SIZE; x < (bx + 1) * CUBE_BRICK_SIZE; x++)
+                        {
+                            i = ((z - z0) * CUBE_SIZE_Z + y) * groupSize + (x - x0);
+                            VoxelData& cube = brick[BrickLocalIdx(x, y, z)];
+                            cube.age = 0;
+                            cube.matId = matIds[i];
+                            PackVoxelDistances(cube, &axisDists[i * 6], minDists[i]);
+                        }
+                StoreBrick(bx, by, bz, brick);
+            }
+    return true;
+}
+
+void FCPUProbeBaker::UploadGPU(Vulkan::DeviceMemory& voxelGpuMemory)
+{
+    // a dirty slot's chunk was allocated before its bit was set, the acquire in TakeDirtyBits makes it visible here
+    std::vector<uint64_t> dirty = TakeDirtyBits(dirtySlots);
+    if (std::all_of(dirty.begin(), dirty.end(), [](uint64_t word) { return word == 0; }))
+    {
+        return;
+    }
+
+    const size_t slotBytes = sizeof(VoxelData) * CUBE_BRICK_VOXELS;
+    uint8_t* data = reinterpret_cast<uint8_t*>(voxelGpuMemory.Map(0, slotBytes * CUBE_BRICK_CAPACITY));
+    ForEachDirtyRun(dirty, [&](uint32_t first, uint32_t count)
+    {
+        // runs are split at chunk borders, every chunk is its own allocation
+        for (uint32_t slot = first; slot < first + count;)
+        {
+            uint32_t chunkEnd = std::min(first + count, (slot / BrickChunkSlots + 1) * BrickChunkSlots);
+            std::memcpy(data + slot * slotBytes, BrickVoxels(slot), (chunkEnd - slot) * slotBytes);
+            slot = chunkEnd;
+        }
+    });
+    voxelGpuMemory.Unmap();
+}
+
+bool FCPUAccelerationStructure::AsyncProcessFull(Assets::Scene& scene, Vulkan::DeviceMemory* voxelGpuMemory, Vulkan::DeviceMemory* pageIndexGpuMemory, bool incremental)
+{
+    if ( !TaskCoordinator::GetInstance()->IsAllParralledTaskComplete() )
+    {
+        return false;
+    }
+    // clean
+    while (!needUpdateGroups.empty())
+        needUpdateGroups.pop();
+    lastBatchTasks.clear();
+    lastFenceTask = UINT32_MAX;
+
+    voxelGPUMemory = voxelGpuMemory;
+    pageIndexGPUMemory = pageIndexGpuMemory;
+
+    if (!incremental)
+    {
+        probeBaker.ClearAmbientCubes();
+        probeBaker.UploadGPU(*voxelGpuMemory);
+        // the cleared brick tables, otherwise the gpu keeps looking up the old slots
+        cpuPageIndex.UploadGPU(*pageIndexGpuMemory, probeBaker);
+    }
+    else
+    {
+        UpdateBVH(scene);
+    }
+    // every group is in this batch already
+    dirtyGroups.fill(0);
+    dirtyGroupCount = 0;
+    
+    const int lengthX = ProbeGroupCount;
+    const int lengthZ = ProbeGroupCount;
+
+    // far probe gen
+    // for (int x = 0; x < lengthX; x++)
+    //     for (int z = 0; z < lengthZ; z++)
+    //         needUpdateGroups.push({ivec3(x, 0, z), ECubeProcType::ECPT_Voxelize, EBakerType::EBT_FarProbe});
+    
+    // 2 pass near probe iterate
+    for(int pass = 0; pass < 1; ++pass)
+    {
+        // shuffle
+        std::vector<std::pair<int, int>> coordinates;
+        for (int x = 0; x < lengthX; x++)
+            for (int z = 0; z < lengthZ; z++)
+                coordinates.push_back({x, z});
+        
+        std::random_device rd;
+        std::mt19937 g(rd());
+        std::shuffle(coordinates.begin(), coordinates.end(), g);
+
+        // dispatch
+        for (const auto& [x, z] : coordinates)
+            needUpdateGroups.push({ivec3(x, 0, z), ECubeProcType::ECPT_Voxelize, EBakerType::EBT_Probe});
+        // add fence
+        needUpdateGroups.push({ivec3(0), ECubeProcType::ECPT_Fence, EBakerType::EBT_Probe});
+    }
+
+    // the whole chain goes into the task graph now, no need to wait for the next Tick
+    DispatchPendingGroups(scene);
+
+    return true;
+}
+
+uint32_t FCPUAccelerationStructure::AsyncProcessGroup(int xInMeter, int zInMeter, Scene& scene, ECubeProcType procType, EBakerType bakerType)
+{
+    if (bvhInstanceList.empty())
+    {
+        return UINT32_MAX;
+    }
+    
+    int groupSize = ProbeGroupSize; // 4 x 4 x 12 bricks a group
+    
+    int actualX = xInMeter * groupSize;
+    int actualZ = zInMeter * groupSize;
+
+    std::vector<vec3> lightPos;
+    std::vector<vec3> sunDir;
+    for( auto& light : scene.Lights() )
+    {
+        lightPos.push_back(mix(light.p1, light.p3, 0.5f));
+    }
+
+    if (scene.HasSun())
+    {
+        sunDir.push_back( scene.GetSunDir() );
+    }
+
+    uint32_t taskId = TaskCoordinator::GetInstance()->AddParralledTask(
+                [this, actualX, actualZ, groupSize, procType](ResTask& task)
+            {
+                FCPUTraversalGate::Scope traversal(traversalGate);
+                probeBaker.ProcessGroup(actualX, actualZ, groupSize, procType, task);
+            },
+            [this](ResTask& task)
+            {
+                // flush here
+                //bakerType == EBakerType::EBT_Probe ? probeBaker.UploadGPU(*GPUMemory) : farProbeBaker.UploadGPU(*FarGPUMemory);
+                needFlush = true;
+            },
+            // groups after a fence wait for it in the graph
+            lastFenceTask != UINT32_MAX ? std::vector<uint32_t>{lastFenceTask} : std::vector<uint32_t>{},
+            ETaskPriority::Background);
+
+    lastBatchTasks.push_back(taskId);
+    return taskId;
+}
+
+void FCPUAccelerationStructure::DispatchPendingGroups(Scene& scene)
+{
+    while (!needUpdateGroups.empty())
+    {
+        auto& group = needUpdateGroups.front();
+        ECubeProcType type = std::get<1>(group);
+        if (type == ECubeProcType::ECPT_Fence)
+        {
+            // the distance field follows the batch's occupancy on the pool, page-index and upload run on main thread right after
+            uint32_t distanceFieldTask = TaskCoordinator::GetInstance()->AddParralledTask([this](ResTask& task)
+            {
+                distanceField.Update(probeBaker);
+            }, nullptr, lastBatchTasks, ETaskPriority::Background);
+            lastFenceTask = TaskCoordinator::GetInstance()->AddJoinTask({distanceFieldTask}, [this](ResTask& task)
+            {
+                FlushGPU();
+            }, ETaskPriority::Background);
+            lastBatchTasks.clear();
+        }
+        else
+        {
+            AsyncProcessGroup(std::get<0>(group).x, std::get<0>(group).z, scene, std::get<1>(group), std::get<2>(group));
+        }
+        needUpdateGroups.pop();
+    }
+}
+
+void FCPUAccelerationStructure::FlushGPU()
+{
+    if (voxelGPUMemory == nullptr || pageIndexGPUMemory == nullptr)
+    {
+        return;
+    }
+    // only bricks, table blocks and pages changed since the last flush are written
+    probeBaker.UploadGPU(*voxelGPUMemory);
+    cpuPageIndex.UpdateData(probeBaker);
+    cpuPageIndex.UploadGPU(*pageIndexGPUMemory, probeBaker);
+    if (distanceFieldGPUMemory != nullptr)
+    {
+        distanceField.UploadGPU(*distanceFieldGPUMemory);
+    }
+    needFlush = false;
+
+#ifndef NDEBUG
+    // only when no group is writing bricks, a running batch would show up as mismatches
+    if (TaskCoordinator::GetInstance()->IsAllParralledTaskComplete())
+    {
+        cpuPageIndex.ValidateCounts(probeBaker);
+    }
+#endif
+
+    uint32_t overflow = probeBaker.brickOverflow.exchange(0, std::memory_order_relaxed);
+    if (overflow > 0)
+    {
+        SPDLOG_WARN("probe brick pool is full ({} bricks), {} bricks were stored as air", CUBE_BRICK_CAPACITY, overflow);
+    }
+}
+
+void FCPUAccelerationStructure::Tick(Scene& scene, Vulkan::DeviceMemory* gpuMemory, Vulkan::DeviceMemory* voxelGpuMemory, Vulkan::DeviceMemory* pageIndexMemory, Vulkan::DeviceMemory* distanceFieldMemory)
+{
+    voxelGPUMemory = voxelGpuMemory;
+    pageIndexGPUMemory = pageIndexMemory;
+    distanceFieldGPUMemory = distanceFieldMemory;
+
+    // progressive preview while a batch is still running, the fence continuation does the final flush
+    if (needFlush)
+    {
+        FlushGPU();
     }
+
+    // edits keep coalescing while a batch runs, the next batch goes out after its fence
+    if (dirtyGroupCount > 0 && (lastFenceTask == UINT32_MAX || TaskCoordinator::GetInstance()->IsTaskComplete(lastFenceTask)))
+    {
+        QueueDirtyGroups();
+    }
+
+    // requests queued from outside a full bake (RequestUpdate, scene edits)
+    DispatchPendingGroups(scene);
+
+    // cascades follow the camera, a request that came in during the last run goes out here as well
+    shadowCameraPos = vec3(NextEngine::GetInstance()->GetUniformBufferObject().ModelViewInverse[3]);
+    DispatchShadowMap(scene);
 }
 
 void FCPUAccelerationStructure::RequestUpdate(vec3 worldPos, float radius)
 {
-    ivec3 center = ivec3(worldPos - CUBE_OFFSET);
-    ivec3 min = center - ivec3(static_cast<int>(radius));
-    ivec3 max = center + ivec3(static_cast<int>(radius));
+    InvalidateRegion(worldPos - vec3(radius), worldPos + vec3(radius));
+}
+
+void FCPUAccelerationStructure::InvalidateRegion(vec3 boundsMin, vec3 boundsMax)
+{
+    boundsMin -= vec3(GRebakeMargin);
+    boundsMax += vec3(GRebakeMargin);
+
+    const float groupExtent = CUBE_UNIT * ProbeGroupSize;
+    const vec3 gridMax = CUBE_OFFSET + vec3(CUBE_SIZE_XY, CUBE_SIZE_Z, CUBE_SIZE_XY) * CUBE_UNIT;
+    if (any(greaterThan(boundsMin, gridMax)) || any(lessThan(boundsMax, CUBE_OFFSET)))
+    {
+        return;
+    }
+
+    // groups are full height columns, only xz picks them
+    const vec2 gridOrigin = vec2(CUBE_OFFSET.x, CUBE_OFFSET.z);
+    ivec2 groupMin = clamp(ivec2(floor((vec2(boundsMin.x, boundsMin.z) - gridOrigin) / groupExtent)), ivec2(0), ivec2(ProbeGroupCount - 1));
+    ivec2 groupMax = clamp(ivec2(floor((vec2(boundsMax.x, boundsMax.z) - gridOrigin) / groupExtent)), ivec2(0), ivec2(ProbeGroupCount - 1));
+    for (int z = groupMin.y; z <= groupMax.y; ++z)
+    {
+        for (int x = groupMin.x; x <= groupMax.x; ++x)
+        {
+            uint8_t& dirty = dirtyGroups[z * ProbeGroupCount + x];
+            dirtyGroupCount += dirty == 0;
+            dirty = 1;
+        }
+    }
+}
 
-    // Insert all points within the radius (using manhattan distance for simplicity)
-    for (int x = min.x; x <= max.x; ++x) {
-        for (int z = min.z; x <= max.z; ++z) {
-            ivec3 point(x, 1, z);
-            needUpdateGroups.push({point, ECubeProcType::ECPT_Voxelize, EBakerType::EBT_Probe});
+void FCPUAccelerationStructure::QueueDirtyGroups()
+{
+    for (int z = 0; z < ProbeGroupCount; ++z)
+    {
+        for (int x = 0; x < ProbeGroupCount; ++x)
+        {
+            if (dirtyGroups[z * ProbeGroupCount + x])
+            {
+                needUpdateGroups.push({ivec3(x, 0, z), ECubeProcType::ECPT_Voxelize, EBakerType::EBT_Probe});
+            }
         }
     }
+    needUpdateGroups.push({ivec3(0), ECubeProcType::ECPT_Fence, EBakerType::EBT_Probe});
+    dirtyGroups.fill(0);
+    dirtyGroupCount = 0;
 }
 
 void FCPUProbeBaker::ClearAmbientCubes()
 {
-    for(auto& voxel : voxels)
+    std::lock_guard<std::mutex> lock(brickMutex);
+    // every slot free, every brick reads as zeroed voxels until it is baked
+    std::fill(brickExt.begin(), brickExt.begin() + CUBE_BRICK_CAPACITY, CUBE_BRICK_FREE);
+    std::fill(brickExt.begin() + CUBE_BRICK_CAPACITY, brickExt.end(), CUBE_BRICK_EMPTY);
+    brickChunks.clear();
+    brickChunks.resize(CUBE_BRICK_CAPACITY / BrickChunkSlots);
+    // lowest slot on top, used slots stay packed in the first chunks
+    freeBrickSlots.resize(CUBE_BRICK_CAPACITY);
+    std::iota(freeBrickSlots.rbegin(), freeBrickSlots.rend(), 0u);
+    brickOverflow = 0;
+    std::fill(brickSolidCounts.begin(), brickSolidCounts.end(), 0);
+    std::fill(voxelSolid.begin(), voxelSolid.end(), 0);
+    for (auto& word : solidDirtyGroups)
+    {
+        word.store(~0ull, std::memory_order_relaxed);
+    }
+    for (auto& count : pageSolidCounts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    // nothing in the pool is looked up anymore, but every table entry changed
+    for (auto& word : dirtySlots)
     {
-        voxel = {};
+        word.store(0, std::memory_order_relaxed);
+    }
+    for (uint32_t block = 0; block * DirtyExtBlock < brickExt.size(); ++block)
+    {
+        MarkExtDirty(block * DirtyExtBlock);
     }
 }
 
 void FCPUPageIndex::Init()
 {
-    pageIndex.resize(Assets::ACGI_PAGE_COUNT * Assets::ACGI_PAGE_COUNT);
+    pageIndex.assign(Assets::ACGI_PAGE_COUNT * Assets::ACGI_PAGE_COUNT, {});
+    for (PageIndex& page : pageIndex)
+    {
+        page.voxelDataIdx = UINT32_MAX;
+    }
+    dirtyPages.assign(pageIndex.size() / 64, ~0ull);
+
+    // each page the probe grid overlaps gets a brick table, right behind the slot -> coords entries
+    uint32_t tableCount = 0;
+    ivec2 local;
+    for (int bz = 0; bz < CUBE_BRICKS_XY; bz++)
+        for (int bx = 0; bx < CUBE_BRICKS_XY; bx++)
+        {
+            PageIndex& page = pageIndex[GetBrickPage(bx, bz, local)];
+            if (page.voxelDataIdx == UINT32_MAX)
+            {
+                page.voxelDataIdx = CUBE_BRICK_CAPACITY + tableCount++ * CUBE_BRICK_TABLE_SIZE;
+            }
+        }
+    assert(tableCount <= CUBE_BRICK_TABLE_PAGES);
 }
 
 void FCPUPageIndex::UpdateData(FCPUProbeBaker& baker)
 {
-    // 粗暴实现，先全部page置空
-    for (auto& page : pageIndex)
+    // the baker keeps the counts current as bricks are stored, only changed pages get uploaded
+    for (uint32_t i = 0; i < static_cast<uint32_t>(pageIndex.size()); ++i)
     {
-        page = {};
-        page.voxelCount = 0;
+        uint32_t voxelCount = baker.pageSolidCounts[i].load(std::memory_order_relaxed);
+        if (pageIndex[i].voxelCount != voxelCount)
+        {
+            pageIndex[i].voxelCount = voxelCount;
+            dirtyPages[i / 64] |= 1ull << (i % 64);
+        }
     }
+}
 
-    // 遍历baker里的数据，根据index，取得worldpos，然后取page出来，给voxel数量提升
-    for ( uint gIdx = 0; gIdx < baker.voxels.size(); ++gIdx)
+// matId != 0 voxels of one brick
+static uint32_t CountSolidVoxels(const VoxelData* voxels)
+{
+    static_assert(sizeof(VoxelData) == 16 && offsetof(VoxelData, matId) == 0, "matId is the first uint of a 16 byte voxel");
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(voxels);
+    uint32_t emptyCount = 0;
+#if defined(BVH_USEAVX) && (defined(__x86_64__) || defined(_M_X64))
+    // 4 voxels per step, the matIds are the first lane of each
+    __m128i empty = _mm_setzero_si128();
+    for (int i = 0; i < CUBE_BRICK_VOXELS; i += 4)
     {
-        VoxelData& voxel = baker.voxels[gIdx];
-        if (voxel.matId == 0) continue; // 只处理活跃的cube
-
-        // convert to local position
-        uint y = gIdx / (CUBE_SIZE_XY * CUBE_SIZE_XY);
-        uint z = (gIdx - y * CUBE_SIZE_XY * CUBE_SIZE_XY) / CUBE_SIZE_XY;
-        uint x = gIdx - y * CUBE_SIZE_XY * CUBE_SIZE_XY - z * CUBE_SIZE_XY;
+        __m128i v01 = _mm_unpacklo_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i * 4)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i * 4 + 4)));
+        __m128i v23 = _mm_unpacklo_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i * 4 + 8)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i * 4 + 12)));
+        // equal lanes are -1, subtracting counts them
+        empty = _mm_sub_epi32(empty, _mm_cmpeq_epi32(_mm_unpacklo_epi64(v01, v23), _mm_setzero_si128()));
+    }
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), empty);
+    emptyCount = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(BVH_USENEON)
+    uint32x4_t empty = vdupq_n_u32(0);
+    for (int i = 0; i < CUBE_BRICK_VOXELS; i += 4)
+    {
+        // de-interleaved load, val[0] holds the matIds of 4 voxels
+        uint32x4x4_t v = vld4q_u32(words + i * 4);
+        empty = vsubq_u32(empty, vceqq_u32(v.val[0], vdupq_n_u32(0)));
+    }
+    emptyCount = vaddvq_u32(empty);
+#else
+    for (int i = 0; i < CUBE_BRICK_VOXELS; ++i)
+    {
+        emptyCount += words[i * 4] == 0;
+    }
+#endif
+    return CUBE_BRICK_VOXELS - emptyCount;
+}
 
-        vec3 worldPos = vec3(x, y, z) *  CUBE_UNIT + CUBE_OFFSET;
+bool FCPUPageIndex::ValidateCounts(FCPUProbeBaker& baker) const
+{
+    // full recount straight from the pool, 按brick层切分并行统计，最后按顺序累加
+    const uint32_t pageCount = static_cast<uint32_t>(pageIndex.size());
+    std::vector<uint32_t> voxelCounts = TaskCoordinator::GetInstance()->ParallelReduce(0u, uint32_t(CUBE_BRICKS_Z), 1, std::vector<uint32_t>(pageCount, 0),
+        [&](uint32_t byBegin, uint32_t byEnd)
+        {
+            std::vector<uint32_t> localCounts(pageCount, 0);
+            ivec2 local;
+            for (uint32_t by = byBegin; by < byEnd; ++by)
+                for (int bz = 0; bz < CUBE_BRICKS_XY; ++bz)
+                    for (int bx = 0; bx < CUBE_BRICKS_XY; ++bx)
+                    {
+                        uint32_t entry = baker.BrickEntry(bx, by, bz);
+                        if ((entry & CUBE_BRICK_EMPTY) != 0) continue; // air brick，没有活跃的cube
 
-        // 获取对应的page
-        Assets::PageIndex& page = GetPage(worldPos);
+                        localCounts[GetBrickPage(bx, bz, local)] += CountSolidVoxels(baker.BrickVoxels(entry));
+                    }
+            return localCounts;
+        },
+        [](std::vector<uint32_t> lhs, const std::vector<uint32_t>& rhs)
+        {
+            for (size_t i = 0; i < lhs.size(); ++i)
+            {
+                lhs[i] += rhs[i];
+            }
+            return lhs;
+        });
 
-        // 增加voxel数量
-        page.voxelCount += 1; // 假设每个cube对应一个voxel
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < pageCount; ++i)
+    {
+        if (voxelCounts[i] != pageIndex[i].voxelCount)
+        {
+            SPDLOG_WARN("page {} has {} solid voxels, incremental count says {}", i, voxelCounts[i], pageIndex[i].voxelCount);
+            ++mismatches;
+        }
     }
+    return mismatches == 0;
 }
 
-Assets::PageIndex& FCPUPageIndex::GetPage(glm::vec3 worldpos)
+uint32_t FCPUPageIndex::GetPageIdx(glm::vec3 worldpos) const
 {
     // 假设CUBE_OFFSET定义了世界空间的起始位置
     glm::vec3 relativePos = worldpos - Assets::ACGI_PAGE_OFFSET;
@@ -546,22 +2039,309 @@ Assets::PageIndex& FCPUPageIndex::GetPage(glm::vec3 worldpos)
     pageZ = glm::clamp(pageZ, 0, Assets::ACGI_PAGE_COUNT - 1);
 
     // 计算一维索引
-    int index = pageZ * Assets::ACGI_PAGE_COUNT + pageX;
+    return static_cast<uint32_t>(pageZ * Assets::ACGI_PAGE_COUNT + pageX);
+}
 
+Assets::PageIndex& FCPUPageIndex::GetPage(glm::vec3 worldpos)
+{
     // 返回对应的PageIndex引用
-    return pageIndex[index];
+    return pageIndex[GetPageIdx(worldpos)];
 }
 
-void FCPUPageIndex::UploadGPU(Vulkan::DeviceMemory& gpuMemory)
+void FCPUPageIndex::UploadGPU(Vulkan::DeviceMemory& gpuMemory, FCPUProbeBaker& baker)
 {
-    PageIndex* data = reinterpret_cast<PageIndex*>(gpuMemory.Map(0, sizeof(PageIndex) * pageIndex.size()));
-    std::memcpy(data, pageIndex.data(), pageIndex.size() * sizeof(PageIndex));
+    std::vector<uint64_t> dirtyExt = TakeDirtyBits(baker.dirtyExtBlocks);
+    auto isClean = [](const std::vector<uint64_t>& bits) { return std::all_of(bits.begin(), bits.end(), [](uint64_t word) { return word == 0; }); };
+    if (isClean(dirtyPages) && isClean(dirtyExt))
+    {
+        return;
+    }
+
+    const size_t pageBytes = sizeof(PageIndex) * pageIndex.size();
+    const size_t extCount = baker.brickExt.size();
+    uint8_t* data = reinterpret_cast<uint8_t*>(gpuMemory.Map(0, pageBytes + sizeof(uint32_t) * extCount));
+    ForEachDirtyRun(dirtyPages, [&](uint32_t first, uint32_t count)
+    {
+        std::memcpy(data + first * sizeof(PageIndex), &pageIndex[first], count * sizeof(PageIndex));
+    });
+    ForEachDirtyRun(dirtyExt, [&](uint32_t first, uint32_t count)
+    {
+        size_t begin = size_t(first) * FCPUProbeBaker::DirtyExtBlock;
+        size_t end = std::min(extCount, size_t(first + count) * FCPUProbeBaker::DirtyExtBlock);
+        std::memcpy(data + pageBytes + begin * sizeof(uint32_t), &baker.brickExt[begin], (end - begin) * sizeof(uint32_t));
+    });
     gpuMemory.Unmap();
+    std::fill(dirtyPages.begin(), dirtyPages.end(), 0);
+}
+
+static constexpr float GEdtFar = 1e20f;
+// sdf groups a changed group reaches
+static constexpr int GSdfGroupReach = (CUBE_SDF_RANGE + CUBE_SDF_GROUP_SIZE - 1) / CUBE_SDF_GROUP_SIZE;
+
+// 1D squared euclidean distance transform of n samples at stride (Felzenszwalb & Huttenlocher), in place.
+// d, v need n entries, z n + 1
+static void DistanceTransform1D(float* f, int n, int stride, float* d, int* v, float* z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -GEdtFar;
+    z[1] = GEdtFar;
+    for (int q = 1; q < n; ++q)
+    {
+        float fq = f[q * stride] + float(q * q);
+        float s = (fq - (f[v[k] * stride] + float(v[k] * v[k]))) / float(2 * (q - v[k]));
+        while (s <= z[k])
+        {
+            --k;
+            s = (fq - (f[v[k] * stride] + float(v[k] * v[k]))) / float(2 * (q - v[k]));
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = GEdtFar;
+    }
+    k = 0;
+    for (int q = 0; q < n; ++q)
+    {
+        while (z[k + 1] < float(q))
+        {
+            ++k;
+        }
+        d[q] = float((q - v[k]) * (q - v[k])) + f[v[k] * stride];
+    }
+    for (int q = 0; q < n; ++q)
+    {
+        f[q * stride] = d[q];
+    }
+}
+
+void FCPUDistanceField::Init()
+{
+    // nothing solid yet, everything reads as far outside
+    distances.assign(CUBE_SDF_BYTES, 0xFF);
+    for (int group = 0; group < CUBE_SDF_GROUPS * CUBE_SDF_GROUPS; ++group)
+    {
+        dirtyUploads[group / 64].fetch_or(1ull << (group % 64), std::memory_order_relaxed);
+    }
+}
+
+void FCPUDistanceField::Update(FCPUProbeBaker& baker)
+{
+    std::vector<uint64_t> changed = TakeDirtyBits(baker.solidDirtyGroups);
+    if (std::all_of(changed.begin(), changed.end(), [](uint64_t word) { return word == 0; }))
+    {
+        return;
+    }
+
+    // a voxel's distance only depends on solids within CUBE_SDF_RANGE, so the groups around a changed one are redone too
+    std::array<uint8_t, CUBE_SDF_GROUPS * CUBE_SDF_GROUPS> affected{};
+    for (int group = 0; group < CUBE_SDF_GROUPS * CUBE_SDF_GROUPS; ++group)
+    {
+        if (((changed[group / 64] >> (group % 64)) & 1) == 0)
+        {
+            continue;
+        }
+        int gx = group % CUBE_SDF_GROUPS;
+        int gz = group / CUBE_SDF_GROUPS;
+        for (int z = std::max(0, gz - GSdfGroupReach); z <= std::min(CUBE_SDF_GROUPS - 1, gz + GSdfGroupReach); ++z)
+            for (int x = std::max(0, gx - GSdfGroupReach); x <= std::min(CUBE_SDF_GROUPS - 1, gx + GSdfGroupReach); ++x)
+                affected[z * CUBE_SDF_GROUPS + x] = 1;
+    }
+
+    std::vector<uint32_t> groups;
+    for (uint32_t group = 0; group < affected.size(); ++group)
+    {
+        if (affected[group])
+        {
+            groups.push_back(group);
+        }
+    }
+
+    TaskCoordinator::GetInstance()->ParallelFor(0, static_cast<uint32_t>(groups.size()), 1, [this, &baker, &groups](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            UpdateGroup(baker, groups[i] % CUBE_SDF_GROUPS, groups[i] / CUBE_SDF_GROUPS);
+            dirtyUploads[groups[i] / 64].fetch_or(1ull << (groups[i] % 64), std::memory_order_release);
+        }
+    });
+}
+
+void FCPUDistanceField::UpdateGroup(const FCPUProbeBaker& baker, int gx, int gz)
+{
+    // the group's columns plus CUBE_SDF_RANGE voxels around, full height. a solid further out can't be closer than the range
+    const int x0 = gx * CUBE_SDF_GROUP_SIZE;
+    const int z0 = gz * CUBE_SDF_GROUP_SIZE;
+    const int wx0 = std::max(0, x0 - CUBE_SDF_RANGE);
+    const int wz0 = std::max(0, z0 - CUBE_SDF_RANGE);
+    const int wx = std::min(CUBE_SIZE_XY, x0 + CUBE_SDF_GROUP_SIZE + CUBE_SDF_RANGE) - wx0;
+    const int wz = std::min(CUBE_SIZE_XY, z0 + CUBE_SDF_GROUP_SIZE + CUBE_SDF_RANGE) - wz0;
+    const int wy = CUBE_SIZE_Z;
+    const int sliceStride = wx * wz;
+
+    // squared distance to the nearest solid voxel, and inside solids to the nearest empty one
+    thread_local std::vector<float> outside;
+    thread_local std::vector<float> inside;
+    thread_local std::vector<float> lineD;
+    thread_local std::vector<int> lineV;
+    thread_local std::vector<float> lineZ;
+    outside.resize(sliceStride * wy);
+    inside.resize(sliceStride * wy);
+    const int lineLength = std::max(std::max(wx, wz), wy);
+    lineD.resize(lineLength);
+    lineV.resize(lineLength);
+    lineZ.resize(lineLength + 1);
+
+    for (int y = 0; y < wy; ++y)
+        for (int z = 0; z < wz; ++z)
+            for (int x = 0; x < wx; ++x)
+            {
+                bool solid = baker.voxelSolid[(y * CUBE_SIZE_XY + wz0 + z) * CUBE_SIZE_XY + wx0 + x] != 0;
+                outside[y * sliceStride + z * wx + x] = solid ? 0.0f : GEdtFar;
+                inside[y * sliceStride + z * wx + x] = solid ? GEdtFar : 0.0f;
+            }
+
+    // separable passes, x over the whole window, z only under the group's columns, y only inside the group
+    const int ox0 = x0 - wx0;
+    const int oz0 = z0 - wz0;
+    for (float* field : { outside.data(), inside.data() })
+    {
+        for (int y = 0; y < wy; ++y)
+            for (int z = 0; z < wz; ++z)
+                DistanceTransform1D(field + y * sliceStride + z * wx, wx, 1, lineD.data(), lineV.data(), lineZ.data());
+        for (int y = 0; y < wy; ++y)
+            for (int x = ox0; x < ox0 + CUBE_SDF_GROUP_SIZE; ++x)
+                DistanceTransform1D(field + y * sliceStride + x, wz, wx, lineD.data(), lineV.data(), lineZ.data());
+        for (int z = oz0; z < oz0 + CUBE_SDF_GROUP_SIZE; ++z)
+            for (int x = ox0; x < ox0 + CUBE_SDF_GROUP_SIZE; ++x)
+                DistanceTransform1D(field + z * wx + x, wy, sliceStride, lineD.data(), lineV.data(), lineZ.data());
+    }
+
+    // the surface sits half a voxel from the centres, stored in quarter voxels around 128
+    uint8_t* out = distances.data() + size_t(gz * CUBE_SDF_GROUPS + gx) * CUBE_SIZE_Z * CUBE_SDF_GROUP_SIZE * CUBE_SDF_GROUP_SIZE;
+    for (int y = 0; y < wy; ++y)
+        for (int z = 0; z < CUBE_SDF_GROUP_SIZE; ++z)
+            for (int x = 0; x < CUBE_SDF_GROUP_SIZE; ++x)
+            {
+                int idx = y * sliceStride + (oz0 + z) * wx + ox0 + x;
+                float distance = outside[idx] == 0.0f ? 0.5f - std::sqrt(inside[idx]) : std::sqrt(outside[idx]) - 0.5f;
+                int encoded = static_cast<int>(std::lround(distance * 4.0f)) + 128;
+                *out++ = static_cast<uint8_t>(std::clamp(encoded, 0, 255));
+            }
+}
+
+void FCPUDistanceField::UploadGPU(Vulkan::DeviceMemory& deviceMemory)
+{
+    std::vector<uint64_t> dirty = TakeDirtyBits(dirtyUploads);
+    if (std::all_of(dirty.begin(), dirty.end(), [](uint64_t word) { return word == 0; }))
+    {
+        return;
+    }
+
+    // a group is one contiguous range, neighbouring dirty groups go out in one copy
+    const size_t groupBytes = size_t(CUBE_SIZE_Z) * CUBE_SDF_GROUP_SIZE * CUBE_SDF_GROUP_SIZE;
+    uint8_t* data = reinterpret_cast<uint8_t*>(deviceMemory.Map(0, CUBE_SDF_BYTES));
+    ForEachDirtyRun(dirty, [&](uint32_t first, uint32_t count)
+    {
+        std::memcpy(data + first * groupBytes, distances.data() + first * groupBytes, count * groupBytes);
+    });
+    deviceMemory.Unmap();
+}
+
+// 正交投影，near平面上的世界坐标对像素坐标是仿射的，所以光线原点可以逐像素累加
+struct FShadowRaySetup
+{
+    vec3 origin;        // light space texel (0, 0) on the near plane
+    vec3 stepX;         // one texel right
+    vec3 stepY;         // one texel down
+    vec3 dir;
+    vec3 invDir;
+    // ndc z is 0 at the origins and grows linearly along the ray
+    float depthPerT;
+    float farT;
+    vec3 boundsMin;
+    vec3 boundsMax;
+};
+
+static constexpr int GShadowBlockSize = 16;
+// half extent of every cascade in meters, nearest first
+static constexpr float GShadowCascadeHalfSizes[SHADOWMAP_CASCADES] = { 16.f, 40.f, 100.f, 250.f };
+
+static int PositiveMod(int value, int size)
+{
+    return (value % size + size) % size;
+}
+
+// one block as a stream of parallel rays, each clipped to the scene bounds first. (gridX, gridY) is the light space
+// texel of the block's first ray, rows go down. returns the min / max hit depth
+static vec2 TraceShadowBlock(const FShadowRaySetup& setup, int gridX, int gridY, float* block, int stride)
+{
+    constexpr int blockRays = GShadowBlockSize * GShadowBlockSize;
+    thread_local std::vector<tinybvh::Ray> rays(blockRays);
+    thread_local std::vector<float> rayStart(blockRays);
+    thread_local std::vector<float> rayEnd(blockRays);
+    thread_local std::vector<uint32_t> rayPixel(blockRays);
+
+    // same direction for every ray, copying this skips the normalize and reciprocal of the constructor
+    const tinybvh::Ray prototype(tinybvh::bvhvec3(0.0f), tinybvh::bvhvec3(setup.dir.x, setup.dir.y, setup.dir.z));
+    uint32_t count = 0;
+    for (int y = 0; y < GShadowBlockSize; ++y)
+    {
+        vec3 origin = setup.origin + setup.stepX * float(gridX) + setup.stepY * float(gridY + y);
+        for (int x = 0; x < GShadowBlockSize; ++x, origin += setup.stepX)
+        {
+            uint32_t pixel = y * stride + x;
+            vec3 t0 = (setup.boundsMin - origin) * setup.invDir;
+            vec3 t1 = (setup.boundsMax - origin) * setup.invDir;
+            vec3 tNear = min(t0, t1);
+            vec3 tFar = max(t0, t1);
+            float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+            float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, setup.farT));
+            if (tExit <= tEnter)
+            {
+                block[pixel] = 0.0f;
+                continue;
+            }
+
+            tinybvh::Ray& ray = rays[count];
+            ray = prototype;
+            vec3 start = origin + setup.dir * tEnter;
+            ray.O = tinybvh::bvhvec3(start.x, start.y, start.z);
+            ray.hit.t = tExit - tEnter;
+            rayStart[count] = tEnter;
+            rayEnd[count] = tExit - tEnter;
+            rayPixel[count] = pixel;
+            ++count;
+        }
+    }
+
+    TraceRayStream(rays.data(), count);
+
+    vec2 depthRange(1.0f, 0.0f);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (rays[i].hit.t >= rayEnd[i])
+        {
+            block[rayPixel[i]] = 0.0f;
+            continue;
+        }
+        // same value as projecting the hit point with the light view projection
+        float depth = ((rayStart[i] + rays[i].hit.t) * setup.depthPerT + 1.0f) * 0.5f;
+        block[rayPixel[i]] = depth;
+        depthRange = vec2(std::min(depthRange.x, depth), std::max(depthRange.y, depth));
+    }
+    return depthRange;
 }
 
 void FCPUAccelerationStructure::GenShadowMap(Scene& scene)
 {
-    if (bvhInstanceList.empty())
+    shadowMapInvalid = true;
+    DispatchShadowMap(scene);
+}
+
+void FCPUAccelerationStructure::DispatchShadowMap(Scene& scene)
+{
+    if (bvhInstanceList.empty() || !GCpuBvhReady)
     {
         return;
     }
@@ -570,78 +2350,275 @@ void FCPUAccelerationStructure::GenShadowMap(Scene& scene)
     {
         return;
     }
-    
-    const vec3& sunDir = scene.GetEnvSettings().SunDirection();
-    
-    // 阴影图分辨率设置
-    int shadowMapSize = SHADOWMAP_SIZE;
-    int tileSize = 256; // 每个tile的大小
-    int tilesPerRow = shadowMapSize / tileSize;
-    shadowMapR32.resize(shadowMapSize * shadowMapSize, 0); // 初始化为1.0（不被遮挡）
 
-    // 使用环境设置中的方法获取光源视图投影矩阵
-    mat4 lightViewProj = scene.GetEnvSettings().GetSunViewProjection();
-    mat4 invLVP = inverse(lightViewProj);
-    vec3 lightDir = normalize(-sunDir);
+    // tiles of the previous run are still writing, Tick comes back once they are done
+    if (shadowMapTask != UINT32_MAX && !TaskCoordinator::GetInstance()->IsTaskComplete(shadowMapTask))
+    {
+        return;
+    }
+
+    // the last run never reached its join, shadowMapR32 and the pyramid hold a mix of both windows
+    if (shadowMapPending)
+    {
+        shadowMapPending = false;
+        shadowMapUploads.clear();
+        shadowMapInvalid = true;
+    }
 
-    
-    // 计算当前tile的起始像素坐标
-    for ( int currentTileX = 0; currentTileX < tilesPerRow; ++currentTileX )
+    // 阴影图分辨率设置，2x2个cascade共用一张atlas
+    const int shadowMapSize = SHADOWMAP_SIZE;
+    const int cascadeSize = SHADOWMAP_CASCADE_SIZE;
+    const int tileSize = 256; // 每个tile的大小，一个task一次上传
+    const int tilesPerCascade = cascadeSize / tileSize;
+    const int blocksPerTile = tileSize / GShadowBlockSize;
+    const int blocksPerRow = shadowMapSize / GShadowBlockSize;
+    if (shadowMapR32.empty())
     {
-        for ( int currentTileY = 0; currentTileY < tilesPerRow; ++currentTileY )
+        shadowMapR32.resize(shadowMapSize * shadowMapSize, 0);
+
+        // level 0 per block, reduced to 1x1 once every tile is done
+        uint32_t pyramidSize = 0;
+        for (uint32_t levelSize = blocksPerRow; levelSize > 0; levelSize /= 2)
         {
-            int startX = currentTileX * tileSize;
-            int startY = currentTileY * tileSize;
+            shadowDepthPyramid.levelOffsets.push_back(pyramidSize);
+            shadowDepthPyramid.levelSizes.push_back(levelSize);
+            pyramidSize += levelSize * levelSize;
+        }
+        shadowDepthPyramid.minMax.assign(pyramidSize, vec2(1.0f, 0.0f));
+    }
+
+    // windows around the camera, snapped to whole blocks so a block never straddles the wrap of the storage
+    const EnvironmentSetting& env = scene.GetEnvSettings();
+    const mat4 sunView = env.GetSunView();
+    const vec2 cameraLight = vec2(sunView * vec4(shadowCameraPos, 1.0f));
+    const bool full = shadowMapInvalid;
+    std::array<FCPUShadowCascade, SHADOWMAP_CASCADES> windows;
+    bool moved = false;
+    for (int cascade = 0; cascade < SHADOWMAP_CASCADES; ++cascade)
+    {
+        const float texelSize = GShadowCascadeHalfSizes[cascade] * 2.0f / float(cascadeSize);
+        FCPUShadowCascade& window = windows[cascade];
+        window.origin = ivec2(floor(cameraLight / (texelSize * GShadowBlockSize))) * GShadowBlockSize - cascadeSize / 2;
+        window.viewProjection = EnvironmentSetting::GetSunProjection(vec2(window.origin) * texelSize, vec2(window.origin + cascadeSize) * texelSize) * sunView;
+        // storage column = light texel x mod size, storage row = (size - 1 - light texel y) mod size
+        window.offset = vec4(float(PositiveMod(window.origin.x, cascadeSize)) / float(cascadeSize),
+            float(PositiveMod(-window.origin.y, cascadeSize)) / float(cascadeSize), texelSize, 1.0f);
+        moved |= full || shadowCascades[cascade].offset.w == 0.0f || window.origin != shadowCascades[cascade].origin;
+    }
+    if (!moved)
+    {
+        return;
+    }
+    shadowMapInvalid = false;
+
+    FShadowRaySetup baseSetup;
+    const mat4 invView = inverse(sunView);
+    // view space z of the near plane, shared by every window
+    const float nearZ = (sunView * inverse(windows[0].viewProjection) * vec4(0.0f, 0.0f, 0.0f, 1.0f)).z;
+    baseSetup.dir = normalize(-env.SunDirection());
+    // the slab test divides by the direction, keep it away from 0
+    baseSetup.invDir = 1.0f / mix(baseSetup.dir, vec3(1e-8f), lessThan(abs(baseSetup.dir), vec3(1e-8f)));
+    baseSetup.depthPerT = (windows[0].viewProjection * vec4(baseSetup.dir, 0.0f)).z;
+    // the far plane, ndc z 1
+    baseSetup.farT = 1.0f / baseSetup.depthPerT;
+    baseSetup.boundsMin = vec3(GCpuBvh.bvhNode[0].aabbMin.x, GCpuBvh.bvhNode[0].aabbMin.y, GCpuBvh.bvhNode[0].aabbMin.z);
+    baseSetup.boundsMax = vec3(GCpuBvh.bvhNode[0].aabbMax.x, GCpuBvh.bvhNode[0].aabbMax.y, GCpuBvh.bvhNode[0].aabbMax.z);
+
+    // scene bounds in light view space, blocks outside never hit anything
+    vec2 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        vec3 p((corner & 1) ? baseSetup.boundsMax.x : baseSetup.boundsMin.x, (corner & 2) ? baseSetup.boundsMax.y : baseSetup.boundsMin.y, (corner & 4) ? baseSetup.boundsMax.z : baseSetup.boundsMin.z);
+        vec2 light = vec2(sunView * vec4(p, 1.0f));
+        sceneMin = min(sceneMin, light);
+        sceneMax = max(sceneMax, light);
+    }
 
-                // 处理当前tile
-            TaskCoordinator::GetInstance()->AddParralledTask(
-                [this, lightViewProj, invLVP, lightDir, startX, startY, tileSize, shadowMapSize](ResTask& task)
+    struct FShadowBlockJob
+    {
+        int atlasX;         // first pixel in the atlas
+        int atlasY;
+        int gridX;          // first light space texel, rows go down
+        int gridY;
+        bool inScene;
+    };
+    struct FShadowTileJob
+    {
+        int cascade;
+        float distance;     // nearest dirty block to the camera, in meters
+        ivec2 uploadMin;
+        ivec2 uploadMax;
+        std::vector<FShadowBlockJob> blocks;
+    };
+    std::vector<FShadowTileJob> tileJobs;
+
+    for (int cascade = 0; cascade < SHADOWMAP_CASCADES; ++cascade)
+    {
+        const FCPUShadowCascade& window = windows[cascade];
+        const FCPUShadowCascade& previous = shadowCascades[cascade];
+        // nothing was ever uploaded into this quadrant, even empty blocks have to be written once
+        const bool neverWritten = previous.offset.w == 0.0f;
+        const bool cascadeFull = full || neverWritten;
+        const float texelSize = window.offset.z;
+        const ivec2 storageOffset = ivec2(PositiveMod(window.origin.x, cascadeSize), PositiveMod(-window.origin.y, cascadeSize));
+        const ivec2 quadrant = ivec2(cascade & 1, cascade >> 1) * cascadeSize;
+        const ivec2 sceneTexelMin = ivec2(floor(sceneMin / texelSize)) - 1;
+        const ivec2 sceneTexelMax = ivec2(ceil(sceneMax / texelSize)) + 1;
+
+        for (int tileY = 0; tileY < tilesPerCascade; ++tileY)
+        {
+            for (int tileX = 0; tileX < tilesPerCascade; ++tileX)
+            {
+                FShadowTileJob tile{ cascade, FLT_MAX, ivec2(INT_MAX), ivec2(-1), {} };
+                bool changes = false;
+                for (int blockY = 0; blockY < blocksPerTile; ++blockY)
                 {
-                    for (int y = 0; y < tileSize; y++)
+                    for (int blockX = 0; blockX < blocksPerTile; ++blockX)
                     {
-                        for (int x = 0; x < tileSize; x++)
+                        const ivec2 storage = ivec2(tileX * tileSize + blockX * GShadowBlockSize, tileY * tileSize + blockY * GShadowBlockSize);
+                        // light texels of the block: x from ix to ix + 15, y from iy down to iy - 15
+                        const int ix = window.origin.x + PositiveMod(storage.x - storageOffset.x, cascadeSize);
+                        const int row = PositiveMod(storage.y - storageOffset.y, cascadeSize);
+                        const int iy = window.origin.y + cascadeSize - 1 - row;
+
+                        // still in the window the texture holds, the texels are already where they belong
+                        if (!cascadeFull && ix >= previous.origin.x && ix < previous.origin.x + cascadeSize
+                            && iy - GShadowBlockSize + 1 >= previous.origin.y && iy < previous.origin.y + cascadeSize)
                         {
-                            int pixelX = startX + x;
-                            int pixelY = startY + y;
-                            
-                            // 计算NDC坐标
-                            float ndcX = (pixelX / static_cast<float>(shadowMapSize - 1)) * 2.0f - 1.0f;
-                            float ndcY = 1.0f - (pixelY / static_cast<float>(shadowMapSize - 1)) * 2.0f;
-                            
-                            // 从NDC空间变换到世界空间
-                            vec4 worldPos = invLVP * vec4(ndcX, ndcY, 0.0f, 1.0f);
-                            worldPos /= worldPos.w;
-                            
-                            // 发射光线
-                            vec3 origin = vec3(worldPos);
-                            vec3 rayDir = normalize(lightDir);
-                            
-                            tinybvh::Ray ray(
-                                tinybvh::bvhvec3(origin.x, origin.y, origin.z),
-                                tinybvh::bvhvec3(rayDir.x, rayDir.y, rayDir.z),
-                                10000.0f
-                            );
-                            
-                            GCpuBvh.Intersect(ray);
-                            if (ray.hit.t < 9999.0f)
-                            {
-                                vec3 hitPoint = origin + rayDir * ray.hit.t;
-                                vec4 hitPosInLightSpace = lightViewProj * vec4(hitPoint, 1.0f);
-                                float depth = (hitPosInLightSpace.z / hitPosInLightSpace.w + 1.0f) * 0.5f;
-                                shadowMapR32[pixelY * shadowMapSize + pixelX] = depth;
-                            }
+                            continue;
+                        }
+
+                        const ivec2 atlas = quadrant + storage;
+                        const bool inScene = ix <= sceneTexelMax.x && ix + GShadowBlockSize > sceneTexelMin.x
+                            && iy >= sceneTexelMin.y && iy - GShadowBlockSize < sceneTexelMax.y;
+                        const vec2 depthRange = shadowDepthPyramid.Get(0, atlas.x / GShadowBlockSize, atlas.y / GShadowBlockSize);
+                        // the gpu copy only needs clearing if this block had hits
+                        if (!inScene && depthRange.x > depthRange.y && !neverWritten)
+                        {
+                            continue;
                         }
+
+                        tile.blocks.push_back({ atlas.x, atlas.y, ix, -iy, inScene });
+                        tile.uploadMin = min(tile.uploadMin, atlas);
+                        tile.uploadMax = max(tile.uploadMax, atlas + GShadowBlockSize);
+                        changes = true;
+
+                        vec2 blockCenter = (vec2(ix, iy - GShadowBlockSize + 1) + GShadowBlockSize * 0.5f) * texelSize;
+                        tile.distance = std::min(tile.distance, length(blockCenter - cameraLight));
                     }
-                },
-                [this, &scene, shadowMapSize, startX, startY, tileSize](ResTask& task)
+                }
+                if (changes)
                 {
-                    // 更新当前tile到GPU
-                    Vulkan::CommandPool& commandPool = GlobalTexturePool::GetInstance()->GetMainThreadCommandPool();
-                    const unsigned char* tileData = reinterpret_cast<const unsigned char*>(shadowMapR32.data());
-                    scene.ShadowMap().UpdateDataMainThread(commandPool, startX, startY, tileSize, tileSize, shadowMapSize, shadowMapSize,
-                        tileData, shadowMapSize * shadowMapSize * sizeof(float));
+                    tileJobs.push_back(std::move(tile));
                 }
-            );
+            }
+        }
+    }
+
+    // nearest tiles first, the finer cascade wins a tie
+    std::sort(tileJobs.begin(), tileJobs.end(), [](const FShadowTileJob& a, const FShadowTileJob& b)
+    {
+        return a.distance != b.distance ? a.distance < b.distance : a.cascade < b.cascade;
+    });
+
+    for (int cascade = 0; cascade < SHADOWMAP_CASCADES; ++cascade)
+    {
+        if (shadowCascades[cascade].offset.w == 0.0f)
+        {
+            shadowCascades[cascade] = windows[cascade];
         }
     }
+    shadowCascadesTracing = windows;
+
+    std::vector<uint32_t> tileTasks;
+    tileTasks.reserve(tileJobs.size());
+    for (FShadowTileJob& tile : tileJobs)
+    {
+        FShadowRaySetup setup = baseSetup;
+        const float texelSize = windows[tile.cascade].offset.z;
+        setup.origin = vec3(invView * vec4(0.5f * texelSize, 0.5f * texelSize, nearZ, 1.0f));
+        setup.stepX = vec3(invView * vec4(texelSize, 0.0f, 0.0f, 0.0f));
+        setup.stepY = vec3(invView * vec4(0.0f, -texelSize, 0.0f, 0.0f));
+
+        // 处理当前tile
+        uint32_t taskId = TaskCoordinator::GetInstance()->AddParralledTask(
+            [this, setup, blocks = std::move(tile.blocks), shadowMapSize](ResTask& task)
+            {
+                FCPUTraversalGate::Scope traversal(traversalGate);
+                for (const FShadowBlockJob& block : blocks)
+                {
+                    if (task.IsCancelled())
+                    {
+                        return;
+                    }
+                    float* blockData = &shadowMapR32[block.atlasY * shadowMapSize + block.atlasX];
+                    vec2 depthRange(1.0f, 0.0f);
+                    if (block.inScene)
+                    {
+                        depthRange = TraceShadowBlock(setup, block.gridX, block.gridY, blockData, shadowMapSize);
+                    }
+                    else
+                    {
+                        for (int y = 0; y < GShadowBlockSize; ++y)
+                        {
+                            std::fill_n(blockData + y * shadowMapSize, GShadowBlockSize, 0.0f);
+                        }
+                    }
+                    shadowDepthPyramid.minMax[(block.atlasY / GShadowBlockSize) * (shadowMapSize / GShadowBlockSize) + block.atlasX / GShadowBlockSize] = depthRange;
+                }
+            },
+            [this, uploadMin = tile.uploadMin, uploadSize = tile.uploadMax - tile.uploadMin](ResTask& task)
+            {
+                // the texture keeps the old texels until the join publishes the new windows with them
+                shadowMapUploads.emplace_back(uploadMin.x, uploadMin.y, uploadSize.x, uploadSize.y);
+            },
+            std::vector<uint32_t>{}, ETaskPriority::Background
+        );
+        tileTasks.push_back(taskId);
+    }
+
+    shadowMapUploads.clear();
+    shadowMapTileCount = tileTasks.size();
+    shadowMapPending = true;
+
+    // every level above 0 once all tiles are in, then the texture and the windows switch over together
+    shadowMapTask = TaskCoordinator::GetInstance()->AddJoinTask(tileTasks, [this, &scene, shadowMapSize](ResTask& task)
+    {
+        shadowMapPending = false;
+        // a cancelled tile skipped its completion, its blocks are half traced
+        if (shadowMapUploads.size() != shadowMapTileCount)
+        {
+            shadowMapUploads.clear();
+            shadowMapInvalid = true;
+            return;
+        }
+
+        FCPUShadowDepthPyramid& pyramid = shadowDepthPyramid;
+        for (size_t level = 1; level < pyramid.levelSizes.size(); ++level)
+        {
+            const uint32_t size = pyramid.levelSizes[level];
+            for (uint32_t y = 0; y < size; ++y)
+            {
+                for (uint32_t x = 0; x < size; ++x)
+                {
+                    vec2 a = pyramid.Get(uint32_t(level - 1), x * 2, y * 2);
+                    vec2 b = pyramid.Get(uint32_t(level - 1), x * 2 + 1, y * 2);
+                    vec2 c = pyramid.Get(uint32_t(level - 1), x * 2, y * 2 + 1);
+                    vec2 d = pyramid.Get(uint32_t(level - 1), x * 2 + 1, y * 2 + 1);
+                    pyramid.minMax[pyramid.levelOffsets[level] + y * size + x] = vec2(std::min(std::min(a.x, b.x), std::min(c.x, d.x)), std::max(std::max(a.y, b.y), std::max(c.y, d.y)));
+                }
+            }
+        }
+
+        // 更新所有tile里变化的部分到GPU
+        Vulkan::CommandPool& commandPool = GlobalTexturePool::GetInstance()->GetMainThreadCommandPool();
+        const unsigned char* tileData = reinterpret_cast<const unsigned char*>(shadowMapR32.data());
+        for (const glm::ivec4& upload : shadowMapUploads)
+        {
+            scene.ShadowMap().UpdateDataMainThread(commandPool, upload.x, upload.y, upload.z, upload.w, shadowMapSize, shadowMapSize,
+                tileData, shadowMapSize * shadowMapSize * sizeof(float));
+        }
+        shadowMapUploads.clear();
+        shadowCascades = shadowCascadesTracing;
+    }, ETaskPriority::Background);
 }
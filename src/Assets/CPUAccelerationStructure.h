@@ -3,7 +3,11 @@
 #include "Assets/UniformBuffer.hpp"
 #include <glm/glm.hpp>
 #include "ThirdParty/tinybvh/tiny_bvh.h"
+#include <array>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <queue>
 
 #include "Material.hpp"
@@ -24,9 +28,19 @@ namespace std {
     };
 }
 
+namespace Utilities
+{
+    namespace FileHelper
+    {
+        class FMappedFile;
+    }
+}
+
 namespace Assets
 {
     class Scene;
+    class Node;
+    class Model;
     struct RayCastResult;
 }
 
@@ -35,6 +49,8 @@ namespace Vulkan
     class DeviceMemory;
 }
 
+struct ResTask;
+
 enum class ECubeProcType : uint8_t
 {
     ECPT_Clear,
@@ -47,6 +63,42 @@ enum class EBakerType : uint8_t
     EBT_Probe,
 };
 
+// BLAS节点布局，TLAS始终是二叉BVH，tinybvh只支持这种布局做TLAS遍历
+enum class ECPUBVHLayout : uint8_t
+{
+    ECBL_Binary,    // tinybvh::BVH, 32 byte nodes
+    ECBL_SoA,       // tinybvh::BVH_SoA, both child boxes in one simd test
+    ECBL_Wide4,     // tinybvh::BVH4_CPU, 4-wide nodes with precomputed triangles
+    ECBL_Count,
+};
+
+const char* GetCPUBVHLayoutName(ECPUBVHLayout layout);
+
+enum class ECPURayQueryType : uint8_t
+{
+    ECRQ_ClosestHit,    // full RayCastResult
+    ECRQ_AnyHit,        // stops at the first hit on the way, only Hitted is set
+};
+
+enum class ECPURayQueryStatus : uint8_t
+{
+    ECRS_Pending,       // queued or tracing
+    ECRS_Ready,
+    ECRS_Expired,       // results are kept for a few frames only, or the handle was never submitted
+    ECRS_Cancelled,     // the batch was dropped by CancelAllParralledTasks (scene switch, shutdown), nothing was traced
+};
+
+struct FCPURayQuery
+{
+    glm::vec3 origin{};
+    glm::vec3 dir{0.0f, 0.0f, 1.0f};
+    float maxDist = 2000.0f;
+    ECPURayQueryType type = ECPURayQueryType::ECRQ_ClosestHit;
+};
+
+// handles count up, a batch submit of n queries gets n consecutive handles starting at the returned one
+using FCPURayQueryHandle = uint32_t;
+
 struct FCPUBLASVertInfo
 {
     glm::vec3 normal;
@@ -55,40 +107,176 @@ struct FCPUBLASVertInfo
 
 struct FCPUTLASInstanceInfo
 {
-    std::array<uint32_t, 16> matIdxs;
-    uint32_t nodeId;
+    std::array<uint32_t, 16> matIdxs{};
+    uint32_t nodeId = 0;
+    uint32_t modelId = UINT32_MAX;
+    // slot of a removed node, kept out of reach until an added node reuses it or the next rebuild compacts it away
+    bool parked = false;
+};
+
+// bake tasks stay inside the gate while they traverse the BVH, the main thread closes it to edit instances and the TLAS.
+// closing only waits for traversals already running, queued tasks start after the edit
+class FCPUTraversalGate
+{
+public:
+    void Enter();
+    void Leave();
+    void Close();
+    void Open();
+
+    struct Scope
+    {
+        explicit Scope(FCPUTraversalGate& gate) : gate_(gate) { gate_.Enter(); }
+        ~Scope() { gate_.Leave(); }
+        FCPUTraversalGate& gate_;
+    };
+
+    struct Closed
+    {
+        explicit Closed(FCPUTraversalGate& gate) : gate_(gate) { gate_.Close(); }
+        ~Closed() { gate_.Open(); }
+        FCPUTraversalGate& gate_;
+    };
+
+private:
+    std::atomic<bool> closed_{false};
+    std::atomic<uint32_t> active_{0};
 };
 
 struct FCPUBLASContext
 {
+    ~FCPUBLASContext();
+
+    // set when bvh's nodes and indices live in the mapped cache file instead of tinybvh allocations
+    std::shared_ptr<Utilities::FileHelper::FMappedFile> cacheFile;
     tinybvh::BVH bvh;
+    // converted from bvh on first use and share its index data, primitive indices stay the same in every layout
+    tinybvh::BVH_SoA bvhSoA;
+    tinybvh::BVH4_CPU bvh4;
+    uint32_t convertedLayouts = 0;
     std::vector<tinybvh::bvhvec4> triangles;
     std::vector<FCPUBLASVertInfo> extinfos;
+
+    tinybvh::BVHBase* GetTraversalBVH(ECPUBVHLayout layout);
 };
 
+struct FCPUPageIndex;
+
 // 抽象一个CPUBaker，拥有独立的上下文和独立的Task发起机制
 // 由CpuAS来控制
+// 体素按4x4x4的brick存储，只有靠近几何体的brick占用pool里的slot，空气brick只在brick表里留一个最小距离
 struct FCPUProbeBaker
 {
+    static constexpr uint32_t BrickChunkSlots = 256;
+    static constexpr uint32_t DirtyExtBlock = 64;
+
     float UNIT_SIZE;
     glm::vec3 CUBE_OFFSET;
-    
-    std::vector<Assets::VoxelData> voxels;
 
-    void Init( float unit_size, glm::vec3 offset );
+    // same layout as behind the gpu PageIndex array: CUBE_BRICK_CAPACITY slot -> packed brick coords, then the per page brick tables
+    std::vector<uint32_t> brickExt;
+    // grid brick (by * CUBE_BRICKS_XY + bz) * CUBE_BRICKS_XY + bx -> its brick table entry in brickExt
+    std::vector<uint32_t> brickTableIdx;
+    // voxel pool, BrickChunkSlots slots per chunk, a chunk is allocated when one of its slots is first used
+    std::vector<std::unique_ptr<Assets::VoxelData[]>> brickChunks;
+    std::vector<uint32_t> freeBrickSlots;
+    // bricks that found the pool full and were stored as air
+    std::atomic<uint32_t> brickOverflow{0};
+    // solid (matId != 0) voxels per grid brick and per page, kept current by StoreBrick
+    std::vector<uint8_t> brickSolidCounts;
+    std::array<std::atomic<uint32_t>, Assets::ACGI_PAGE_COUNT * Assets::ACGI_PAGE_COUNT> pageSolidCounts{};
+    // changed since the last upload: one bit per pool slot, one bit per DirtyExtBlock uints of brickExt
+    std::array<std::atomic<uint64_t>, Assets::CUBE_BRICK_CAPACITY / 64> dirtySlots{};
+    std::array<std::atomic<uint64_t>, (Assets::CUBE_BRICK_CAPACITY + Assets::CUBE_BRICK_TABLE_PAGES * Assets::CUBE_BRICK_TABLE_SIZE) / DirtyExtBlock / 64 + 1> dirtyExtBlocks{};
+    // 1 per solid voxel, (y * CUBE_SIZE_XY + z) * CUBE_SIZE_XY + x, and the sdf groups whose occupancy changed since FCPUDistanceField took them
+    std::vector<uint8_t> voxelSolid;
+    std::array<std::atomic<uint64_t>, Assets::CUBE_SDF_GROUPS * Assets::CUBE_SDF_GROUPS / 64 + 1> solidDirtyGroups{};
+    // guards the free list and chunk allocation, groups write disjoint bricks otherwise
+    std::mutex brickMutex;
+
+    void Init( float unit_size, glm::vec3 offset, const FCPUPageIndex& pageIndex );
     void ProcessCube(int x, int y, int z, ECubeProcType procType);
+    // 整个group的体素按方向组成ray stream一次提交，返回false表示中途被取消，此时brick不会被写入
+    // x0, z0 and groupSize are multiples of CUBE_BRICK_SIZE
+    bool ProcessGroup(int x0, int z0, int groupSize, ECubeProcType procType, ResTask& task);
+    // writes only the bricks stored since the last upload
     void UploadGPU(Vulkan::DeviceMemory& voxelDeviceMemory);
     void ClearAmbientCubes();
+
+    // 64 voxels of a brick in (ly * 4 + lz) * 4 + lx order, air bricks come back synthesized
+    void LoadBrick(int bx, int by, int bz, Assets::VoxelData* outVoxels);
+    // keeps or takes a pool slot while any voxel is near geometry, gives it back once the brick turns to air
+    void StoreBrick(int bx, int by, int bz, const Assets::VoxelData* voxels);
+    uint32_t BrickEntryIdx(int bx, int by, int bz) const { return brickTableIdx[(by * Assets::CUBE_BRICKS_XY + bz) * Assets::CUBE_BRICKS_XY + bx]; }
+    uint32_t& BrickEntry(int bx, int by, int bz) { return brickExt[BrickEntryIdx(bx, by, bz)]; }
+    Assets::VoxelData* BrickVoxels(uint32_t slot) { return brickChunks[slot / BrickChunkSlots].get() + (slot % BrickChunkSlots) * Assets::CUBE_BRICK_VOXELS; }
+
+private:
+    // CUBE_BRICK_FREE when the pool is full
+    uint32_t AllocBrickSlot(int bx, int by, int bz);
+    void FreeBrickSlot(uint32_t slot);
+    void MarkExtDirty(uint32_t extIdx);
+    void SetBrickSolidCount(int bx, int by, int bz, uint32_t solidCount);
+    // nullptr stores the brick as all empty
+    void SetBrickOccupancy(int bx, int by, int bz, const Assets::VoxelData* voxels);
+};
+
+// signed distance field over the probe grid, rebuilt per CUBE_SDF_GROUP_SIZE column group from the baker's occupancy.
+// only groups within CUBE_SDF_RANGE of a changed one are recomputed, each as an exact euclidean transform over its neighbourhood
+struct FCPUDistanceField
+{
+    // gpu layout, see CUBE_SDF_BYTES
+    std::vector<uint8_t> distances;
+    // groups written since the last upload
+    std::array<std::atomic<uint64_t>, Assets::CUBE_SDF_GROUPS * Assets::CUBE_SDF_GROUPS / 64 + 1> dirtyUploads{};
+
+    void Init();
+    // takes the baker's changed groups, runs on the parallel pool while no group is baking
+    void Update(FCPUProbeBaker& baker);
+    void UploadGPU(Vulkan::DeviceMemory& deviceMemory);
+
+private:
+    void UpdateGroup(const FCPUProbeBaker& baker, int gx, int gz);
 };
 
 struct FCPUPageIndex
 {
     std::vector<Assets::PageIndex> pageIndex;
+    // pages changed since the last upload, one bit each
+    std::vector<uint64_t> dirtyPages;
 
+    // also places the brick table of every page the probe grid overlaps
     void Init();
+    // copies the baker's incremental counts, cheap enough for every flush
     void UpdateData(FCPUProbeBaker& baker);
+    // recounts every page from the brick pool and logs pages that differ from the incremental counts
+    bool ValidateCounts(FCPUProbeBaker& baker) const;
     Assets::PageIndex& GetPage(glm::vec3 worldpos);
-    void UploadGPU(Vulkan::DeviceMemory& deviceMemory);
+    uint32_t GetPageIdx(glm::vec3 worldpos) const;
+    // page array followed by the baker's brick coords and tables, only the changed parts are written
+    void UploadGPU(Vulkan::DeviceMemory& deviceMemory, FCPUProbeBaker& baker);
+};
+
+// by-product of the shadow map: level 0 has one texel per 16x16 block of the atlas storage, each level above halves
+// the previous one down to 1x1. x is the nearest, y the farthest hit depth, (1, 0) means nothing was hit
+struct FCPUShadowDepthPyramid
+{
+    std::vector<glm::vec2> minMax;
+    std::vector<uint32_t> levelOffsets;
+    std::vector<uint32_t> levelSizes;
+
+    glm::vec2 Get(uint32_t level, uint32_t x, uint32_t y) const { return minMax[levelOffsets[level] + y * levelSizes[level] + x]; }
+};
+
+// one camera-centred sun shadow cascade, a SHADOWMAP_CASCADE_SIZE square of the atlas. the window moves in steps of
+// whole texels and its storage wraps around, a light space texel keeps its atlas texel while it stays in the window
+struct FCPUShadowCascade
+{
+    glm::mat4 viewProjection{};
+    // xy storage offset in uv, z texel size in meters, w 1 once the cascade holds data. see SunCascadeOffsets
+    glm::vec4 offset{};
+    // window min corner in light space texels
+    glm::ivec2 origin{};
 };
 
 class FCPUAccelerationStructure
@@ -96,32 +284,140 @@ class FCPUAccelerationStructure
 public:
     void InitBVH(Assets::Scene& scene);
 
+    // only instances whose node was added, removed or moved are touched, the TLAS is refitted
+    // and rebuilt when it runs out of free slots or the refit degraded it too much
     void UpdateBVH(Assets::Scene& scene);
 
     Assets::RayCastResult RayCastInCPU(glm::vec3 rayOrigin, glm::vec3 rayDir);
+
+    // batched closest-hit trace, results land in rays[i].hit. keep rays with the same direction and neighbouring origins adjacent
+    void TraceRays(tinybvh::Ray* rays, uint32_t count) const;
+
+    // any-hit through the TLAS, stops at the first triangle within maxDist. use it when only yes / no matters
+    bool IsOccluded(glm::vec3 origin, glm::vec3 dir, float maxDist) const;
+    // batched any-hit, rays[i].hit.t is the length of each query, outOccluded[i] gets 1 when something is in the way
+    void OccludedRays(const tinybvh::Ray* rays, uint32_t count, uint8_t* outOccluded) const;
+
+    // async ray queries, submit from any thread. everything submitted between two frames is traced as one batch on the pool,
+    // results can be read from the next frame on and stay around for RayQueryKeepFrames frames after they land
+    FCPURayQueryHandle SubmitRayQuery(const FCPURayQuery& query);
+    FCPURayQueryHandle SubmitRayQueries(const FCPURayQuery* queries, uint32_t count);
+    ECPURayQueryStatus GetRayQueryResult(FCPURayQueryHandle handle, Assets::RayCastResult& outResult);
+    // every frame, not throttled like Tick: queued ray queries become one batch of pool tasks, old batches are dropped
+    void DispatchRayQueries();
     
-    bool AsyncProcessFull(Assets::Scene& scene, Vulkan::DeviceMemory* VoxelGPUMemory, bool Incremental = false);
-    void AsyncProcessGroup(int xInMeter, int zInMeter, Assets::Scene& scene, ECubeProcType procType, EBakerType bakerType);
+    bool AsyncProcessFull(Assets::Scene& scene, Vulkan::DeviceMemory* VoxelGPUMemory, Vulkan::DeviceMemory* PageIndexGPUMemory, bool Incremental = false);
+    uint32_t AsyncProcessGroup(int xInMeter, int zInMeter, Assets::Scene& scene, ECubeProcType procType, EBakerType bakerType);
     
-    void Tick(Assets::Scene& scene, Vulkan::DeviceMemory* GPUMemory, Vulkan::DeviceMemory* FarGPUMemory, Vulkan::DeviceMemory* PageIndexMemory);
+    void Tick(Assets::Scene& scene, Vulkan::DeviceMemory* GPUMemory, Vulkan::DeviceMemory* FarGPUMemory, Vulkan::DeviceMemory* PageIndexMemory, Vulkan::DeviceMemory* DistanceFieldMemory);
 
+    // re-bakes the probe groups within radius of worldPos, coalesced with scene edits
     void RequestUpdate(glm::vec3 worldPos, float radius);
 
+    // marks the 16x16 voxel column groups a world box touches, Tick re-bakes them once the running batch is done
+    void InvalidateRegion(glm::vec3 boundsMin, glm::vec3 boundsMax);
+
+    // sun or scene changed: every cascade is re-traced around the camera. Tick scrolls the cascades after the camera
+    // and only traces the strips a move exposes, nearest tiles first. work is traced per 256x256 tile on the pool
+    // and uploaded tile by tile, a request while the previous one is still tracing runs once that one is done
     void GenShadowMap(Assets::Scene& scene);
+    const FCPUShadowDepthPyramid& GetShadowDepthPyramid() const { return shadowDepthPyramid; }
+    // the cascades the shadow map texture currently holds
+    const FCPUShadowCascade& GetShadowCascade(int cascade) const { return shadowCascades[cascade]; }
+
+    // waits for running bake tasks, converts the BLASes if needed and rebuilds the TLAS over them
+    void SetBVHLayout(Assets::Scene& scene, ECPUBVHLayout layout);
+    ECPUBVHLayout GetBVHLayout() const { return bvhLayout; }
+
+    // logs Mrays/s of every layout for probe-bake rays and random rays in the scene bounds, restores the current layout
+    void BenchmarkBVHLayouts(Assets::Scene& scene);
 
 private:
+    // turn queued groups into task graph nodes, fences become join nodes with an upload continuation
+    void DispatchPendingGroups(Assets::Scene& scene);
+    void FlushGPU();
+
+    // triangles, extinfos and bvh of one model, runs on the parallel pool. returns true when the bvh came from the cache
+    bool BuildBLAS(FCPUBLASContext& context, const Assets::Model& model, uint32_t modelIdx);
+
+    // callers hold the traversal gate closed
+    void UpdateInstances(Assets::Scene& scene);
+    void FillInstance(uint32_t slot, Assets::Node& node);
+    void ParkInstance(uint32_t slot);
+    void RebuildTLAS();
+    void InvalidateInstance(uint32_t slot);
+    // every dirty group plus a fence into needUpdateGroups
+    void QueueDirtyGroups();
+    // traces whatever the cascade windows around shadowCameraPos need, nothing while a previous run is going
+    void DispatchShadowMap(Assets::Scene& scene);
+
     std::vector<FCPUBLASContext> bvhBLASContexts;
     std::vector<tinybvh::BLASInstance> bvhInstanceList;
     std::vector<FCPUTLASInstanceInfo> bvhTLASContexts;
     std::vector<tinybvh::BVHBase*> bvhBLASList;
+    ECPUBVHLayout bvhLayout = ECPUBVHLayout::ECBL_Binary;
+
+    // node instance id -> slot in bvhInstanceList / bvhTLASContexts
+    std::unordered_map<uint32_t, uint32_t> instanceSlots;
+    std::vector<uint32_t> freeInstanceSlots;
+    std::vector<uint8_t> instanceSeen;
+    // sah cost right after the last full build, refits that exceed it by too much trigger a rebuild
+    float tlasBuildCost = 0.0f;
+    FCPUTraversalGate traversalGate;
         
+    // groups dispatched since the last fence, and the fence the next groups depend on
     std::vector<uint32_t> lastBatchTasks;
+    uint32_t lastFenceTask = UINT32_MAX;
+
+    Vulkan::DeviceMemory* voxelGPUMemory = nullptr;
+    Vulkan::DeviceMemory* pageIndexGPUMemory = nullptr;
+    Vulkan::DeviceMemory* distanceFieldGPUMemory = nullptr;
 
     std::queue<std::tuple<glm::ivec3, ECubeProcType, EBakerType> > needUpdateGroups;
 
+    // probe bake works on columns of ProbeGroupSize x ProbeGroupSize voxels
+    static constexpr int ProbeGroupSize = 16;
+    static constexpr int ProbeGroupCount = Assets::CUBE_SIZE_XY / ProbeGroupSize;
+    // groups touched by edits since the last incremental batch went out, repeated edits land on the same flag
+    std::array<uint8_t, ProbeGroupCount * ProbeGroupCount> dirtyGroups{};
+    uint32_t dirtyGroupCount = 0;
+
     std::vector<float> shadowMapR32;
+    FCPUShadowDepthPyramid shadowDepthPyramid;
+    std::array<FCPUShadowCascade, Assets::SHADOWMAP_CASCADES> shadowCascades{};
+    // windows of the running scroll, published to shadowCascades once its tiles are in
+    std::array<FCPUShadowCascade, Assets::SHADOWMAP_CASCADES> shadowCascadesTracing{};
+    glm::vec3 shadowCameraPos{};
+    uint32_t shadowMapTask = UINT32_MAX;
+    // changed rects of finished tiles (x, y, w, h), uploaded together with the publish in the join
+    std::vector<glm::ivec4> shadowMapUploads;
+    size_t shadowMapTileCount = 0;
+    // set at dispatch, cleared when the join publishes, still set afterwards means the run got cancelled
+    bool shadowMapPending = false;
+    // sun or scene changed, every cascade has to be traced again
+    bool shadowMapInvalid = false;
     bool needFlush = false;
 
+    struct FRayQueryBatch
+    {
+        FCPURayQueryHandle first = 0;
+        std::vector<FCPURayQuery> queries;
+        std::vector<Assets::RayCastResult> results;
+        // frame the results landed on, 0 while tracing
+        uint32_t readyFrame = 0;
+        // join of the chunk tasks, done without readyFrame set means the batch got cancelled
+        uint32_t joinTask = UINT32_MAX;
+        bool cancelled = false;
+    };
+    static constexpr uint32_t RayQueryKeepFrames = 2;
+    // guards the queue and the batch list, tracing tasks only touch their own batch
+    std::mutex rayQueryMutex;
+    std::vector<FCPURayQuery> queuedRayQueries;
+    std::vector<std::shared_ptr<FRayQueryBatch>> rayQueryBatches;
+    FCPURayQueryHandle nextRayQueryHandle = 0;
+    uint32_t rayQueryFrame = 1;
+
     FCPUProbeBaker probeBaker;
     FCPUPageIndex cpuPageIndex;
+    FCPUDistanceField distanceField;
 };
@@ -42,7 +42,7 @@ namespace Assets
             return glm::normalize(glm::vec3( sinf( SunRotation * glm::pi<float>() ), 0.75f, cosf(SunRotation * glm::pi<float>()) ));
         }
 
-        glm::mat4 GetSunViewProjection() const
+        glm::mat4 GetSunView() const
         {
             // 获取阳光方向并规范化
             vec3 lightDir = normalize(-SunDirection());
@@ -54,18 +54,24 @@ namespace Assets
             vec3 lightRight = normalize(cross(lightUp, lightDir));
             lightUp = normalize(cross(lightDir, lightRight));
 
-            // 定义阴影图覆盖的世界空间大小
-            float halfSize = 100.f;
-
             // 构建从光源视角的观察矩阵（将光源放在远处）
             vec3 lightPos = vec3(0) - lightDir * 1000.f;
-            mat4 lightView = glm::lookAt(lightPos, lightPos + lightDir, lightUp);
+            return glm::lookAt(lightPos, lightPos + lightDir, lightUp);
+        }
+
+        // orthographic window in sun view space, every window shares the depth range so depths stay comparable
+        static glm::mat4 GetSunProjection(glm::vec2 windowMin, glm::vec2 windowMax)
+        {
+            return glm::ortho(windowMin.x, windowMax.x, windowMin.y, windowMax.y, 500.f, 2000.f);
+        }
 
-            // 创建正交投影矩阵
-            mat4 lightProj = glm::ortho(-halfSize, halfSize, -halfSize, halfSize, 500.f, 2000.f);
+        glm::mat4 GetSunViewProjection() const
+        {
+            // 定义阴影图覆盖的世界空间大小
+            float halfSize = 100.f;
 
             // 返回组合的视图投影矩阵
-            return lightProj * lightView;
+            return GetSunProjection(vec2(-halfSize), vec2(halfSize)) * GetSunView();
         }
         
         float ControlSpeed;
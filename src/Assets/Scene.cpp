@@ -28,10 +28,13 @@ namespace Assets
         //int flags = supportRayTracing ? (VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
         int flags =  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
         // host buffers
-        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "VoxelDatas", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_Z * sizeof(Assets::VoxelData), farAmbientCubeBuffer_,
+        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "VoxelDatas", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,Assets::CUBE_BRICK_CAPACITY * Assets::CUBE_BRICK_VOXELS * sizeof(Assets::VoxelData), farAmbientCubeBuffer_,
                                                     farAmbientCubeBufferMemory_);
-        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "PageIndex", flags,VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ACGI_PAGE_COUNT * ACGI_PAGE_COUNT * sizeof(Assets::PageIndex), pageIndexBuffer_,
+        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "PageIndex", flags,VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ACGI_PAGE_COUNT * ACGI_PAGE_COUNT * sizeof(Assets::PageIndex) +
+            (CUBE_BRICK_CAPACITY + CUBE_BRICK_TABLE_PAGES * CUBE_BRICK_TABLE_SIZE) * sizeof(uint32_t), pageIndexBuffer_,
             pageIndexBufferMemory_);
+        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "DistanceField", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, CUBE_SDF_BYTES, distanceFieldBuffer_,
+            distanceFieldBufferMemory_);
 
         Vulkan::BufferUtil::CreateDeviceBufferLocal( commandPool, "GPUDrivenStats", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, sizeof(Assets::GPUDrivenStat), gpuDrivenStatsBuffer_, gpuDrivenStatsBuffer_Memory_ );
 
@@ -40,7 +43,7 @@ namespace Assets
         // gpu local buffers
         Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "IndirectDraws", flags | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, sizeof(VkDrawIndexedIndirectCommand) * 65535, indirectDrawBuffer_,
                                             indirectDrawBufferMemory_); // support 65535 nodes
-        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "AmbientCubes", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_Z * sizeof(Assets::AmbientCube), ambientCubeBuffer_,
+        Vulkan::BufferUtil::CreateDeviceBufferLocal(commandPool, "AmbientCubes", flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,Assets::CUBE_BRICK_CAPACITY * Assets::CUBE_BRICK_VOXELS * sizeof(Assets::AmbientCube), ambientCubeBuffer_,
                                             ambientCubeBufferMemory_);
 
         // shadow maps
@@ -83,6 +86,9 @@ namespace Assets
         pageIndexBuffer_.reset();
         pageIndexBufferMemory_.reset();
 
+        distanceFieldBuffer_.reset();
+        distanceFieldBufferMemory_.reset();
+
         hdrSHBuffer_.reset();
         hdrSHBufferMemory_.reset();
 
@@ -101,6 +107,15 @@ namespace Assets
 
     void Scene::RebuildMeshBuffer(Vulkan::CommandPool& commandPool, bool supportRayTracing)
     {
+        // the loader attaches parents depth first with partial updates, settle every world transform root first once
+        for (auto& node : nodes_)
+        {
+            if (node->GetParent() == nullptr)
+            {
+                node->RecalcTransform(true);
+            }
+        }
+
         // Rebuild the cpu bvh
         cpuAccelerationStructure_.InitBVH(*this);
 
@@ -285,7 +300,7 @@ namespace Assets
         UpdateNodesGpuDriven();
         MarkDirty();
 
-        cpuAccelerationStructure_.AsyncProcessFull(*this, farAmbientCubeBufferMemory_.get(), false);
+        cpuAccelerationStructure_.AsyncProcessFull(*this, farAmbientCubeBufferMemory_.get(), pageIndexBufferMemory_.get(), false);
     }
 
     const Assets::GPUScene& Scene::FetchGPUScene(const uint32_t imageIndex) const
@@ -303,6 +318,7 @@ namespace Assets
         gpuScene_.Cubes = ambientCubeBuffer_->GetDeviceAddress();
         gpuScene_.Voxels = farAmbientCubeBuffer_->GetDeviceAddress();
         gpuScene_.Pages = pageIndexBuffer_->GetDeviceAddress();
+        gpuScene_.SDFs = distanceFieldBuffer_->GetDeviceAddress();
         gpuScene_.HDRSHs = hdrSHBuffer_->GetDeviceAddress();
         gpuScene_.IndirectDrawCommands = indirectDrawBuffer_->GetDeviceAddress();
         gpuScene_.GPUDrivenStats = gpuDrivenStatsBuffer_->GetDeviceAddress();
@@ -323,8 +339,9 @@ namespace Assets
 
     void Scene::MarkEnvDirty()
     {
-        //cpuAccelerationStructure_.AsyncProcessFull(*this, farAmbientCubeBufferMemory_.get(), true);
-        //cpuAccelerationStructure_.GenShadowMap(*this);
+        //cpuAccelerationStructure_.AsyncProcessFull(*this, farAmbientCubeBufferMemory_.get(), pageIndexBufferMemory_.get(), true);
+        // culled and clipped tiles keep this cheap enough for every sun change, requests during a run coalesce
+        cpuAccelerationStructure_.GenShadowMap(*this);
     }
 
     void Scene::Tick(float deltaSeconds)
@@ -376,17 +393,19 @@ namespace Assets
             }
         }
 
+        // ray query results are due the next frame, they do not wait for the throttled bake tick below
+        cpuAccelerationStructure_.DispatchRayQueries();
+
         if ( NextEngine::GetInstance()->GetTotalFrames() % 10 == 0 )
         {
-            // if (sceneDirtyForCpuAS_)
-            // {
-            //     if ( cpuAccelerationStructure_.AsyncProcessFull(*this, farAmbientCubeBufferMemory_.get(), true) )
-            //     {
-            //         sceneDirtyForCpuAS_ = false;
-            //     }
-            // }
+            // only changed instances are touched, the groups around them get re-baked by the Tick below
+            if (sceneDirtyForCpuAS_)
+            {
+                cpuAccelerationStructure_.UpdateBVH(*this);
+                sceneDirtyForCpuAS_ = false;
+            }
             
-            cpuAccelerationStructure_.Tick(*this,  ambientCubeBufferMemory_.get(), farAmbientCubeBufferMemory_.get(), pageIndexBufferMemory_.get() );
+            cpuAccelerationStructure_.Tick(*this,  ambientCubeBufferMemory_.get(), farAmbientCubeBufferMemory_.get(), pageIndexBufferMemory_.get(), distanceFieldBufferMemory_.get() );
         }
     }
 
@@ -543,10 +562,15 @@ namespace Assets
     void Scene::MarkDirty()
     {
         sceneDirty_ = true;
-        sceneDirtyForCpuAS_ = true;
         NextEngine::GetInstance()->SetProgressiveRendering(false, false);
     }
 
+    void Scene::MarkDirtyForCpuAS()
+    {
+        MarkDirty();
+        sceneDirtyForCpuAS_ = true;
+    }
+
     void Scene::OverrideModelView(glm::mat4& outMatrix)
     {
         if (requestOverrideModelView)
@@ -90,7 +90,10 @@ namespace Assets
 		const FMaterial* GetMaterial(uint32_t id) const;
 		const uint32_t AddMaterial(const FMaterial& material);
 
+		// gpu side only, per frame animation and physics moves land here
 		void MarkDirty();
+		// an edit: the cpu bvh picks it up and the probe groups around it get re-baked
+		void MarkDirtyForCpuAS();
 		
 		std::vector<NodeProxy>& GetNodeProxys() { return nodeProxys; }
 
@@ -114,6 +117,7 @@ namespace Assets
 		Vulkan::Buffer& AmbientCubeBuffer() const { return *ambientCubeBuffer_; }
 		Vulkan::Buffer& FarAmbientCubeBuffer() const { return *farAmbientCubeBuffer_; }
 		Vulkan::Buffer& PageIndexBuffer() const { return *pageIndexBuffer_; }
+		Vulkan::Buffer& DistanceFieldBuffer() const { return *distanceFieldBuffer_; }
 
 		Vulkan::Buffer& HDRSHBuffer() const { return *hdrSHBuffer_; }
 
@@ -169,6 +173,9 @@ namespace Assets
 		std::unique_ptr<Vulkan::Buffer> pageIndexBuffer_;
 		std::unique_ptr<Vulkan::DeviceMemory> pageIndexBufferMemory_;
 
+		std::unique_ptr<Vulkan::Buffer> distanceFieldBuffer_;
+		std::unique_ptr<Vulkan::DeviceMemory> distanceFieldBufferMemory_;
+
 		std::unique_ptr<Vulkan::Buffer> hdrSHBuffer_;
 		std::unique_ptr<Vulkan::DeviceMemory> hdrSHBufferMemory_;
 
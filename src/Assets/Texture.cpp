@@ -29,7 +29,7 @@ namespace Assets
         TextureImage* transferPtr;
         float elapsed;
         bool needFlushHDRSH;
-        std::array<char, 256> outputInfo;
+        std::string outputInfo;
     };
     
     void PrefilterEnvironmentMapLevel(const float* sourcePixels, int sourceWidth, int sourceHeight,
@@ -38,111 +38,115 @@ namespace Assets
     {
         const int sampleCount = std::max(1, static_cast<int>(128 * (1.0f - roughness) + 64 * roughness));
         
-        for (int y = 0; y < targetHeight; ++y)
+        // rows are independent, spread them over the low priority pool
+        TaskCoordinator::GetInstance()->ParallelFor(0, uint32_t(targetHeight), 4, [&](uint32_t rowBegin, uint32_t rowEnd)
         {
-            for (int x = 0; x < targetWidth; ++x)
+            for (int y = int(rowBegin); y < int(rowEnd); ++y)
             {
-                // Convert target pixel to direction
-                float u = (x + 0.5f) / targetWidth;
-                float v = (y + 0.5f) / targetHeight;
+                for (int x = 0; x < targetWidth; ++x)
+                {
+                    // Convert target pixel to direction
+                    float u = (x + 0.5f) / targetWidth;
+                    float v = (y + 0.5f) / targetHeight;
                 
-                float theta = v * M_NEXT_PI;
-                float phi = u * 2.0f * M_NEXT_PI;
+                    float theta = v * M_NEXT_PI;
+                    float phi = u * 2.0f * M_NEXT_PI;
                 
-                float sinTheta = std::sin(theta);
-                float cosTheta = std::cos(theta);
-                float sinPhi = std::sin(phi);
-                float cosPhi = std::cos(phi);
+                    float sinTheta = std::sin(theta);
+                    float cosTheta = std::cos(theta);
+                    float sinPhi = std::sin(phi);
+                    float cosPhi = std::cos(phi);
                 
-                // Main reflection direction
-                float mainDirX = sinTheta * cosPhi;
-                float mainDirY = cosTheta;
-                float mainDirZ = sinTheta * sinPhi;
+                    // Main reflection direction
+                    float mainDirX = sinTheta * cosPhi;
+                    float mainDirY = cosTheta;
+                    float mainDirZ = sinTheta * sinPhi;
                 
-                // Build tangent space around main direction
-                float upX = 0.0f, upY = 1.0f, upZ = 0.0f;
-                if (std::abs(mainDirY) > 0.999f)
-                {
-                    upX = 1.0f; upY = 0.0f; upZ = 0.0f;
-                }
+                    // Build tangent space around main direction
+                    float upX = 0.0f, upY = 1.0f, upZ = 0.0f;
+                    if (std::abs(mainDirY) > 0.999f)
+                    {
+                        upX = 1.0f; upY = 0.0f; upZ = 0.0f;
+                    }
                 
-                // Tangent vectors
-                float tangentX = upY * mainDirZ - upZ * mainDirY;
-                float tangentY = upZ * mainDirX - upX * mainDirZ;
-                float tangentZ = upX * mainDirY - upY * mainDirX;
+                    // Tangent vectors
+                    float tangentX = upY * mainDirZ - upZ * mainDirY;
+                    float tangentY = upZ * mainDirX - upX * mainDirZ;
+                    float tangentZ = upX * mainDirY - upY * mainDirX;
                 
-                float tangentLen = std::sqrt(tangentX * tangentX + tangentY * tangentY + tangentZ * tangentZ);
-                tangentX /= tangentLen;
-                tangentY /= tangentLen;
-                tangentZ /= tangentLen;
+                    float tangentLen = std::sqrt(tangentX * tangentX + tangentY * tangentY + tangentZ * tangentZ);
+                    tangentX /= tangentLen;
+                    tangentY /= tangentLen;
+                    tangentZ /= tangentLen;
                 
-                float bitangentX = mainDirY * tangentZ - mainDirZ * tangentY;
-                float bitangentY = mainDirZ * tangentX - mainDirX * tangentZ;
-                float bitangentZ = mainDirX * tangentY - mainDirY * tangentX;
+                    float bitangentX = mainDirY * tangentZ - mainDirZ * tangentY;
+                    float bitangentY = mainDirZ * tangentX - mainDirX * tangentZ;
+                    float bitangentZ = mainDirX * tangentY - mainDirY * tangentX;
                 
-                float colorR = 0.0f, colorG = 0.0f, colorB = 0.0f;
-                float totalWeight = 0.0f;
+                    float colorR = 0.0f, colorG = 0.0f, colorB = 0.0f;
+                    float totalWeight = 0.0f;
                 
-                // Monte Carlo sampling
-                for (int i = 0; i < sampleCount; ++i)
-                {
-                    // Generate random numbers (using simple pseudo-random for now)
-                    float xi1 = static_cast<float>(i) / sampleCount;
-                    float xi2 = static_cast<float>((i * 17 + 13) % sampleCount) / sampleCount;
+                    // Monte Carlo sampling
+                    for (int i = 0; i < sampleCount; ++i)
+                    {
+                        // Generate random numbers (using simple pseudo-random for now)
+                        float xi1 = static_cast<float>(i) / sampleCount;
+                        float xi2 = static_cast<float>((i * 17 + 13) % sampleCount) / sampleCount;
                     
-                    // Importance sampling for GGX distribution
-                    float alpha = roughness * roughness;
-                    float alpha2 = alpha * alpha;
+                        // Importance sampling for GGX distribution
+                        float alpha = roughness * roughness;
+                        float alpha2 = alpha * alpha;
                     
-                    float cosTheta = std::sqrt((1.0f - xi1) / (1.0f + (alpha2 - 1.0f) * xi1));
-                    float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
-                    float phi = 2.0f * M_NEXT_PI * xi2;
+                        float cosTheta = std::sqrt((1.0f - xi1) / (1.0f + (alpha2 - 1.0f) * xi1));
+                        float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+                        float phi = 2.0f * M_NEXT_PI * xi2;
                     
-                    // Local sample direction
-                    float localX = sinTheta * std::cos(phi);
-                    float localY = sinTheta * std::sin(phi);
-                    float localZ = cosTheta;
+                        // Local sample direction
+                        float localX = sinTheta * std::cos(phi);
+                        float localY = sinTheta * std::sin(phi);
+                        float localZ = cosTheta;
                     
-                    // Transform to world space
-                    float worldX = localX * tangentX + localY * bitangentX + localZ * mainDirX;
-                    float worldY = localX * tangentY + localY * bitangentY + localZ * mainDirY;
-                    float worldZ = localX * tangentZ + localY * bitangentZ + localZ * mainDirZ;
+                        // Transform to world space
+                        float worldX = localX * tangentX + localY * bitangentX + localZ * mainDirX;
+                        float worldY = localX * tangentY + localY * bitangentY + localZ * mainDirY;
+                        float worldZ = localX * tangentZ + localY * bitangentZ + localZ * mainDirZ;
                     
-                    // Sample environment map
-                    float sampleTheta = std::acos(std::clamp(worldY, -1.0f, 1.0f));
-                    float samplePhi = std::atan2(worldZ, worldX);
-                    if (samplePhi < 0) samplePhi += 2.0f * M_NEXT_PI;
+                        // Sample environment map
+                        float sampleTheta = std::acos(std::clamp(worldY, -1.0f, 1.0f));
+                        float samplePhi = std::atan2(worldZ, worldX);
+                        if (samplePhi < 0) samplePhi += 2.0f * M_NEXT_PI;
                     
-                    float sampleU = samplePhi / (2.0f * M_NEXT_PI);
-                    float sampleV = sampleTheta / M_NEXT_PI;
+                        float sampleU = samplePhi / (2.0f * M_NEXT_PI);
+                        float sampleV = sampleTheta / M_NEXT_PI;
                     
-                    int sampleX = static_cast<int>(sampleU * sourceWidth) % sourceWidth;
-                    int sampleY = static_cast<int>(sampleV * sourceHeight) % sourceHeight;
+                        int sampleX = static_cast<int>(sampleU * sourceWidth) % sourceWidth;
+                        int sampleY = static_cast<int>(sampleV * sourceHeight) % sourceHeight;
                     
-                    int sampleIndex = (sampleY * sourceWidth + sampleX) * 4;
+                        int sampleIndex = (sampleY * sourceWidth + sampleX) * 4;
                     
-                    float weight = 1.0f;
-                    colorR += sourcePixels[sampleIndex + 0] * weight;
-                    colorG += sourcePixels[sampleIndex + 1] * weight;
-                    colorB += sourcePixels[sampleIndex + 2] * weight;
-                    totalWeight += weight;
-                }
+                        float weight = 1.0f;
+                        colorR += sourcePixels[sampleIndex + 0] * weight;
+                        colorG += sourcePixels[sampleIndex + 1] * weight;
+                        colorB += sourcePixels[sampleIndex + 2] * weight;
+                        totalWeight += weight;
+                    }
                 
-                // Normalize and store result
-                if (totalWeight > 0.0f)
-                {
-                    colorR /= totalWeight;
-                    colorG /= totalWeight;
-                    colorB /= totalWeight;
-                }
+                    // Normalize and store result
+                    if (totalWeight > 0.0f)
+                    {
+                        colorR /= totalWeight;
+                        colorG /= totalWeight;
+                        colorB /= totalWeight;
+                    }
                 
-                int targetIndex = (y * targetWidth + x) * 4;
-                targetPixels[targetIndex + 0] = colorR;
-                targetPixels[targetIndex + 1] = colorG;
-                targetPixels[targetIndex + 2] = colorB;
-                targetPixels[targetIndex + 3] = 1.0f;
+                    int targetIndex = (y * targetWidth + x) * 4;
+                    targetPixels[targetIndex + 0] = colorR;
+                    targetPixels[targetIndex + 1] = colorG;
+                    targetPixels[targetIndex + 2] = colorB;
+                    targetPixels[targetIndex + 3] = 1.0f;
+                }
             }
-        }
+        });
     }
 
     void PrefilterHdrEnvironmentMap(const float* hdrPixels, int width, int height, 
@@ -179,12 +183,12 @@ namespace Assets
 
     SphericalHarmonics ProjectHdrToSh(const float* hdrPixels, int width, int height)
     {
-        SphericalHarmonics result{};
+        SphericalHarmonics zero{};
         
         // Initialize coefficients to zero
         for (int i = 0; i < 3; ++i)
             for (int j = 0; j < 9; ++j)
-                result.coefficients[i][j] = 0.0f;
+                zero.coefficients[i][j] = 0.0f;
         
         // SH basis function evaluation constants
         constexpr float shC0 = 0.282095f; // 1/(2*sqrt(π))
@@ -193,68 +197,75 @@ namespace Assets
         constexpr float shC3 = 0.315392f; // sqrt(5)/(4*sqrt(π))
         constexpr float shC4 = 0.546274f; // sqrt(15)/(4*sqrt(π))
         
-        float weightSum = 0.0f;
-        
-        // For each pixel in the environment map
-        for (int y = 0; y < height; ++y)
+        // For each row of the environment map, partial sums per row band are added up in order
+        return TaskCoordinator::GetInstance()->ParallelReduce(0, uint32_t(height), 16, zero,
+            [&](uint32_t rowBegin, uint32_t rowEnd)
         {
-            // Calculate spherical coordinates
-            float v = (y + 0.5f) / height;
-            float theta = v * M_NEXT_PI;
-            float sinTheta = std::sin(theta);
-            float cosTheta = std::cos(theta);
-            
-            // Pixel solid angle weight (important for correct integration)
-            float weight = sinTheta * (M_NEXT_PI / height) * (2.0f * M_NEXT_PI / width);
-            
-            for (int x = 0; x < width; ++x)
+            SphericalHarmonics result = zero;
+            for (int y = int(rowBegin); y < int(rowEnd); ++y)
             {
-                float u = (x + 0.5f) / width;
-                float phi = u * 2.0f * M_NEXT_PI;
-                float sinPhi = std::sin(phi);
-                float cosPhi = std::cos(phi);
-                
-                // Convert to direction vector
-                float dx = sinTheta * cosPhi;
-                float dy = cosTheta;
-                float dz = sinTheta * sinPhi;
-                
-                // Evaluate SH basis functions
-                float basis[9];
-                // Band 0 (1 coefficient)
-                basis[0] = shC0;
-                
-                // Band 1 (3 coefficients)
-                basis[1] = -shC1 * dy;
-                basis[2] = shC1 * dz;
-                basis[3] = -shC1 * dx;
-                
-                // Band 2 (5 coefficients)
-                basis[4] = shC2 * dx * dy;
-                basis[5] = -shC2 * dy * dz;
-                basis[6] = shC3 * (3.0f * dy * dy - 1.0f);
-                basis[7] = -shC2 * dx * dz;
-                basis[8] = shC4 * (dx * dx - dz * dz);
+                // Calculate spherical coordinates
+                float v = (y + 0.5f) / height;
+                float theta = v * M_NEXT_PI;
+                float sinTheta = std::sin(theta);
+                float cosTheta = std::cos(theta);
                 
-                // Get pixel color (RGBA format, we want RGB)
-                int pixelIndex = (y * width + x) * 4;
-                float r = hdrPixels[pixelIndex + 0];
-                float g = hdrPixels[pixelIndex + 1];
-                float b = hdrPixels[pixelIndex + 2];
+                // Pixel solid angle weight (important for correct integration)
+                float weight = sinTheta * (M_NEXT_PI / height) * (2.0f * M_NEXT_PI / width);
                 
-                // Project color onto SH basis functions
-                for (int i = 0; i < 9; ++i)
+                for (int x = 0; x < width; ++x)
                 {
-                    result.coefficients[0][i] += r * basis[i] * weight;
-                    result.coefficients[1][i] += g * basis[i] * weight;
-                    result.coefficients[2][i] += b * basis[i] * weight;
+                    float u = (x + 0.5f) / width;
+                    float phi = u * 2.0f * M_NEXT_PI;
+                    float sinPhi = std::sin(phi);
+                    float cosPhi = std::cos(phi);
+                    
+                    // Convert to direction vector
+                    float dx = sinTheta * cosPhi;
+                    float dy = cosTheta;
+                    float dz = sinTheta * sinPhi;
+                    
+                    // Evaluate SH basis functions
+                    float basis[9];
+                    // Band 0 (1 coefficient)
+                    basis[0] = shC0;
+                    
+                    // Band 1 (3 coefficients)
+                    basis[1] = -shC1 * dy;
+                    basis[2] = shC1 * dz;
+                    basis[3] = -shC1 * dx;
+                    
+                    // Band 2 (5 coefficients)
+                    basis[4] = shC2 * dx * dy;
+                    basis[5] = -shC2 * dy * dz;
+                    basis[6] = shC3 * (3.0f * dy * dy - 1.0f);
+                    basis[7] = -shC2 * dx * dz;
+                    basis[8] = shC4 * (dx * dx - dz * dz);
+                    
+                    // Get pixel color (RGBA format, we want RGB)
+                    int pixelIndex = (y * width + x) * 4;
+                    float r = hdrPixels[pixelIndex + 0];
+                    float g = hdrPixels[pixelIndex + 1];
+                    float b = hdrPixels[pixelIndex + 2];
+                    
+                    // Project color onto SH basis functions
+                    for (int i = 0; i < 9; ++i)
+                    {
+                        result.coefficients[0][i] += r * basis[i] * weight;
+                        result.coefficients[1][i] += g * basis[i] * weight;
+                        result.coefficients[2][i] += b * basis[i] * weight;
+                    }
                 }
-                
-                weightSum += weight;
             }
-        }
-                
-        return result;
+            return result;
+        },
+        [](SphericalHarmonics lhs, const SphericalHarmonics& rhs)
+        {
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 9; ++j)
+                    lhs.coefficients[i][j] += rhs.coefficients[i][j];
+            return lhs;
+        });
     }
 
     uint32_t GlobalTexturePool::LoadTexture(const std::string& filename, bool srgb)
@@ -397,7 +408,7 @@ namespace Assets
         TaskCoordinator::GetInstance()->AddTask(
             [this, hdr, srgb, texname, mime, copyedData, bytelength, newTextureIdx](ResTask& task)
             {
-                TextureTaskContext taskContext{};
+                TextureTaskContext& taskContext = task.SetContext(TextureTaskContext{});
                 const auto timer = std::chrono::high_resolution_clock::now();
 
                 // Load the texture in normal host memory.
@@ -628,7 +639,8 @@ namespace Assets
                             params.uastc = KTX_TRUE;
                             params.compressionLevel = 2;
                             params.qualityLevel = 128;
-                            params.threadCount = 12;
+                            // ktx spawns its own threads, keep them inside the budget of the task pool
+                            params.threadCount = (GOption != nullptr && GOption->KtxThreads > 0) ? GOption->KtxThreads : std::max(1u, TaskCoordinator::GetInstance()->GetWorkerCount() / 2);
                             result = ktxTexture2_CompressBasisEx(kTexture, &params);
                             if (KTX_SUCCESS != result) Throw(std::runtime_error("failed to compress ktx2 image "));
                             // save to cache
@@ -676,23 +688,20 @@ namespace Assets
                 taskContext.needFlushHDRSH = hdr;
                 taskContext.elapsed = std::chrono::duration<float, std::chrono::seconds::period>(
                     std::chrono::high_resolution_clock::now() - timer).count();
-                std::string info = fmt::format("loaded {} ({} x {} x {}) in {:.2f}ms", texname, width, height, miplevel,
+                taskContext.outputInfo = fmt::format("loaded {} ({} x {} x {}) in {:.2f}ms", texname, width, height, miplevel,
                                                taskContext.elapsed * 1000.f);
-                std::copy(info.begin(), info.end(), taskContext.outputInfo.data());
-                task.SetContext(taskContext);
             }, [this, copyedData](ResTask& task)
             {
-                TextureTaskContext taskContext{};
-                task.GetContext(taskContext);
+                TextureTaskContext& taskContext = task.GetContext<TextureTaskContext>();
                 textureImages_[taskContext.textureId]->MainThreadPostLoading(mainThreadCommandPool_);
-                //SPDLOG_INFO("{}", taskContext.outputInfo.data());
+                //SPDLOG_INFO("{}", taskContext.outputInfo);
                 delete[] copyedData;
 
                 if (taskContext.needFlushHDRSH)
                 {
                     NextEngine::GetInstance()->GetScene().UpdateHDRSH();
                 }
-            }, 0);
+            }, ETaskPriority::Streaming);
 
         return newTextureIdx;
     }
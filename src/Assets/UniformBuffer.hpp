@@ -20,11 +20,40 @@ namespace Assets
 	const float ACGI_PAGE_SIZE = 16; // 16m
 	const vec3 ACGI_PAGE_OFFSET = vec3( -512, 0, -512);
 	const int SHADOWMAP_SIZE = 4096;
+	// the shadow map is an atlas of 2x2 camera-centred cascades, cascade i in quadrant (i & 1, i >> 1)
+	const int SHADOWMAP_CASCADES = 4;
+	const int SHADOWMAP_CASCADE_SIZE = SHADOWMAP_SIZE / 2;
 	const int CUBE_SIZE_XY = 192;//256;
 	const int CUBE_SIZE_Z = 48;
 	const float CUBE_UNIT = 0.25f;
 	const vec3 CUBE_OFFSET = vec3(-CUBE_SIZE_XY / 2, -1.375f, -CUBE_SIZE_XY / 2) * CUBE_UNIT;
 
+	// the probe grid is kept as 4x4x4 bricks, only bricks near geometry own a slot in the VoxelDatas / AmbientCubes pools.
+	// each page the grid overlaps has a brick table, stored behind the PageIndex array in the same buffer
+	const int CUBE_BRICK_SIZE = 4;
+	const int CUBE_BRICK_VOXELS = CUBE_BRICK_SIZE * CUBE_BRICK_SIZE * CUBE_BRICK_SIZE;
+	// pool budget in bricks, independent of the grid resolution
+	const int CUBE_BRICK_CAPACITY = 12288;
+	const int CUBE_BRICKS_XY = CUBE_SIZE_XY / CUBE_BRICK_SIZE;
+	const int CUBE_BRICKS_Z = CUBE_SIZE_Z / CUBE_BRICK_SIZE;
+	const int ACGI_PAGE_BRICKS_XZ = 16; // ACGI_PAGE_SIZE / CUBE_UNIT / CUBE_BRICK_SIZE
+	const int CUBE_BRICK_TABLE_SIZE = ACGI_PAGE_BRICKS_XZ * ACGI_PAGE_BRICKS_XZ * CUBE_BRICKS_Z;
+	// pages the grid can overlap per axis is at most one more than it spans
+	const int CUBE_BRICK_TABLE_PAGES = (CUBE_BRICKS_XY / ACGI_PAGE_BRICKS_XZ + 1) * (CUBE_BRICKS_XY / ACGI_PAGE_BRICKS_XZ + 1);
+	// brick table entry of an air brick, the low byte keeps the smallest distance to solid in the brick
+	const uint32_t CUBE_BRICK_EMPTY = 0x80000000u;
+	// slot -> brick coords entry of a free slot
+	const uint32_t CUBE_BRICK_FREE = 0xFFFFFFFFu;
+
+	// signed distance of every probe voxel to the nearest solid one, a byte each in its own buffer. kept per 16x16 column
+	// group: ((group * CUBE_SIZE_Z + y) * 16 + z % 16) * 16 + x % 16, group = (z / 16) * CUBE_SDF_GROUPS + x / 16.
+	// 128 is the surface, one step is a quarter voxel, below 128 is inside
+	const int CUBE_SDF_GROUP_SIZE = 16;
+	const int CUBE_SDF_GROUPS = CUBE_SIZE_XY / CUBE_SDF_GROUP_SIZE;
+	const int CUBE_SDF_BYTES = CUBE_SIZE_XY * CUBE_SIZE_XY * CUBE_SIZE_Z;
+	// in voxels, distances saturate beyond
+	const int CUBE_SDF_RANGE = 32;
+
 #define float3 vec3
 #define float4 vec4
 #define float4x4 mat4
@@ -1,6 +1,7 @@
 #include "Utilities/Exception.hpp"
 #include "Options.hpp"
 #include "Runtime/Engine.hpp"
+#include "Runtime/TaskCoordinator.hpp"
 
 #include <fmt/format.h>
 #include <filesystem>
@@ -48,6 +49,12 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
     // Global GOption, can access from everywhere
     GOption = GOptionPtr.get();
 
+    if(GOption->BenchTaskQueue)
+    {
+        TaskCoordinator::BenchmarkQueues();
+        return SDL_APP_SUCCESS;
+    }
+
 #if __APPLE__
     setenv("MVK_CONFIG_USE_METAL_ARGUMENT_BUFFERS", "1", 1);
 #endif   
@@ -90,7 +97,10 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
 void SDL_AppQuit(void *appstate, SDL_AppResult result)
 {
     // Shutdown
-    GApplication->End();
+    if (GApplication)
+    {
+        GApplication->End();
+    }
     
     GApplication.reset();
     GOptionPtr.reset();
@@ -37,7 +37,7 @@ void Editor::GUI::ShowProperties()
             if ( ImGui::DragFloat3("##Location", &selectedObj->Translation().x, 0.1f) )
             {
                 selectedObj->RecalcTransform(true);
-                current_scene->MarkDirty();
+                current_scene->MarkDirtyForCpuAS();
             }
             ImGui::EndGroup();
 
@@ -50,7 +50,7 @@ void Editor::GUI::ShowProperties()
             {
                 selectedObj->SetRotation( glm::quat(eular));
                 selectedObj->RecalcTransform(true);
-                current_scene->MarkDirty();
+                current_scene->MarkDirtyForCpuAS();
             }
             ImGui::EndGroup();
 
@@ -61,7 +61,7 @@ void Editor::GUI::ShowProperties()
             if ( ImGui::DragFloat3("##Scale", &selectedObj->Scale().x, 0.1f) )
             {
                 selectedObj->RecalcTransform(true);
-                current_scene->MarkDirty();
+                current_scene->MarkDirtyForCpuAS();
             }
             ImGui::EndGroup();
 
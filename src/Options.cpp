@@ -34,6 +34,14 @@ Options::Options(const int argc, const char* argv[])
 		("forcesoftgen", "Forcing software raytracing for ambient cube gen.", cxxopts::value<bool>(ForceSoftGen)->default_value("false"))
 		("superres", "SuperResolution: 50% / 66% / 100% -> 0 / 1 / 2.", cxxopts::value<uint32_t>(SuperResolution)->default_value("1"))
 		("hwquery", "Forcing hardware raytracing not supported.", cxxopts::value<bool>(HardwareQuery)->default_value("true"))
+		("task-workers", "Worker threads of the parallel task pool (0 = one per core).", cxxopts::value<uint32_t>(TaskWorkers)->default_value("0"))
+		("bake-threads", "Max workers baking probes and shadow maps at once (0 = no limit).", cxxopts::value<uint32_t>(BakeThreads)->default_value("0"))
+		("physics-threads", "Concurrency physics jobs are split for (0 = task workers + 1).", cxxopts::value<uint32_t>(PhysicsThreads)->default_value("0"))
+		("ktx-threads", "Threads used by ktx texture compression (0 = half the task workers).", cxxopts::value<uint32_t>(KtxThreads)->default_value("0"))
+		("bench-taskqueue", "Benchmark the task queues at 1/4/16/64 producers and exit.", cxxopts::value<bool>(BenchTaskQueue)->default_value("false"))
+		("cpubvh", "CPU BVH layout for baking and ray casts (0 = Binary, 1 = SoA, 2 = Wide4).", cxxopts::value<uint32_t>(CpuBvhLayout)->default_value("0"))
+		("bench-cpubvh", "Log Mrays/s of every CPU BVH layout after a scene is loaded.", cxxopts::value<bool>(BenchCpuBvh)->default_value("false"))
+		("tasktrace", "Record task scheduling from startup and write it as chrome trace json to this file on exit.", cxxopts::value<std::string>(TaskTraceFile)->default_value(""))
 	
 		("h,help", "Print usage");
 	try
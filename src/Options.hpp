@@ -31,6 +31,18 @@ public:
 	bool ForceSoftGen{};
 	bool HardwareQuery{};
 	std::string locale{};
+	std::string TaskTraceFile{};
+
+	// Thread budgets, 0 = automatic.
+	uint32_t TaskWorkers{};
+	uint32_t BakeThreads{};
+	uint32_t PhysicsThreads{};
+	uint32_t KtxThreads{};
+	bool BenchTaskQueue{};
+
+	// CPU BVH options.
+	uint32_t CpuBvhLayout{};
+	bool BenchCpuBvh{};
 
 	// Renderer options.
 	uint32_t Samples{};
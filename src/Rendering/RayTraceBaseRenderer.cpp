@@ -229,7 +229,8 @@ namespace Vulkan::RayTracing
         if(supportRayTracing_ && !GOption->ForceSoftGen)
         {
             const int cubesPerGroup = 64;
-            const int count = Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_Z;
+            // one group per brick slot, free slots return right away
+            const int count = Assets::CUBE_BRICK_CAPACITY * Assets::CUBE_BRICK_VOXELS;
             const int group = count / cubesPerGroup;
 
             // 每32个cube一个group
@@ -255,7 +256,7 @@ namespace Vulkan::RayTracing
                 if (NextEngine::GetInstance()->GetUserSettings().BakeSpeedLevel != 2)
                 {
                     int frame = (int)(frameCount_ % temporalFrames);
-                    int groupPerFrame = group / temporalFrames;
+                    int groupPerFrame = (group + temporalFrames - 1) / temporalFrames;
                     int offset = frame * groupPerFrame;
                     int offsetInCubes = offset * cubesPerGroup;
                 
@@ -1078,7 +1078,8 @@ namespace Vulkan
         if (!supportRayTracing_ || GOption->ForceSoftGen)
         {
             const int cubesPerGroup = 64;
-            const int count = Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_XY * Assets::CUBE_SIZE_Z;
+            // one group per brick slot, free slots return right away
+            const int count = Assets::CUBE_BRICK_CAPACITY * Assets::CUBE_BRICK_VOXELS;
             const int group = count / cubesPerGroup;
 
             int temporalFrames = 120;
@@ -1103,7 +1104,7 @@ namespace Vulkan
                 SCOPED_GPU_TIMER("sw-lightbake");
                 
                 int frame = (int)(frameCount_ % temporalFrames);
-                int groupPerFrame = group / temporalFrames;
+                int groupPerFrame = (group + temporalFrames - 1) / temporalFrames;
                 int offset = frame * groupPerFrame;
                 int offsetInCubes = offset * cubesPerGroup;
 
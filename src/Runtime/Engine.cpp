@@ -104,7 +104,7 @@ namespace
     {
         bool success;
         float elapsed;
-        std::array<char, 256> outputInfo;
+        std::string outputInfo;
     };
 }
 
@@ -182,6 +182,15 @@ NextEngine::NextEngine(Options& options, void* userdata)
 
     status_ = NextRenderer::EApplicationStatus::Starting;
 
+    if (!options.TaskTraceFile.empty())
+    {
+        TaskTrace::SetEnabled(true);
+    }
+
+    // thread budgets, physics and ktx read theirs when they start
+    TaskCoordinator::SetWorkerCount(options.TaskWorkers);
+    TaskCoordinator::GetInstance()->SetLaneBudget(ETaskPriority::Background, options.BakeThreads);
+
     packageFileSystem_.reset(new Utilities::Package::FPackageFileSystem(Utilities::Package::EPM_OsFile));
 
     Vulkan::Window::InitGLFW();
@@ -404,6 +413,18 @@ void NextEngine::End()
 {
     TaskCoordinator::GetInstance()->CancelAllParralledTasks();
     TaskCoordinator::GetInstance()->WaitForAllParralledTask();
+
+    if (!GOption->TaskTraceFile.empty())
+    {
+        if (TaskTrace::DumpChromeTrace(GOption->TaskTraceFile))
+        {
+            SPDLOG_INFO("task trace written to {}", GOption->TaskTraceFile);
+        }
+        else
+        {
+            SPDLOG_ERROR("failed to write task trace {}", GOption->TaskTraceFile);
+        }
+    }
     
     physicsEngine_->Stop();
     animationEngine_->Stop();
@@ -788,7 +809,13 @@ Assets::UniformBufferObject NextEngine::GetUniformBufferObject(const VkOffset2D
     
     ubo.ViewportRect = glm::vec4(renderer_->SwapChain().RenderOffset().x, renderer_->SwapChain().RenderOffset().y, renderer_->SwapChain().RenderExtent().width, renderer_->SwapChain().RenderExtent().height);
 
-    ubo.SunViewProjection = scene_->GetEnvSettings().GetSunViewProjection();
+    // the cascades the shadow map holds right now, a scrolling cascade switches over once its strips are traced
+    for (int cascade = 0; cascade < Assets::SHADOWMAP_CASCADES; ++cascade)
+    {
+        const FCPUShadowCascade& shadowCascade = scene_->GetCPUAccelerationStructure().GetShadowCascade(cascade);
+        ubo.SunViewProjection[cascade] = shadowCascade.viewProjection;
+        ubo.SunCascadeOffsets[cascade] = shadowCascade.offset;
+    }
 
     ubo.SelectedId = scene_->GetSelectedId();
 
@@ -1040,6 +1067,9 @@ void NextEngine::OnDropFile(int pathCount, const char* paths[])
 
 void NextEngine::OnRendererBeforeNextFrame()
 {
+    // completions get a slice of the frame time we actually run at, clamped so a hitch does not open the flood gates
+    float frameTargetMs = glm::clamp(GetSmoothDeltaSeconds(), 1.f / 240.f, 1.f / 30.f) * 1000.f;
+    TaskCoordinator::GetInstance()->SetFrameTarget(frameTargetMs);
     TaskCoordinator::GetInstance()->Tick();
 }
 
@@ -1057,7 +1087,7 @@ void NextEngine::RequestLoadScene(std::string sceneFileName)
     });
 }
 
-void NextEngine::LoadScene(std::string sceneFileName)
+TaskRoutine NextEngine::LoadScene(std::string sceneFileName)
 {
     // wait all task finish
     TaskCoordinator::GetInstance()->CancelAllParralledTasks();
@@ -1075,66 +1105,61 @@ void NextEngine::LoadScene(std::string sceneFileName)
     physicsEngine_->OnSceneDestroyed();
     Assets::GlobalTexturePool::GetInstance()->FreeNonSystemTextures();
     
-    // dispatch in thread task and reset in main thread
-    TaskCoordinator::GetInstance()->AddTask( [cameraState, sceneFileName, models, nodes, materials, lights, tracks](ResTask& task)
+    // parse in thread task, the rest of this routine resumes on main thread once it is done
+    SceneTaskContext taskContext = co_await TaskCoordinator::GetInstance()->AddTaskFuture( [cameraState, sceneFileName, models, nodes, materials, lights, tracks]()
     {
-        SceneTaskContext taskContext {};
+        SceneTaskContext context {};
         const auto timer = std::chrono::high_resolution_clock::now();
         
-        taskContext.success = SceneList::LoadScene( sceneFileName, *cameraState, *nodes, *models, *materials, *lights, *tracks);
+        context.success = SceneList::LoadScene( sceneFileName, *cameraState, *nodes, *models, *materials, *lights, *tracks);
         
-        taskContext.elapsed = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - timer).count();
+        context.elapsed = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - timer).count();
 
-        std::string info = fmt::format("parsed scene [{}] on cpu in {:.2f}ms", std::filesystem::path(sceneFileName).filename().string(), taskContext.elapsed * 1000.f);
-        std::copy(info.begin(), info.end(), taskContext.outputInfo.data());
-        task.SetContext( taskContext );
+        context.outputInfo = fmt::format("parsed scene [{}] on cpu in {:.2f}ms", std::filesystem::path(sceneFileName).filename().string(), context.elapsed * 1000.f);
+        return context;
     },
-    [this, cameraState, sceneFileName, models, nodes, materials, lights, tracks](ResTask& task)
+    ETaskPriority::FrameCritical);
+
+    if (taskContext.success )
     {
-        SceneTaskContext taskContext {};
-        task.GetContext( taskContext );
-        if (taskContext.success )
-        {
-            SPDLOG_INFO("{}", taskContext.outputInfo.data());
-            const auto timer = std::chrono::high_resolution_clock::now();
-            scene_->GetEnvSettings().Reset();
-            scene_->SetEnvSettings(*cameraState);
-
-            gameInstance_->OnSceneUnloaded();
-            physicsEngine_->OnSceneStarted();
-
-            renderer_->Device().WaitIdle();
-            renderer_->DeleteSwapChain();
-            renderer_->OnPreLoadScene();
-
-            gameInstance_->BeforeSceneRebuild(*nodes, *models, *materials, *lights, *tracks);
-            scene_->Reload(*nodes, *models, *materials, *lights, *tracks);
-            scene_->RebuildMeshBuffer(renderer_->CommandPool(), renderer_->supportRayTracing_);
-                    
-            renderer_->SetScene(scene_);
-                    
-            userSettings_.CameraIdx = 0;
-            assert(!scene_->GetEnvSettings().cameras.empty());
-            scene_->SetRenderCamera(scene_->GetEnvSettings().cameras[0]);
-
-            totalFrames_ = 0;
-                    
-            renderer_->OnPostLoadScene();
-            renderer_->CreateSwapChain();
-
-            gameInstance_->OnSceneLoaded();
-
-            float elapsed = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - timer).count();
-            SPDLOG_INFO("uploaded scene [{}] to gpu in {:.2f}ms", std::filesystem::path(sceneFileName).filename().string(), elapsed * 1000.f);
-        }
-        else
-        {
-            SPDLOG_ERROR("failed to load scene [{}]", std::filesystem::path(sceneFileName).filename().string());
-        }
+        SPDLOG_INFO("{}", taskContext.outputInfo);
+        const auto timer = std::chrono::high_resolution_clock::now();
+        scene_->GetEnvSettings().Reset();
+        scene_->SetEnvSettings(*cameraState);
+
+        gameInstance_->OnSceneUnloaded();
+        physicsEngine_->OnSceneStarted();
+
+        renderer_->Device().WaitIdle();
+        renderer_->DeleteSwapChain();
+        renderer_->OnPreLoadScene();
+
+        gameInstance_->BeforeSceneRebuild(*nodes, *models, *materials, *lights, *tracks);
+        scene_->Reload(*nodes, *models, *materials, *lights, *tracks);
+        scene_->RebuildMeshBuffer(renderer_->CommandPool(), renderer_->supportRayTracing_);
+                
+        renderer_->SetScene(scene_);
+                
+        userSettings_.CameraIdx = 0;
+        assert(!scene_->GetEnvSettings().cameras.empty());
+        scene_->SetRenderCamera(scene_->GetEnvSettings().cameras[0]);
+
+        totalFrames_ = 0;
+                
+        renderer_->OnPostLoadScene();
+        renderer_->CreateSwapChain();
+
+        gameInstance_->OnSceneLoaded();
+
+        float elapsed = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - timer).count();
+        SPDLOG_INFO("uploaded scene [{}] to gpu in {:.2f}ms", std::filesystem::path(sceneFileName).filename().string(), elapsed * 1000.f);
+    }
+    else
+    {
+        SPDLOG_ERROR("failed to load scene [{}]", std::filesystem::path(sceneFileName).filename().string());
+    }
 
-        status_ = NextRenderer::EApplicationStatus::Running;
-    },
-    1);
+    status_ = NextRenderer::EApplicationStatus::Running;
 }
 
 
@@ -22,6 +22,7 @@ namespace qjs
 
 class NextEngine;
 class NextAnimation;
+struct TaskRoutine;
 
 class NextGameInstanceBase
 {
@@ -216,7 +217,7 @@ protected:
 	void OnDropFile(int path_count, const char* paths[]);
 	
 private:
-	void LoadScene(std::string sceneFileName);
+	TaskRoutine LoadScene(std::string sceneFileName);
 
 	void InitJSEngine();
 	void TestJSEngine();
@@ -8,7 +8,8 @@
 #include <Jolt/RegisterTypes.h>
 #include <Jolt/Core/Factory.h>
 #include <Jolt/Core/TempAllocator.h>
-#include <Jolt/Core/JobSystemThreadPool.h>
+#include <Jolt/Core/JobSystemWithBarrier.h>
+#include <Jolt/Core/FixedSizeFreeList.h>
 #include <Jolt/Physics/PhysicsSettings.h>
 #include <Jolt/Physics/PhysicsSystem.h>
 #include <Jolt/Physics/Collision/Shape/BoxShape.h>
@@ -26,6 +27,8 @@
 #include <glm/ext.hpp>
 
 #include "Engine.hpp"
+#include "Options.hpp"
+#include "TaskCoordinator.hpp"
 
 // Disable common warnings triggered by Jolt, you can use JPH_SUPPRESS_WARNING_PUSH / JPH_SUPPRESS_WARNING_POP to store and restore the warning state
 JPH_SUPPRESS_WARNINGS
@@ -67,6 +70,108 @@ static bool AssertFailedImpl(const char *inExpression, const char *inMessage, co
 
 #endif // JPH_ENABLE_ASSERTS
 
+// Jolt job system on top of the TaskCoordinator pool. physics jobs go to the frame-critical lane, so a step
+// shares the cores with probe bakes and texture streaming instead of running a second thread pool next to them.
+class FTaskCoordinatorJobSystem final : public JobSystemWithBarrier
+{
+public:
+	FTaskCoordinatorJobSystem(uint inMaxJobs, uint inMaxBarriers, int inMaxConcurrency) :
+		JobSystemWithBarrier(inMaxBarriers),
+		maxConcurrency(inMaxConcurrency)
+	{
+		jobs.Init(inMaxJobs, inMaxJobs);
+	}
+
+	virtual int GetMaxConcurrency() const override
+	{
+		return maxConcurrency;
+	}
+
+	virtual JobHandle CreateJob(const char *inName, ColorArg inColor, const JobFunction &inJobFunction, uint32 inNumDependencies = 0) override
+	{
+		uint32 index;
+		for (;;)
+		{
+			index = jobs.ConstructObject(inName, inColor, this, inJobFunction, inNumDependencies);
+			if (index != AvailableJobs::cInvalidObjectIndex)
+			{
+				break;
+			}
+			JPH_ASSERT(false, "No jobs available!");
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		Job *job = &jobs.Get(index);
+
+		// the handle keeps a reference, the job may complete as soon as it is queued
+		JobHandle handle(job);
+		if (inNumDependencies == 0)
+		{
+			QueueJob(job);
+		}
+		return handle;
+	}
+
+protected:
+	virtual void QueueJob(Job *inJob) override
+	{
+		inJob->AddRef();
+		TaskCoordinator::GetInstance()->AddParralledTask([jobRef = FJobRef(inJob)](ResTask& task) mutable
+		{
+			jobRef.job->Execute();
+			jobRef.Release();
+		}, nullptr, {}, ETaskPriority::FrameCritical);
+	}
+
+	virtual void QueueJobs(Job **inJobs, uint inNumJobs) override
+	{
+		for (uint i = 0; i < inNumJobs; ++i)
+		{
+			QueueJob(inJobs[i]);
+		}
+	}
+
+	virtual void FreeJob(Job *inJob) override
+	{
+		jobs.DestructObject(inJob);
+	}
+
+private:
+	// reference held by the queued task. still dropped if the task is cancelled before it runs,
+	// a barrier waiting on the job executes it itself in that case
+	struct FJobRef
+	{
+		explicit FJobRef(Job *inJob) : job(inJob) {}
+		FJobRef(FJobRef&& other) noexcept : job(other.job) { other.job = nullptr; }
+		FJobRef(const FJobRef&) = delete;
+		~FJobRef() { Release(); }
+
+		void Release()
+		{
+			if (job != nullptr)
+			{
+				job->Release();
+				job = nullptr;
+			}
+		}
+
+		Job *job;
+	};
+
+	using AvailableJobs = FixedSizeFreeList<Job>;
+	AvailableJobs jobs;
+	int maxConcurrency;
+};
+
+static int GetPhysicsConcurrency()
+{
+	// the caller of Update works too, hence the + 1
+	if (GOption != nullptr && GOption->PhysicsThreads > 0)
+	{
+		return int(GOption->PhysicsThreads);
+	}
+	return int(TaskCoordinator::GetInstance()->GetWorkerCount()) + 1;
+}
+
 // Layer that objects can be in, determines which other objects it can collide with
 // Typically you at least want to have 1 layer for moving bodies and 1 layer for static bodies, but you can have more
 // layers if you want. E.g. you could have a layer for high detail collision (which is not used by the physics simulation
@@ -209,7 +314,7 @@ struct FNextPhysicsContext
 {
 	FNextPhysicsContext():
 		tempAllocator(10 * 1024 * 1024),
-		jobSystem(cMaxPhysicsJobs, cMaxPhysicsBarriers, thread::hardware_concurrency() - 1)
+		jobSystem(cMaxPhysicsJobs, cMaxPhysicsBarriers, GetPhysicsConcurrency())
 	{
 		// This is the max amount of rigid bodies that you can add to the physics system. If you try to add more you'll get an error.
 		// Note: This value is low because this is a simple test. For a real project use something in the order of 65536.
@@ -252,10 +357,8 @@ struct FNextPhysicsContext
 	// malloc / free.
 	TempAllocatorImpl tempAllocator;
 
-	// We need a job system that will execute physics jobs on multiple threads. Typically
-	// you would implement the JobSystem interface yourself and let Jolt Physics run on top
-	// of your own job scheduler. JobSystemThreadPool is an example implementation.
-	JobSystemThreadPool jobSystem;
+	// Physics jobs run on the TaskCoordinator pool, see FTaskCoordinatorJobSystem.
+	FTaskCoordinatorJobSystem jobSystem;
 
 	// Create mapping table from object layer to broadphase layer
 	// Note: As this is an interface, PhysicsSystem will take a reference to this so this instance needs to stay alive!
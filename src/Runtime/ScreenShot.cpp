@@ -85,7 +85,7 @@ namespace ScreenShot
         [](ResTask& task)
         {
 
-        },1);
+        }, ETaskPriority::Background);
     }
 
     void SaveSwapChainToFile(Vulkan::VulkanBaseRenderer* renderer, const std::string& filePathWithoutExtension, int inX, int inY, int inWidth, int inHeight)
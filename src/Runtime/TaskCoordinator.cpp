@@ -2,22 +2,68 @@
 
 #include <chrono>
 
-TaskThread::TaskThread(TaskCoordinator* coordinator)
+namespace
+{
+    // the worker owning the calling thread, null on main thread and priority threads
+    thread_local TaskWorker* GCurrentWorker = nullptr;
+    // lane of the task running on the calling thread, ParallelFor helpers inherit it
+    thread_local ETaskPriority GCurrentPriority = ETaskPriority::FrameCritical;
+
+    constexpr size_t LaneCount = size_t(ETaskPriority::Count);
+
+    // runs task_func or complete_func, skipped when the task got cancelled, and puts it on the trace timeline
+    void RunTraced(ResTask& task, TaskFunction& func, ETaskTraceKind kind)
+    {
+        if (func == nullptr)
+        {
+            return;
+        }
+        bool cancelled = task.IsCancelled();
+        if (!TaskTrace::IsEnabled())
+        {
+            if (!cancelled)
+            {
+                func(task);
+            }
+            return;
+        }
+
+        TaskTraceEvent event;
+        event.beginNs = TaskTrace::Now();
+        if (!cancelled)
+        {
+            func(task);
+        }
+        event.endNs = TaskTrace::Now();
+        event.waitNs = task.queued_ns != 0 && task.queued_ns < event.beginNs ? event.beginNs - task.queued_ns : 0;
+        event.taskId = task.task_id;
+        event.kind = kind;
+        event.lane = uint8_t(task.priority);
+        event.cancelled = cancelled;
+        TaskTrace::Record(event);
+    }
+}
+
+TaskThread::TaskThread(ETaskPriority priority)
 {
     complete_.reset(new event_signal());
     terminate_.reset(new event_signal());
-    thread_.reset(new std::thread([this] {
+    thread_.reset(new std::thread([this, priority] {
+        TaskTrace::SetThreadName(fmt::format("{} thread", GetTaskPriorityName(priority)));
+        GCurrentPriority = priority;
         while (true)
         {
+            uint32_t epoch = wakeEpoch_.load(std::memory_order_acquire);
             if(terminate_->is_set())
             {
                 break;
             }
 
-            ResTask task;
+            ResTask* task = nullptr;
             if (taskQueue_.dequeue(task, false))
             {
-                task.task_func(task);
+                complete_->reset();
+                RunTraced(*task, task->task_func, ETaskTraceKind::Task);
 
                 // sync add to mainthread complete queue
                 TaskCoordinator::GetInstance()->MarkTaskComplete(task);
@@ -25,59 +71,495 @@ TaskThread::TaskThread(TaskCoordinator* coordinator)
             else
             {
                 complete_->set();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                // park until the next enqueue, no more 1ms sleep polling
+                wakeEpoch_.wait(epoch, std::memory_order_acquire);
             }
         }
     }));
 }
 
+void TaskWorker::Start(TaskCoordinator* coordinator)
+{
+    thread_.reset(new std::thread([this, coordinator] {
+        GCurrentWorker = this;
+        TaskTrace::SetThreadName(fmt::format("worker {}", index_));
+        coordinator->WorkerLoop(this);
+        GCurrentWorker = nullptr;
+    }));
+}
+
+TaskWorker::~TaskWorker()
+{
+    Join();
+}
+
+void TaskWorker::Join()
+{
+    if (thread_ && thread_->joinable())
+    {
+        thread_->join();
+    }
+}
+
 void TaskCoordinator::TestCase()
 {
     TaskCoordinator taskCoordinator;
 }
 
-uint32_t TaskCoordinator::AddTask( ResTask::TaskFunc taskFunc, ResTask::TaskFunc completeFunc, uint8_t priority)
+namespace
 {
-    static uint32_t taskId = 0;
-    ResTask task;
-    task.task_id = taskId++;
-    task.priority = priority;
-    task.task_func = std::move(taskFunc);
-    task.complete_func = std::move(completeFunc);
+    // producers push itemsPerProducer items each while consumers drain, returns million items per second.
+    // producers hold back once maxQueued items are waiting, like the engine can never queue more tasks than the pool holds
+    template<typename Queue>
+    double BenchmarkQueue(uint32_t producerCount, uint32_t consumerCount, uint32_t itemsPerProducer, uint32_t maxQueued)
+    {
+        // producers reserve this many items at a time, so the depth check stays off the per item path
+        static constexpr uint32_t ReserveBatch = 256;
+
+        Queue queue;
+        const uint32_t total = producerCount * itemsPerProducer;
+        std::atomic<uint32_t> consumed{0};
+        std::atomic<uint32_t> reserved{0};
+        std::atomic<bool> go{false};
+
+        std::vector<std::thread> threads;
+        for (uint32_t p = 0; p < producerCount; ++p)
+        {
+            threads.emplace_back([&queue, &go, &consumed, &reserved, itemsPerProducer, maxQueued]()
+            {
+                while (!go.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+                for (uint32_t i = 0; i < itemsPerProducer; ++i)
+                {
+                    if (i % ReserveBatch == 0)
+                    {
+                        uint32_t upTo = reserved.fetch_add(ReserveBatch, std::memory_order_relaxed) + ReserveBatch;
+                        while (upTo - std::min(upTo, consumed.load(std::memory_order_relaxed)) > maxQueued)
+                        {
+                            std::this_thread::yield();
+                        }
+                    }
+                    queue.enqueue(i);
+                }
+            });
+        }
+        for (uint32_t c = 0; c < consumerCount; ++c)
+        {
+            threads.emplace_back([&queue, &consumed, total]()
+            {
+                uint32_t item;
+                while (consumed.load(std::memory_order_relaxed) < total)
+                {
+                    if (queue.dequeue(item, false))
+                    {
+                        consumed.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return double(total) / seconds / 1e6;
+    }
+}
+
+void TaskCoordinator::BenchmarkQueues()
+{
+    const uint32_t consumerCount = std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u);
+    const uint32_t totalItems = 1u << 21;
+    // the deepest a task queue can get in the engine
+    const uint32_t maxQueued = uint32_t(TaskQueueCapacity) - 1024;
+    fmt::print("task queue benchmark, {} consumers, {} items, at most {} queued, million items/s\n", consumerCount, totalItems, maxQueued);
+    for (uint32_t producerCount : {1u, 4u, 16u, 64u})
+    {
+        double locked = BenchmarkQueue<lockedqueue<uint32_t>>(producerCount, consumerCount, totalItems / producerCount, maxQueued);
+        double lockFree = BenchmarkQueue<tsqueue<uint32_t>>(producerCount, consumerCount, totalItems / producerCount, maxQueued);
+        // a ring far below the queue depth, shows what the overflow list costs once it is hit
+        double overflow = BenchmarkQueue<tsqueue<uint32_t, 4096>>(producerCount, consumerCount, totalItems / producerCount, maxQueued);
+        fmt::print("{:3} producers: locked {:8.2f}  lock-free {:8.2f} (x{:.2f})  small ring {:8.2f} (x{:.2f})\n",
+            producerCount, locked, lockFree, lockFree / locked, overflow, overflow / locked);
+    }
+}
+
+ResTask* TaskCoordinator::CreateTask(TaskFunction taskFunc, TaskFunction completeFunc, ETaskPriority priority)
+{
+    ResTask* task = taskPool_.Acquire();
+    task->priority = priority;
+    task->task_func = std::move(taskFunc);
+    task->complete_func = std::move(completeFunc);
+    return task;
+}
+
+uint32_t TaskCoordinator::AddTask( ResTask::TaskFunc taskFunc, ResTask::TaskFunc completeFunc, ETaskPriority priority, TaskCancelToken cancelToken)
+{
+    ResTask* task = CreateTask(std::move(taskFunc), std::move(completeFunc), priority);
+    task->cancel_token = std::move(cancelToken);
+    task->queued_ns = TaskTrace::IsEnabled() ? TaskTrace::Now() : 0;
+    uint32_t taskIdRet = task->task_id;
 #if __APPLE__
     mainthreadTaskQueue_.enqueue(task);
-    return task.task_id;
+    return taskIdRet;
 #endif
-    threads_[priority]->taskQueue_.enqueue(task);
-    return task.task_id;
+    threads_[size_t(priority)]->Enqueue(task);
+    return taskIdRet;
 }
 
 uint32_t TaskCoordinator::AddParralledTask(ResTask::TaskFunc taskFunc, ResTask::TaskFunc completeFunc)
 {
-    static uint32_t taskId = 0;
-    ResTask task;
-    task.task_id = taskId++;
-    task.priority = 3;
-    task.task_func = std::move(taskFunc);
-    task.complete_func = std::move(completeFunc);
+    return AddParralledTask(std::move(taskFunc), std::move(completeFunc), {});
+}
+
+uint32_t TaskCoordinator::AddParralledTask(ResTask::TaskFunc taskFunc, ResTask::TaskFunc completeFunc, const std::vector<uint32_t>& predecessors,
+    ETaskPriority priority, TaskCancelToken cancelToken)
+{
+    ResTask* task = CreateTask(std::move(taskFunc), std::move(completeFunc), priority);
+    task->cancel_token = std::move(cancelToken);
+    task->cancel_epoch_source = &cancelEpoch_;
+    task->cancel_epoch = cancelEpoch_.load(std::memory_order_acquire);
+    return AddGraphTask(task, predecessors);
+}
+
+uint32_t TaskCoordinator::AddGraphTask(ResTask* task, const std::vector<uint32_t>& predecessors)
+{
+    uint32_t taskIdRet = task->task_id;
+    parralledPending_.fetch_add(1, std::memory_order_acq_rel);
+
+    {
+        std::lock_guard<std::mutex> lock(graphMutex_);
+        TaskGraphNode& node = graphNodes_[taskIdRet];
+        for (uint32_t predecessor : predecessors)
+        {
+            auto it = graphNodes_.find(predecessor);
+            if (it != graphNodes_.end() && it->first != taskIdRet)
+            {
+                it->second.successors.push_back(taskIdRet);
+                node.waitCount++;
+            }
+        }
+        if (node.waitCount > 0)
+        {
+            node.task = task;
+            return taskIdRet;
+        }
+    }
+
+    SubmitParralledTask(task);
+    return taskIdRet;
+}
+
+uint32_t TaskCoordinator::AddJoinTask(const std::vector<uint32_t>& predecessors, ResTask::TaskFunc completeFunc, ETaskPriority priority, TaskCancelToken cancelToken)
+{
+    return AddParralledTask(nullptr, std::move(completeFunc), predecessors, priority, std::move(cancelToken));
+}
+
+void TaskCoordinator::SubmitParralledTask(ResTask* task)
+{
+    // join node, nothing to run, resolve inline
+    if (task->task_func == nullptr)
+    {
+        CompleteParralledTask(task);
+        return;
+    }
 
-    parralledTaskQueue_.enqueue(task);
+    task->queued_ns = TaskTrace::IsEnabled() ? TaskTrace::Now() : 0;
 
-    return task.task_id;
+    // spawned from a worker, keep it local so the spawner picks it up hot, siblings steal when idle
+    size_t lane = size_t(task->priority);
+    if (GCurrentWorker != nullptr)
+    {
+        GCurrentWorker->localQueues_[lane].push(task);
+    }
+    else
+    {
+        parralledTaskQueues_[lane].enqueue(task);
+    }
+    WakeWorkers(false);
+}
+
+void TaskCoordinator::CompleteParralledTask(ResTask* task)
+{
+    std::vector<ResTask*> readyTasks;
+    {
+        std::lock_guard<std::mutex> lock(graphMutex_);
+        auto it = graphNodes_.find(task->task_id);
+        if (it != graphNodes_.end())
+        {
+            for (uint32_t successor : it->second.successors)
+            {
+                auto succ = graphNodes_.find(successor);
+                if (succ != graphNodes_.end() && --succ->second.waitCount == 0)
+                {
+                    readyTasks.push_back(succ->second.task);
+                    succ->second.task = nullptr;
+                }
+            }
+            graphNodes_.erase(it);
+        }
+    }
+
+    MarkTaskComplete(task);
+
+    // release successors before dropping our pending count, so waiters never see a transient zero
+    for (ResTask* ready : readyTasks)
+    {
+        SubmitParralledTask(ready);
+    }
+    FinishParralledTask(1);
 }
 
 void TaskCoordinator::WaitForAllParralledTask()
 {
-    while( parralledTaskQueue_.size() > 0 )
+    // park until the pending counter drops to zero
+    uint32_t pending = parralledPending_.load(std::memory_order_acquire);
+    while( pending != 0 )
+    {
+        parralledPending_.wait(pending, std::memory_order_acquire);
+        pending = parralledPending_.load(std::memory_order_acquire);
+    }
+}
+
+void TaskCoordinator::ParallelForChunks(uint32_t chunkCount, const std::function<void(uint32_t chunk)>& chunkFunc)
+{
+    if (chunkCount == 0)
+    {
+        return;
+    }
+    if (chunkCount == 1)
+    {
+        chunkFunc(0);
+        return;
+    }
+
+    // shared with the helpers, a helper that starts after the loop is over only touches this and leaves
+    struct ParallelForState
+    {
+        std::atomic<uint32_t> next{0};
+        std::atomic<uint32_t> done{0};
+        uint32_t count = 0;
+        const std::function<void(uint32_t)>* func = nullptr;
+
+        void Run()
+        {
+            uint32_t chunk;
+            while ((chunk = next.fetch_add(1, std::memory_order_relaxed)) < count)
+            {
+                (*func)(chunk);
+                if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count)
+                {
+                    done.notify_all();
+                }
+            }
+        }
+    };
+
+    auto state = std::make_shared<ParallelForState>();
+    state->count = chunkCount;
+    state->func = &chunkFunc;
+
+    // helpers run in the lane of the caller, a bake's ParallelFor does not jump ahead of frame work
+    uint32_t helperCount = std::min(chunkCount - 1, uint32_t(lowThreads_.size()));
+    for (uint32_t i = 0; i < helperCount; ++i)
+    {
+        AddParralledTask([state](ResTask& task) { state->Run(); }, nullptr, {}, GCurrentPriority);
+    }
+
+    // the caller works too, then only waits for chunks that are in flight on other threads
+    state->Run();
+    uint32_t done = state->done.load(std::memory_order_acquire);
+    while (done != chunkCount)
+    {
+        state->done.wait(done, std::memory_order_acquire);
+        done = state->done.load(std::memory_order_acquire);
+    }
+}
+
+void TaskCoordinator::CancelAllParralledTasks()
+{
+    // running tasks see IsCancelled() from here on and bail out of their loops
+    cancelEpoch_.fetch_add(1, std::memory_order_acq_rel);
+
+    // futures have neither epoch nor token, someone is waiting on their value
+    auto isCancellable = [](const ResTask* task) { return task->cancel_epoch_source != nullptr || task->cancel_token.IsValid(); };
+
+    std::vector<ResTask*> cancelledTasks;
+    std::vector<ResTask*> keptTasks;
+    ResTask* task = nullptr;
+    for (size_t lane = 0; lane < LaneCount; ++lane)
+    {
+        while (parralledTaskQueues_[lane].dequeue(task, false))
+        {
+            (isCancellable(task) ? cancelledTasks : keptTasks).push_back(task);
+        }
+        for (auto& worker : lowThreads_)
+        {
+            while (worker->localQueues_[lane].steal(task))
+            {
+                (isCancellable(task) ? cancelledTasks : keptTasks).push_back(task);
+            }
+        }
+    }
+
+    {
+        // drop queued nodes and every cancellable node still waiting on predecessors, running tasks finish normally
+        std::lock_guard<std::mutex> lock(graphMutex_);
+        for (auto& [taskId, node] : graphNodes_)
+        {
+            if (node.waitCount > 0 && isCancellable(node.task))
+            {
+                cancelledTasks.push_back(node.task);
+            }
+        }
+        // a dropped node releases its successors like a finished one, so kept nodes behind it still get to run
+        for (ResTask* cancelled : cancelledTasks)
+        {
+            auto it = graphNodes_.find(cancelled->task_id);
+            if (it == graphNodes_.end())
+            {
+                continue;
+            }
+            for (uint32_t successor : it->second.successors)
+            {
+                auto succ = graphNodes_.find(successor);
+                if (succ != graphNodes_.end() && succ->second.waitCount > 0 && --succ->second.waitCount == 0 && !isCancellable(succ->second.task))
+                {
+                    keptTasks.push_back(succ->second.task);
+                    succ->second.task = nullptr;
+                }
+            }
+            graphNodes_.erase(it);
+        }
+    }
+
+    for (ResTask* cancelled : cancelledTasks)
+    {
+        taskPool_.Release(cancelled);
+    }
+    FinishParralledTask(uint32_t(cancelledTasks.size()));
+
+    for (ResTask* kept : keptTasks)
+    {
+        SubmitParralledTask(kept);
+    }
+}
+
+uint32_t TaskCoordinator::GetParralledTaskCount()
+{
+    size_t count = 0;
+    for (size_t lane = 0; lane < LaneCount; ++lane)
+    {
+        count += parralledTaskQueues_[lane].size();
+        for (auto& worker : lowThreads_)
+        {
+            count += worker->localQueues_[lane].size();
+        }
+    }
+    return uint32_t(count);
+}
+
+bool TaskCoordinator::TryRunParralledTask(TaskWorker* worker)
+{
+    ResTask* task = nullptr;
+    bool found = false;
+    // lane slot taken against the budget, released once the task is done
+    size_t budgetLane = LaneCount;
+    // lane by lane: a lower lane is only touched when nobody has anything in the higher ones
+    size_t count = lowThreads_.size();
+    size_t first = worker != nullptr ? worker->index_ + 1 : 0;
+    size_t steals = worker != nullptr ? count - 1 : count;
+    for (size_t lane = 0; lane < LaneCount && !found; ++lane)
+    {
+        // helping waiters ignore the budget, they are blocked on that work anyway
+        uint32_t budget = worker != nullptr ? laneBudget_[lane].load(std::memory_order_relaxed) : 0;
+        if (budget != 0 && laneRunning_[lane].fetch_add(1, std::memory_order_acq_rel) >= budget)
+        {
+            laneRunning_[lane].fetch_sub(1, std::memory_order_acq_rel);
+            continue;
+        }
+
+        found = (worker != nullptr && worker->localQueues_[lane].pop(task)) || parralledTaskQueues_[lane].dequeue(task, false);
+        // steal from siblings, start from the next one to spread the contention
+        for (size_t i = 0; i < steals && !found; ++i)
+        {
+            found = lowThreads_[(first + i) % count]->localQueues_[lane].steal(task);
+        }
+
+        if (budget != 0 && found)
+        {
+            budgetLane = lane;
+        }
+        else if (budget != 0)
+        {
+            laneRunning_[lane].fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+    if (!found)
+    {
+        return false;
+    }
+
+    // skipped when cancelled before it started, successors are still released
+    ETaskPriority outerPriority = GCurrentPriority;
+    GCurrentPriority = task->priority;
+    RunTraced(*task, task->task_func, ETaskTraceKind::Parralled);
+    GCurrentPriority = outerPriority;
+    if (budgetLane != LaneCount)
+    {
+        laneRunning_[budgetLane].fetch_sub(1, std::memory_order_acq_rel);
+    }
+    CompleteParralledTask(task);
+    return true;
+}
+
+void TaskCoordinator::WorkerLoop(TaskWorker* worker)
+{
+    while (!terminate_.load(std::memory_order_acquire))
+    {
+        if (TryRunParralledTask(worker))
+        {
+            continue;
+        }
+
+        // read the epoch before the last look, so a submit racing with us always changes it and wait() returns at once
+        uint32_t epoch = parralledEpoch_.load(std::memory_order_acquire);
+        if (TryRunParralledTask(worker))
+        {
+            continue;
+        }
+        if (terminate_.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        parralledEpoch_.wait(epoch, std::memory_order_acquire);
+    }
+}
+
+void TaskCoordinator::WakeWorkers(bool all)
+{
+    parralledEpoch_.fetch_add(1, std::memory_order_acq_rel);
+    all ? parralledEpoch_.notify_all() : parralledEpoch_.notify_one();
+}
+
+void TaskCoordinator::FinishParralledTask(uint32_t count)
+{
+    if (count == 0)
     {
-        Tick();
-        std::this_thread::sleep_for(std::chrono::milliseconds(0));
+        return;
     }
-    
-    // wait for all idle
-    while( !IsAllParralledTaskComplete() )
+    if (parralledPending_.fetch_sub(count, std::memory_order_acq_rel) == count)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(0));
+        parralledPending_.notify_all();
     }
 }
 
@@ -96,11 +578,72 @@ uint32_t TaskCoordinator::GetMainTaskCount()
     return count;
 }
 
+void TaskCoordinator::WaitForTask(uint32_t taskId)
+{
+    if (IsMainThread())
+    {
+        // completion only happens in Tick, so keep ticking, help the pool, and park until something completes
+        while (!IsTaskComplete(taskId))
+        {
+            uint32_t epoch = completionEpoch_.load(std::memory_order_acquire);
+            Tick();
+            if (IsTaskComplete(taskId) || TryRunParralledTask(nullptr))
+            {
+                continue;
+            }
+            completionEpoch_.wait(epoch, std::memory_order_acquire);
+        }
+        return;
+    }
+
+    ResTask* task = taskPool_.Find(taskId);
+    while (!IsTaskComplete(taskId))
+    {
+        if (GCurrentWorker != nullptr)
+        {
+            // never park a worker, the task we wait on may sit in our own deque
+            if (!TryRunParralledTask(GCurrentWorker))
+            {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        uint32_t generation = TaskPool::HandleGeneration(taskId);
+        task->generation.wait(generation, std::memory_order_acquire);
+    }
+}
+
+void TaskCoordinator::WaitForFlag(const std::atomic<bool>& flag)
+{
+    while (!flag.load(std::memory_order_acquire))
+    {
+        // main thread may own the producer (apple runs AddTask on main thread), worker may own it in its deque
+        if (IsMainThread())
+        {
+            Tick();
+        }
+        if (flag.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        if (TryRunParralledTask(GCurrentWorker))
+        {
+            continue;
+        }
+        if (IsMainThread() || GCurrentWorker != nullptr)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        flag.wait(false, std::memory_order_acquire);
+    }
+}
+
 bool TaskCoordinator::IsAllTaskComplete(std::vector<uint32_t>& tasks)
 {
     for (uint32_t taskId : tasks)
     {
-        if ( !completedTaskIds_.contains(taskId) )
+        if ( !IsTaskComplete(taskId) )
         {
             return false;
         }
@@ -110,49 +653,101 @@ bool TaskCoordinator::IsAllTaskComplete(std::vector<uint32_t>& tasks)
 
 void TaskCoordinator::Tick()
 {
-    ResTask task;
-    if( mainthreadTaskQueue_.dequeue(task, false))
+    using Clock = std::chrono::steady_clock;
+    auto startTime = Clock::now();
+    auto elapsedMs = [&startTime]() { return std::chrono::duration<float, std::milli>(Clock::now() - startTime).count(); };
+
+    TaskTickStats& stats = tickStats_;
+    stats.frameTargetMs = frameTargetMs_;
+    stats.budgetMs = std::max(MinCompletionBudgetMs, frameTargetMs_ * CompletionBudgetRatio);
+    stats.mainThreadTasks = 0;
+    stats.processed.fill(0);
+
+    ResTask* task = nullptr;
+    uint32_t processedTotal = 0;
+    bool mainGuaranteed = stats.mainThreadStarvedTicks >= MaxStarvedTicks;
+    while (true)
     {
-        task.task_func(task);
-        if(task.complete_func != nullptr)
+        // same rules as the completion lanes below
+        bool force = mainGuaranteed || processedTotal == 0;
+        if (!force && elapsedMs() + stats.mainThreadAvgCostMs > stats.budgetMs)
         {
-            MarkTaskComplete(task);
+            break;
         }
-    }
-    
-    auto startTime = std::chrono::high_resolution_clock::now();
-    while (completeTaskQueue_.size() > 0)
-    {
-        // Check if we've exceeded 2ms
-        auto currentTime = std::chrono::high_resolution_clock::now();
-        auto elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime);
-        if (elapsedTime.count() > 4) // 4ms
+        if (!mainthreadTaskQueue_.dequeue(task, false))
         {
             break;
         }
 
-        if (completeTaskQueue_.dequeue(task, false))
+        auto taskStart = Clock::now();
+        RunTraced(*task, task->task_func, ETaskTraceKind::Task);
+        MarkTaskComplete(task);
+        float cost = std::chrono::duration<float, std::milli>(Clock::now() - taskStart).count();
+        stats.mainThreadAvgCostMs = stats.mainThreadAvgCostMs * 0.9f + cost * 0.1f;
+
+        stats.mainThreadTasks++;
+        processedTotal++;
+        mainGuaranteed = false;
+    }
+
+    for (size_t lane = 0; lane < LaneCount; ++lane)
+    {
+        tsqueue<ResTask*>& queue = completeTaskQueues_[lane];
+        bool guaranteed = stats.starvedTicks[lane] >= MaxStarvedTicks;
+        while (true)
         {
-            if (task.complete_func != nullptr)
+            // stop before a completion that would likely cross the budget, but always make some progress
+            bool force = guaranteed || processedTotal == 0;
+            if (!force && elapsedMs() + stats.avgCostMs[lane] > stats.budgetMs)
             {
-                task.complete_func(task);
+                break;
             }
-            MarkTaskEnd(task);
+            if (!queue.dequeue(task, false))
+            {
+                break;
+            }
+
+            auto completeStart = Clock::now();
+            // a cancelled job's result is stale (scene switched, bake restarted), never apply it
+            RunTraced(*task, task->complete_func, ETaskTraceKind::Complete);
+            taskPool_.Release(task);
+            float cost = std::chrono::duration<float, std::milli>(Clock::now() - completeStart).count();
+            stats.avgCostMs[lane] = stats.avgCostMs[lane] * 0.9f + cost * 0.1f;
+
+            stats.processed[lane]++;
+            processedTotal++;
+            guaranteed = false;
         }
     }
 
-    // if low threads has idle one, peak a task from parralled queue
-    for ( auto& thread : lowThreads_ )
+    stats.mainThreadSpilled = uint32_t(mainthreadTaskQueue_.size());
+    stats.mainThreadStarvedTicks = (stats.mainThreadSpilled > 0 && stats.mainThreadTasks == 0) ? stats.mainThreadStarvedTicks + 1 : 0;
+    for (size_t lane = 0; lane < LaneCount; ++lane)
+    {
+        stats.spilled[lane] = uint32_t(completeTaskQueues_[lane].size());
+        stats.starvedTicks[lane] = (stats.spilled[lane] > 0 && stats.processed[lane] == 0) ? stats.starvedTicks[lane] + 1 : 0;
+    }
+    stats.usedMs = elapsedMs();
+
+    if (TaskTrace::IsEnabled())
     {
-        if( thread->IsIdle() )
+        TaskTraceCounters counters;
+        counters.timeNs = TaskTrace::Now();
+        counters.laneCount = uint32_t(LaneCount);
+        for (size_t lane = 0; lane < LaneCount; ++lane)
         {
-            if( parralledTaskQueue_.dequeue(task, false) )
+            size_t queued = parralledTaskQueues_[lane].size();
+            for (auto& worker : lowThreads_)
             {
-                thread->complete_->reset();
-                thread->taskQueue_.enqueue(task);
+                queued += worker->localQueues_[lane].size();
             }
+            counters.parralledQueued[lane] = uint32_t(queued);
+            counters.completeQueued[lane] = stats.spilled[lane];
         }
+        counters.parralledPending = parralledPending_.load(std::memory_order_acquire);
+        TaskTrace::RecordCounters(counters);
     }
 }
 
 std::unique_ptr<TaskCoordinator> TaskCoordinator::instance_;
+uint32_t TaskCoordinator::workerCountOverride_ = 0;
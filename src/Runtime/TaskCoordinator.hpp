@@ -3,11 +3,24 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
 #include <thread>
 #include <atomic>
 #include "Common/CoreMinimal.hpp"
+#include "TaskTrace.hpp"
+#include "Utilities/Exception.hpp"
 #include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+#include <optional>
+#include <variant>
+#include <coroutine>
+#include <array>
+#include <chrono>
+#include <limits>
 #include <unordered_set>
+#include <unordered_map>
 
 namespace details
 {
@@ -97,15 +110,14 @@ struct event_signal final
 {
     event_signal() noexcept : m_signaled{ false } {}
 
+    // lock free, idle checks poll this a lot
     bool is_set() const
     {
-        std::lock_guard<std::mutex> mutexGuard{ m_mutex };
         return m_signaled.load();
     }
 
     void reset() noexcept
     {
-        std::lock_guard<std::mutex> mutexGuard{ m_mutex };
         m_signaled = false;
     }
 
@@ -140,6 +152,7 @@ struct event_signal final
         // Regardless, the C++20 standard requires that co_await of a final_suspend not be potentially throwing, and
         // this member is designed to be called by a final_suspend for awaitable_get, so treat any exception from
         // other Standard Library implementations here as fatal.
+        // the lock is only there so a waiter can not miss the notify between its check and its sleep
         std::lock_guard<std::mutex> mutexGuard{ m_mutex };
         m_signaled = true;
         m_condition.notify_all();
@@ -151,19 +164,197 @@ private:
     details::atomic_acq_rel<bool> m_signaled;
 };
 
-template <class T>
-class tsqueue
+// bounded lock-free multi producer / multi consumer ring (Dmitry Vyukov's design).
+// every cell carries a sequence number telling whether it is free for the producer of round n or
+// filled for the consumer of round n, so producers and consumers only contend on their own cursor.
+template <class T, size_t Capacity>
+class mpmcring
 {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
 public:
-    tsqueue() : q(), m(), c() {}
+    mpmcring() : cells_(new Cell[Capacity])
+    {
+        for (size_t i = 0; i < Capacity; ++i)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // t is only moved from on success
+    bool try_enqueue(T& t)
+    {
+        Cell* cell;
+        size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells_[pos & Mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(t);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_dequeue(T& result)
+    {
+        Cell* cell;
+        size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells_[pos & Mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        result = std::move(cell->data);
+        cell->sequence.store(pos + Capacity, std::memory_order_release);
+        return true;
+    }
 
-    ~tsqueue() {}
+    // two loads, exact only while nobody pushes or pops
+    size_t approx_size() const
+    {
+        size_t dequeuePos = dequeuePos_.load(std::memory_order_acquire);
+        size_t enqueuePos = enqueuePos_.load(std::memory_order_acquire);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+
+private:
+    static constexpr size_t Mask = Capacity - 1;
 
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueuePos_{0};
+    alignas(64) std::atomic<size_t> dequeuePos_{0};
+};
+
+// every queued item is a pooled ResTask, so no queue ever holds more than the pool's index range.
+// the ring is sized to that, the overflow only kicks in for other payloads or a smaller Capacity
+static constexpr size_t TaskQueueCapacity = size_t(1) << 16;
+
+// task queue: lock-free ring for the common case, a locked overflow list once the ring is full.
+// while the overflow holds anything new items go there too, and the overflow is only read once every
+// claimed ring cell has been popped, so items of one producer come out in the order it pushed them.
+template <class T, size_t Capacity = TaskQueueCapacity>
+class tsqueue
+{
+public:
     // Add an element to the queue.
+    void enqueue(T t)
+    {
+        if (overflowCount_.load(std::memory_order_acquire) != 0 || !ring_.try_enqueue(t))
+        {
+            std::lock_guard<std::mutex> lock(overflowMutex_);
+            overflow_.push_back(std::move(t));
+            overflowCount_.fetch_add(1, std::memory_order_release);
+        }
+    }
+    
+    // lock free, may be off by the items in flight
+    size_t size() const
+    {
+        return ring_.approx_size() + overflowCount_.load(std::memory_order_acquire);
+    }
+    
+    // Get the front element.
+    // If the queue is empty, wait till a element is avaiable.
+    // nothing in the engine blocks on a queue (threads park on their own epochs), so waiting just polls
+    // and enqueue never pays for a wakeup.
+    bool dequeue(T& result, bool wait)
+    {
+        for (uint32_t spin = 0; ; ++spin)
+        {
+            if (ring_.try_dequeue(result) || dequeue_overflow(result))
+            {
+                return true;
+            }
+            if (!wait)
+            {
+                return false;
+            }
+            spin < 64 ? std::this_thread::yield() : std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+private:
+    bool dequeue_overflow(T& result)
+    {
+        if (overflowCount_.load(std::memory_order_acquire) == 0)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(overflowMutex_);
+        // try_dequeue also fails on a cell a producer claimed but has not published yet,
+        // that item was pushed before the overflow ones, wait for it instead of jumping ahead
+        if (overflow_.empty() || ring_.approx_size() != 0)
+        {
+            return false;
+        }
+        result = std::move(overflow_.front());
+        overflow_.pop_front();
+        // refill the empty ring so the following pops are lock free again.
+        // producers keep appending to the overflow until it is empty, so the order is kept
+        uint32_t moved = 1;
+        while (!overflow_.empty() && ring_.try_enqueue(overflow_.front()))
+        {
+            overflow_.pop_front();
+            moved++;
+        }
+        overflowCount_.fetch_sub(moved, std::memory_order_release);
+        return true;
+    }
+
+    mpmcring<T, Capacity> ring_;
+    std::atomic<uint32_t> overflowCount_{0};
+    std::mutex overflowMutex_;
+    std::deque<T> overflow_;
+};
+
+// the mutex + condition variable queue tsqueue used to be, kept as the baseline of BenchmarkQueues
+template <class T>
+class lockedqueue
+{
+public:
     void enqueue(T t)
     {
         std::lock_guard<std::mutex> lock(m);
-        q.push(t);
+        q.push(std::move(t));
         c.notify_one();
     }
     
@@ -173,8 +364,6 @@ public:
         return q.size();
     }
     
-    // Get the front element.
-    // If the queue is empty, wait till a element is avaiable.
     bool dequeue(T& result, bool wait)
     {
         std::unique_lock<std::mutex> lock(m);
@@ -182,7 +371,6 @@ public:
         {
             while (q.empty())
             {
-                // release lock as long as the wait and reaquire it afterwards.
                 c.wait(lock);
             }     
         }
@@ -194,7 +382,7 @@ public:
             }
         }
 
-        result = q.front();
+        result = std::move(q.front());
         q.pop();
         return true;
     }
@@ -205,27 +393,521 @@ private:
     std::condition_variable c;
 };
 
+// per-worker deque for work stealing.
+// the owner pushes and pops at the back (LIFO, cache friendly), thieves steal from the front (FIFO, oldest and usually biggest work).
+template <class T>
+class workdeque
+{
+public:
+    void push(T t)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        q.push_back(std::move(t));
+    }
+
+    bool pop(T& result)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (q.empty())
+        {
+            return false;
+        }
+        result = std::move(q.back());
+        q.pop_back();
+        return true;
+    }
+
+    bool steal(T& result)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (q.empty())
+        {
+            return false;
+        }
+        result = std::move(q.front());
+        q.pop_front();
+        return true;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m);
+        return q.size();
+    }
+
+private:
+    std::deque<T> q;
+    mutable std::mutex m;
+};
+
+struct ResTask;
+
+// move-only callable for task bodies. captures up to InlineSize bytes live inside the task itself,
+// bigger ones fall back to the heap. unlike std::function it can hold move-only captures.
+class TaskFunction
+{
+public:
+    static constexpr size_t InlineSize = 128;
+
+    TaskFunction() noexcept = default;
+    TaskFunction(std::nullptr_t) noexcept {}
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, TaskFunction> && !std::is_same_v<std::decay_t<F>, std::nullptr_t>>>
+    TaskFunction(F&& func)
+    {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= InlineSize && alignof(Fn) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Fn>)
+        {
+            new (storage_) Fn(std::forward<F>(func));
+            ops_ = &InlineOps<Fn>;
+        }
+        else
+        {
+            *reinterpret_cast<Fn**>(storage_) = new Fn(std::forward<F>(func));
+            ops_ = &HeapOps<Fn>;
+        }
+    }
+
+    TaskFunction(TaskFunction&& other) noexcept { MoveFrom(other); }
+
+    TaskFunction& operator=(TaskFunction&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    TaskFunction& operator=(std::nullptr_t) noexcept
+    {
+        Reset();
+        return *this;
+    }
+
+    TaskFunction(const TaskFunction&) = delete;
+    TaskFunction& operator=(const TaskFunction&) = delete;
+
+    ~TaskFunction() { Reset(); }
+
+    void operator()(ResTask& task) { ops_->invoke(storage_, task); }
+
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+    friend bool operator==(const TaskFunction& func, std::nullptr_t) noexcept { return func.ops_ == nullptr; }
+
+    void Reset() noexcept
+    {
+        if (ops_ != nullptr)
+        {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops
+    {
+        void (*invoke)(void* storage, ResTask& task);
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Fn>
+    static constexpr Ops InlineOps = {
+        [](void* storage, ResTask& task) { (*static_cast<Fn*>(storage))(task); },
+        [](void* dst, void* src) noexcept
+        {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        },
+        [](void* storage) noexcept { static_cast<Fn*>(storage)->~Fn(); }};
+
+    template <typename Fn>
+    static constexpr Ops HeapOps = {
+        [](void* storage, ResTask& task) { (**static_cast<Fn**>(storage))(task); },
+        [](void* dst, void* src) noexcept { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); },
+        [](void* storage) noexcept { delete *static_cast<Fn**>(storage); }};
+
+    void MoveFrom(TaskFunction& other) noexcept
+    {
+        ops_ = other.ops_;
+        if (ops_ != nullptr)
+        {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[InlineSize];
+    const Ops* ops_ = nullptr;
+};
+
+// priority classes. AddTask has one dedicated thread per class, the parallel pool has one lane per class
+// and workers always drain the higher lanes first, so a background bake never delays frame work.
+enum class ETaskPriority : uint8_t
+{
+    FrameCritical = 0,  // needed for the current or next frame, scene loading
+    Streaming,          // texture and asset streaming
+    Background,         // probe bakes, shadow map generation, screenshots
+    Count
+};
+
+inline const char* GetTaskPriorityName(ETaskPriority priority)
+{
+    switch (priority)
+    {
+    case ETaskPriority::FrameCritical: return "frame-critical";
+    case ETaskPriority::Streaming: return "streaming";
+    case ETaskPriority::Background: return "background";
+    default: return "unknown";
+    }
+}
+
+// cooperative cancellation shared by all tasks of one job. tasks not started yet are skipped once it is cancelled
+// (or past its deadline), long task_func poll ResTask::IsCancelled() and return early. cancelled tasks still release
+// their graph successors, but their complete_func never runs.
+class TaskCancelToken
+{
+public:
+    static TaskCancelToken Create()
+    {
+        TaskCancelToken token;
+        token.state_ = std::make_shared<State>();
+        return token;
+    }
+
+    bool IsValid() const { return state_ != nullptr; }
+
+    void Cancel()
+    {
+        if (state_ != nullptr)
+        {
+            state_->cancelled.store(true, std::memory_order_release);
+        }
+    }
+
+    // work still queued after the deadline is dropped, running work sees IsCancelled() turn true
+    void SetDeadline(std::chrono::steady_clock::time_point deadline)
+    {
+        if (state_ != nullptr)
+        {
+            state_->deadline.store(deadline.time_since_epoch().count(), std::memory_order_release);
+        }
+    }
+
+    bool IsCancelled() const
+    {
+        if (state_ == nullptr)
+        {
+            return false;
+        }
+        if (state_->cancelled.load(std::memory_order_acquire))
+        {
+            return true;
+        }
+        auto deadline = state_->deadline.load(std::memory_order_acquire);
+        if (deadline != NoDeadline && std::chrono::steady_clock::now().time_since_epoch().count() >= deadline)
+        {
+            state_->cancelled.store(true, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    using Ticks = std::chrono::steady_clock::rep;
+    static constexpr Ticks NoDeadline = std::numeric_limits<Ticks>::max();
+
+    struct State
+    {
+        std::atomic<bool> cancelled{false};
+        std::atomic<Ticks> deadline{NoDeadline};
+    };
+    std::shared_ptr<State> state_;
+};
+
+// tasks are pooled and travel through the queues as pointers, they are never copied
 struct ResTask
 {
-    typedef std::function<void (ResTask& task)> TaskFunc;
+    typedef TaskFunction TaskFunc;
+    static constexpr size_t ContextInlineSize = 64;
+
+    ResTask() = default;
+    ResTask(const ResTask&) = delete;
+    ResTask& operator=(const ResTask&) = delete;
+    ~ResTask() { ResetContext(); }
     
+    // handle of the task: generation in the high bits, pool slot in the low bits
     uint32_t task_id;
-    uint8_t priority;
+    ETaskPriority priority = ETaskPriority::FrameCritical;
     TaskFunc task_func;
     TaskFunc complete_func;
-    uint8_t task_context_1k[1024];
 
+    // explicit token of the job, if any
+    TaskCancelToken cancel_token;
+    // parallel tasks also die with CancelAllParralledTasks, which bumps the coordinator epoch they captured
+    const std::atomic<uint32_t>* cancel_epoch_source = nullptr;
+    uint32_t cancel_epoch = 0;
+
+    // trace timestamp of the last enqueue, 0 when not recording
+    uint64_t queued_ns = 0;
+
+    // poll this in long loops and bail out early, the result is thrown away anyway
+    bool IsCancelled() const
+    {
+        if (cancel_epoch_source != nullptr && cancel_epoch_source->load(std::memory_order_acquire) != cancel_epoch)
+        {
+            return true;
+        }
+        return cancel_token.IsCancelled();
+    }
+
+    // slot in the TaskPool, fixed for the lifetime of the object
+    uint32_t pool_index = 0;
+    // bumped each time the slot is recycled, a handle whose generation no longer matches is complete
+    std::atomic<uint32_t> generation{0};
+
+    // typed result slot: task_func builds the result in place, complete_func reads it back by reference
     template<typename T>
-    void SetContext(T& context)
+    T& SetContext(T context)
     {
-        std::memcpy( task_context_1k, &context, std::min(size_t(1024), sizeof(T)) );
+        ResetContext();
+        if constexpr (sizeof(T) <= ContextInlineSize && alignof(T) <= alignof(std::max_align_t))
+        {
+            context_ = new (contextStorage_) T(std::move(context));
+            contextDestroy_ = [](void* ptr) { static_cast<T*>(ptr)->~T(); };
+        }
+        else
+        {
+            context_ = new T(std::move(context));
+            contextDestroy_ = [](void* ptr) { delete static_cast<T*>(ptr); };
+        }
+        return *static_cast<T*>(context_);
     }
+
     template<typename T>
-    void GetContext(T& context)
+    T& GetContext()
     {
-        std::memcpy( &context, task_context_1k, std::min(size_t(1024), sizeof(T)) );
+        assert(context_ != nullptr);
+        return *static_cast<T*>(context_);
     }
-    
+
+    bool HasContext() const { return context_ != nullptr; }
+
+    void ResetContext()
+    {
+        if (context_ != nullptr)
+        {
+            contextDestroy_(context_);
+            context_ = nullptr;
+            contextDestroy_ = nullptr;
+        }
+    }
+
+    // back to the pool: drop captures and result so their resources are freed right away
+    void Recycle()
+    {
+        task_func = nullptr;
+        complete_func = nullptr;
+        cancel_token = {};
+        cancel_epoch_source = nullptr;
+        ResetContext();
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char contextStorage_[ContextInlineSize];
+    void* context_ = nullptr;
+    void (*contextDestroy_)(void*) = nullptr;
+};
+
+// free list of ResTask, grows by blocks and never gives memory back while the coordinator lives.
+// slots are addressable by index, so a task handle can be checked without any lookup table.
+// slots are recycled fifo with at least MinFreeSlots in flight, a stored handle only aliases a new task after
+// MinFreeSlots << (32 - IndexBits) tasks went through the pool
+class TaskPool
+{
+public:
+    static constexpr uint32_t IndexBits = 16;
+    static constexpr uint32_t IndexMask = (1u << IndexBits) - 1;
+    static constexpr uint32_t GenerationMask = (1u << (32 - IndexBits)) - 1;
+    static constexpr uint32_t BlockSize = 256;
+    // one block short of the full index range, so no handle can ever be UINT32_MAX
+    static constexpr uint32_t MaxBlocks = (1u << IndexBits) / BlockSize - 1;
+    static constexpr uint32_t MinFreeSlots = BlockSize;
+    static_assert((size_t(1) << IndexBits) <= TaskQueueCapacity, "a task queue ring must hold every live task");
+
+    static uint32_t MakeHandle(uint32_t index, uint32_t generation) { return (generation << IndexBits) | index; }
+    static uint32_t HandleIndex(uint32_t handle) { return handle & IndexMask; }
+    static uint32_t HandleGeneration(uint32_t handle) { return handle >> IndexBits; }
+
+    ~TaskPool()
+    {
+        for (auto& block : blocks_)
+        {
+            delete[] block.load(std::memory_order_relaxed);
+        }
+    }
+
+    ResTask* Acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        // a short free list would spin the same few slots through their generations
+        if (free_.size() < MinFreeSlots && blockCount_ < MaxBlocks)
+        {
+            ResTask* block = new ResTask[BlockSize];
+            for (uint32_t i = 0; i < BlockSize; ++i)
+            {
+                block[i].pool_index = blockCount_ * BlockSize + i;
+                free_.push_back(&block[i]);
+            }
+            blocks_[blockCount_].store(block, std::memory_order_release);
+            blockCount_++;
+        }
+        if (free_.empty())
+        {
+            Throw(std::runtime_error(fmt::format("task pool exhausted, {} tasks alive", MaxBlocks * BlockSize)));
+        }
+        ResTask* task = free_.front();
+        free_.pop_front();
+        task->task_id = MakeHandle(task->pool_index, task->generation.load(std::memory_order_relaxed));
+        return task;
+    }
+
+    void Release(ResTask* task)
+    {
+        task->Recycle();
+        // invalidate outstanding handles, then wake whoever waits on this one
+        task->generation.store((task->generation.load(std::memory_order_relaxed) + 1) & GenerationMask, std::memory_order_release);
+        task->generation.notify_all();
+        std::lock_guard<std::mutex> lock(m_);
+        free_.push_back(task);
+    }
+
+    // lock free, safe from any thread. null if the handle never came from this pool
+    ResTask* Find(uint32_t handle) const
+    {
+        uint32_t index = HandleIndex(handle);
+        if (index / BlockSize >= MaxBlocks)
+        {
+            return nullptr;
+        }
+        ResTask* block = blocks_[index / BlockSize].load(std::memory_order_acquire);
+        return block != nullptr ? &block[index % BlockSize] : nullptr;
+    }
+
+    bool IsComplete(uint32_t handle) const
+    {
+        ResTask* task = Find(handle);
+        return task == nullptr || task->generation.load(std::memory_order_acquire) != HandleGeneration(handle);
+    }
+
+private:
+    std::mutex m_;
+    std::deque<ResTask*> free_;
+    std::array<std::atomic<ResTask*>, MaxBlocks> blocks_{};
+    uint32_t blockCount_ = 0;
+};
+
+// result of AddTaskFuture / AddParralledFuture, shared between the task and the future
+template<typename T>
+struct TaskFutureState
+{
+    using ValueType = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+    std::optional<ValueType> value;
+    std::atomic<bool> ready{false};
+    // coroutine waiting on the result, or ResumedTag once the main thread completion has run
+    std::atomic<void*> continuation{nullptr};
+
+    static void* ResumedTag() { return reinterpret_cast<void*>(uintptr_t(1)); }
+
+    template<typename Func>
+    void Produce(Func& func)
+    {
+        if constexpr (std::is_void_v<T>)
+        {
+            func();
+            value.emplace();
+        }
+        else
+        {
+            value.emplace(func());
+        }
+        ready.store(true, std::memory_order_release);
+        ready.notify_all();
+    }
+
+    // main thread, from the task completion
+    void Resume()
+    {
+        void* waiting = continuation.exchange(ResumedTag(), std::memory_order_acq_rel);
+        if (waiting != nullptr && waiting != ResumedTag())
+        {
+            std::coroutine_handle<>::from_address(waiting).resume();
+        }
+    }
+};
+
+template<typename T>
+class TaskFuture
+{
+public:
+    TaskFuture() = default;
+    TaskFuture(uint32_t taskId, std::shared_ptr<TaskFutureState<T>> state) : taskId_(taskId), state_(std::move(state)) {}
+
+    uint32_t GetTaskId() const { return taskId_; }
+    bool IsValid() const { return state_ != nullptr; }
+    bool IsReady() const { return state_ != nullptr && state_->ready.load(std::memory_order_acquire); }
+
+    // blocks until the value is produced, helping the pool meanwhile
+    typename TaskFutureState<T>::ValueType& Get();
+
+    // co_await support: the coroutine resumes on the main thread once the task has completed
+    bool await_ready() const noexcept { return state_->continuation.load(std::memory_order_acquire) == TaskFutureState<T>::ResumedTag(); }
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        void* expected = nullptr;
+        return state_->continuation.compare_exchange_strong(expected, handle.address(), std::memory_order_acq_rel);
+    }
+    typename TaskFutureState<T>::ValueType& await_resume() { return *state_->value; }
+
+private:
+    uint32_t taskId_ = UINT32_MAX;
+    std::shared_ptr<TaskFutureState<T>> state_;
+};
+
+// fire-and-forget coroutine for async pipelines, runs eagerly until its first co_await
+struct TaskRoutine
+{
+    struct promise_type
+    {
+        TaskRoutine get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// what the last TaskCoordinator::Tick did with the completion queues, per priority lane
+struct TaskTickStats
+{
+    float frameTargetMs = 0.f;
+    float budgetMs = 0.f;
+    float usedMs = 0.f;
+    uint32_t mainThreadTasks = 0;
+    // main thread tasks left for the next frames, they share the budget with the completions
+    uint32_t mainThreadSpilled = 0;
+    uint32_t mainThreadStarvedTicks = 0;
+    float mainThreadAvgCostMs = 0.f;
+    std::array<uint32_t, size_t(ETaskPriority::Count)> processed{};
+    // left in the queue for the next frames
+    std::array<uint32_t, size_t(ETaskPriority::Count)> spilled{};
+    // consecutive ticks the lane had work but got nothing done
+    std::array<uint32_t, size_t(ETaskPriority::Count)> starvedTicks{};
+    // running average cost of one completion, used to stop before a completion would blow the budget
+    std::array<float, size_t(ETaskPriority::Count)> avgCostMs{};
 };
 
 class TaskCoordinator;
@@ -233,14 +915,15 @@ class TaskCoordinator;
 class TaskThread
 {
 public:
-    TaskThread(TaskCoordinator* coordinator = nullptr);
+    TaskThread(ETaskPriority priority);
    
     ~TaskThread()
     {
         complete_->wait();
         terminate_->set();
-        thread_->detach();
-        //thread_->join();
+        Wake();
+        // parked threads wake up on terminate right away, safe to join now
+        thread_->join();
     }
 
     bool IsIdle()
@@ -248,10 +931,41 @@ public:
         return complete_->is_set();
     }
 
+    void Enqueue(ResTask* task)
+    {
+        taskQueue_.enqueue(task);
+        Wake();
+    }
+
+    void Wake()
+    {
+        wakeEpoch_.fetch_add(1, std::memory_order_release);
+        wakeEpoch_.notify_one();
+    }
+
     std::unique_ptr<event_signal> terminate_;
     std::unique_ptr<event_signal> complete_;
     std::unique_ptr<std::thread> thread_;
-    tsqueue<ResTask> taskQueue_;
+    tsqueue<ResTask*> taskQueue_;
+    // bumped on every enqueue, the thread parks on it with std::atomic::wait instead of sleep polling
+    std::atomic<uint32_t> wakeEpoch_{0};
+};
+
+// low priority worker of the parallel pool, owns a local deque and steals from siblings when it runs dry
+class TaskWorker
+{
+public:
+    TaskWorker(uint32_t index) : index_(index) {}
+    ~TaskWorker();
+
+    // started once all siblings exist, stealing walks the worker list
+    void Start(TaskCoordinator* coordinator);
+    void Join();
+
+    uint32_t index_;
+    // one deque per priority lane
+    std::array<workdeque<ResTask*>, size_t(ETaskPriority::Count)> localQueues_;
+    std::unique_ptr<std::thread> thread_;
 };
 
 class TaskCoordinator
@@ -259,19 +973,26 @@ class TaskCoordinator
 public:
     TaskCoordinator()
     {
-        for (int i = 0; i < 4; i++)
+        TaskTrace::SetThreadName("main");
+
+        // one thread per priority class, a long streaming load never queues scene loading behind it
+        for (size_t i = 0; i < size_t(ETaskPriority::Count); i++)
         {
-            threads_.push_back(std::make_unique<TaskThread>());
+            threads_.push_back(std::make_unique<TaskThread>(ETaskPriority(i)));
         }
 
-        // Get the number of CPU cores (use half of available cores for low-priority threads)
+        // one low-priority worker per core unless the application set a budget
         unsigned int numCores = std::thread::hardware_concurrency();
-        unsigned int lowThreadCount = std::max(1u, numCores / 1);
+        unsigned int lowThreadCount = workerCountOverride_ > 0 ? workerCountOverride_ : std::max(1u, numCores);
 
-        // Create low-priority threads based on CPU cores
+        // Create low-priority workers based on CPU cores, they pull parallel tasks by themselves
         for (unsigned int i = 0; i < lowThreadCount; i++)
         {
-            lowThreads_.push_back(std::make_unique<TaskThread>());
+            lowThreads_.push_back(std::make_unique<TaskWorker>(i));
+        }
+        for (auto& worker : lowThreads_)
+        {
+            worker->Start(this);
         }
 
         //SPDLOG_INFO("low parallel thread count: {}", lowThreadCount);
@@ -284,67 +1005,180 @@ public:
         {
             thread.reset();
         }
+
+        terminate_.store(true);
+        WakeWorkers(true);
+        for (auto& worker : lowThreads_)
+        {
+            worker->Join();
+        }
         puts("TaskCoordinator shut down.");
     }
 
-    void MarkTaskComplete(const ResTask& task)
+    void MarkTaskComplete(ResTask* task)
     {
-        completeTaskQueue_.enqueue(task);
+        task->queued_ns = TaskTrace::IsEnabled() ? TaskTrace::Now() : 0;
+        completeTaskQueues_[size_t(task->priority)].enqueue(task);
+        completionEpoch_.fetch_add(1, std::memory_order_release);
+        completionEpoch_.notify_all();
     }
 
-    void MarkTaskEnd(const ResTask& task)
+
+    uint32_t AddTask( ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func, ETaskPriority priority = ETaskPriority::FrameCritical, TaskCancelToken cancelToken = {});
+    uint32_t AddParralledTask( ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func );
+
+    // task graph: the task is held back until every predecessor has finished its task_func.
+    // predecessors that already finished (or are unknown) count as done.
+    uint32_t AddParralledTask( ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func, const std::vector<uint32_t>& predecessors,
+        ETaskPriority priority = ETaskPriority::Streaming, TaskCancelToken cancelToken = {} );
+    // join node without work, finishes as soon as all predecessors finish, complete_func runs on main thread
+    uint32_t AddJoinTask( const std::vector<uint32_t>& predecessors, ResTask::TaskFunc complete_func,
+        ETaskPriority priority = ETaskPriority::FrameCritical, TaskCancelToken cancelToken = {} );
+    // continuation on the pool, starts right after predecessor finishes
+    uint32_t Then( uint32_t predecessor, ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func )
     {
-        completedTaskIds_.insert(task.task_id);
+        return AddParralledTask(std::move(task_func), std::move(complete_func), {predecessor});
+    }
+
+    // a task is complete once its complete_func has run on the main thread and the slot went back to the pool
+    bool IsTaskComplete(uint32_t task_id) const
+    {
+        return taskPool_.IsComplete(task_id);
     }
-    
-    uint32_t AddTask( ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func, uint8_t priority = 0);
-    uint32_t AddParralledTask( ResTask::TaskFunc task_func, ResTask::TaskFunc complete_func );
 
-    void WaitForTask(uint32_t task_id)
+    // wait for specific task to complete, like sync load.
+    // on the main thread it keeps ticking completions and helps the pool, elsewhere it parks on the handle.
+    // if task_id is already done, return immediately.
+    void WaitForTask(uint32_t task_id);
+
+    // run task_func on a priority thread (or the pool) and hand its return value to a TaskFuture
+    template<typename Func>
+    auto AddTaskFuture(Func&& func, ETaskPriority priority = ETaskPriority::FrameCritical) -> TaskFuture<std::invoke_result_t<std::decay_t<Func>&>>
+    {
+        using T = std::invoke_result_t<std::decay_t<Func>&>;
+        auto state = std::make_shared<TaskFutureState<T>>();
+        uint32_t taskId = AddTask([state, func = std::forward<Func>(func)](ResTask& task) mutable { state->Produce(func); },
+                                  [state](ResTask& task) { state->Resume(); }, priority);
+        return TaskFuture<T>(taskId, std::move(state));
+    }
+
+    // futures are never cancelled, CancelAllParralledTasks keeps them so Get() and co_await always get a value
+    template<typename Func>
+    auto AddParralledFuture(Func&& func, const std::vector<uint32_t>& predecessors = {}, ETaskPriority priority = ETaskPriority::Streaming) -> TaskFuture<std::invoke_result_t<std::decay_t<Func>&>>
     {
-        // wait for specific task to complete, like sync load.
-        // if task_id not found, it has been down, return immediately.
+        using T = std::invoke_result_t<std::decay_t<Func>&>;
+        auto state = std::make_shared<TaskFutureState<T>>();
+        ResTask* task = CreateTask([state, func = std::forward<Func>(func)](ResTask& task) mutable { state->Produce(func); },
+                                   [state](ResTask& task) { state->Resume(); }, priority);
+        uint32_t taskId = AddGraphTask(task, predecessors);
+        return TaskFuture<T>(taskId, std::move(state));
     }
 
+    // blocks until flag is set, the main thread keeps ticking and workers keep running tasks meanwhile
+    void WaitForFlag(const std::atomic<bool>& flag);
+
+    bool IsMainThread() const { return std::this_thread::get_id() == mainThreadId_; }
+
+    // size of the parallel pool, only effective before the first GetInstance()
+    static void SetWorkerCount(uint32_t count) { workerCountOverride_ = count; }
+    uint32_t GetWorkerCount() const { return uint32_t(lowThreads_.size()); }
+
+    // at most maxWorkers pool workers run tasks of this lane at once, 0 = no limit.
+    // keeps e.g. a full probe bake from occupying every core while physics and streaming need some.
+    void SetLaneBudget(ETaskPriority priority, uint32_t maxWorkers) { laneBudget_[size_t(priority)].store(maxWorkers, std::memory_order_relaxed); }
+
     void WaitForAllParralledTask();
-    
-    bool IsAllParralledTaskComplete()
+
+    // data parallel helpers on the low priority pool. [begin, end) is split into grainSize chunks,
+    // func(chunkBegin, chunkEnd) runs once per chunk. the caller takes chunks itself and only waits on
+    // chunks already running, so it is safe to call from a worker thread without deadlocking.
+    template<typename Func>
+    void ParallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, Func&& func)
     {
-        for ( auto& thread : lowThreads_ )
+        if (end <= begin)
         {
-            if( !thread->IsIdle() )
-            {
-                return false;
-            }
+            return;
         }
-        return true;
+        grainSize = std::max(1u, grainSize);
+        uint32_t chunkCount = (end - begin + grainSize - 1) / grainSize;
+        ParallelForChunks(chunkCount, [&func, begin, end, grainSize](uint32_t chunk)
+        {
+            uint32_t chunkBegin = begin + chunk * grainSize;
+            func(chunkBegin, std::min(end, chunkBegin + grainSize));
+        });
     }
 
-    void CancelAllParralledTasks()
+    // func(chunkBegin, chunkEnd) returns the partial result of a chunk, partials are combined with
+    // reduce(a, b) in chunk order so float results do not depend on scheduling
+    template<typename T, typename Func, typename Reduce>
+    T ParallelReduce(uint32_t begin, uint32_t end, uint32_t grainSize, T identity, Func&& func, Reduce&& reduce)
     {
-        while(parralledTaskQueue_.size() > 0)
+        if (end <= begin)
         {
-            ResTask task;
-            parralledTaskQueue_.dequeue(task, true);
+            return identity;
         }
+        grainSize = std::max(1u, grainSize);
+        uint32_t chunkCount = (end - begin + grainSize - 1) / grainSize;
+        std::vector<T> partials(chunkCount, identity);
+        ParallelForChunks(chunkCount, [&func, &partials, begin, end, grainSize](uint32_t chunk)
+        {
+            uint32_t chunkBegin = begin + chunk * grainSize;
+            partials[chunk] = func(chunkBegin, std::min(end, chunkBegin + grainSize));
+        });
+
+        T result = std::move(identity);
+        for (auto& partial : partials)
+        {
+            result = reduce(std::move(result), partial);
+        }
+        return result;
     }
 
-    uint32_t GetParralledTaskCount()
+    void ParallelForChunks(uint32_t chunkCount, const std::function<void(uint32_t chunk)>& chunkFunc);
+    
+    bool IsAllParralledTaskComplete()
     {
-        return uint32_t(parralledTaskQueue_.size());
+        return parralledPending_.load(std::memory_order_acquire) == 0;
     }
 
+    // drops every queued or waiting parallel task and flags the running ones through ResTask::IsCancelled(),
+    // completions still queued for the main thread are dropped too. tasks without epoch and token (futures) are kept,
+    // a dropped predecessor counts as finished for them. returns right away, WaitForAllParralledTask afterwards
+    // waits for the running tasks to notice and for the kept ones to run.
+    void CancelAllParralledTasks();
+
+    uint32_t GetParralledTaskCount();
+
     uint32_t GetMainTaskCount();
 
     uint32_t GetComleteTaskQueueCount()
     {
-        return uint32_t(completeTaskQueue_.size());
+        size_t count = 0;
+        for (auto& queue : completeTaskQueues_)
+        {
+            count += queue.size();
+        }
+        return uint32_t(count);
     }
 
     bool IsAllTaskComplete(std::vector<uint32_t>& tasks);
 
+    // main thread. runs completions in priority order within a slice of the frame target,
+    // the rest spills over to the next ticks. a lane starved for too long still gets one per tick.
     void Tick();
 
+    // frame time the application aims for, the completion budget is a fraction of it
+    void SetFrameTarget(float frameTargetMs) { frameTargetMs_ = frameTargetMs; }
+    const TaskTickStats& GetTickStats() const { return tickStats_; }
+
+    // worker side of the parallel pool: local deque first, then the shared queue, then steal from siblings.
+    // worker may be null when a waiting thread helps out.
+    bool TryRunParralledTask(TaskWorker* worker);
+    void WorkerLoop(TaskWorker* worker);
+
+    // tsqueue against the old locked queue at 1 / 4 / 16 / 64 producers, prints million items per second
+    static void BenchmarkQueues();
+
     static TaskCoordinator* GetInstance()
     {
         if(instance_ == nullptr)
@@ -355,16 +1189,67 @@ public:
     }
 
 private:
+    struct TaskGraphNode
+    {
+        // unfinished predecessors, the task is parked in here until it drops to zero
+        uint32_t waitCount = 0;
+        ResTask* task = nullptr;
+        std::vector<uint32_t> successors;
+    };
+
+    void WakeWorkers(bool all);
+    void FinishParralledTask(uint32_t count);
+    ResTask* CreateTask(TaskFunction task_func, TaskFunction complete_func, ETaskPriority priority);
+    // registers the task in the graph and submits it once its predecessors are done
+    uint32_t AddGraphTask(ResTask* task, const std::vector<uint32_t>& predecessors);
+    void SubmitParralledTask(ResTask* task);
+    void CompleteParralledTask(ResTask* task);
+
+    // indexed by ETaskPriority
     std::vector< std::unique_ptr<TaskThread> > threads_;
     // low-level thread, use for parrallel task
-    std::vector< std::unique_ptr<TaskThread> > lowThreads_;
-    tsqueue<ResTask> mainthreadTaskQueue_;
-    tsqueue<ResTask> completeTaskQueue_;
-    tsqueue<ResTask> parralledTaskQueue_;
+    std::vector< std::unique_ptr<TaskWorker> > lowThreads_;
+    tsqueue<ResTask*> mainthreadTaskQueue_;
+    // completions waiting for the main thread, one per priority lane
+    std::array<tsqueue<ResTask*>, size_t(ETaskPriority::Count)> completeTaskQueues_;
+    // shared queues of the parallel pool, one per priority lane
+    std::array<tsqueue<ResTask*>, size_t(ETaskPriority::Count)> parralledTaskQueues_;
+
+    TaskPool taskPool_;
+
+    // queued + running parallel tasks, waiters park on it
+    std::atomic<uint32_t> parralledPending_{0};
+    // bumped on every parallel submit, idle workers park on it
+    std::atomic<uint32_t> parralledEpoch_{0};
+    std::atomic<bool> terminate_{false};
+    // bumped by CancelAllParralledTasks, parallel tasks created before the bump report IsCancelled()
+    std::atomic<uint32_t> cancelEpoch_{0};
+    // per lane worker budget and how many workers currently run a task of the lane
+    std::array<std::atomic<uint32_t>, size_t(ETaskPriority::Count)> laneBudget_{};
+    std::array<std::atomic<uint32_t>, size_t(ETaskPriority::Count)> laneRunning_{};
+    // bumped on every completion enqueue, the main thread parks on it in WaitForTask
+    std::atomic<uint32_t> completionEpoch_{0};
+    std::thread::id mainThreadId_ = std::this_thread::get_id();
+
+    static constexpr float CompletionBudgetRatio = 0.2f;
+    static constexpr float MinCompletionBudgetMs = 0.5f;
+    static constexpr uint32_t MaxStarvedTicks = 8;
+    float frameTargetMs_ = 1000.f / 60.f;
+    TaskTickStats tickStats_;
+
+    // live (unfinished) parallel tasks, holds the dependency edges of the task graph
+    std::mutex graphMutex_;
+    std::unordered_map<uint32_t, TaskGraphNode> graphNodes_;
 
-    std::unordered_set<uint32_t> completedTaskIds_;
 private:
     static std::unique_ptr<TaskCoordinator> instance_;
+    static uint32_t workerCountOverride_;
     static void TestCase();
 };
 
+template<typename T>
+typename TaskFutureState<T>::ValueType& TaskFuture<T>::Get()
+{
+    TaskCoordinator::GetInstance()->WaitForFlag(state_->ready);
+    return *state_->value;
+}
@@ -0,0 +1,203 @@
+#include "TaskTrace.hpp"
+#include "TaskCoordinator.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <memory>
+#include <fmt/format.h>
+
+std::atomic<bool> TaskTrace::enabled_{false};
+
+namespace
+{
+    struct FTraceThread
+    {
+        uint32_t tid = 0;
+        std::string name;
+        TaskTraceRing<TaskTraceEvent, TaskTrace::EventCapacity> events;
+        // for utilisation, never reset
+        std::atomic<uint64_t> busyNs{0};
+        std::atomic<uint64_t> waitNs{0};
+        std::atomic<uint64_t> taskCount{0};
+    };
+
+    // threads are registered once and never removed, their rings stay readable after the thread exits
+    std::mutex GTraceMutex;
+    std::vector<std::unique_ptr<FTraceThread>> GTraceThreads;
+    TaskTraceRing<TaskTraceCounters, TaskTrace::CounterCapacity> GTraceCounters;
+    thread_local FTraceThread* GTraceThread = nullptr;
+
+    const std::chrono::steady_clock::time_point GTraceEpoch = std::chrono::steady_clock::now();
+
+    struct FUsageSample
+    {
+        uint64_t busyNs = 0;
+        uint64_t waitNs = 0;
+        uint64_t taskCount = 0;
+    };
+    std::vector<FUsageSample> GUsageSamples;
+    std::vector<TaskTrace::ThreadUsage> GUsage;
+    uint64_t GUsageSampleTime = 0;
+
+    FTraceThread* GetTraceThread()
+    {
+        if (GTraceThread == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(GTraceMutex);
+            auto thread = std::make_unique<FTraceThread>();
+            thread->tid = uint32_t(GTraceThreads.size()) + 1;
+            thread->name = fmt::format("thread {}", thread->tid);
+            GTraceThread = thread.get();
+            GTraceThreads.push_back(std::move(thread));
+        }
+        return GTraceThread;
+    }
+
+    const char* GetKindName(ETaskTraceKind kind)
+    {
+        switch (kind)
+        {
+        case ETaskTraceKind::Task: return "task";
+        case ETaskTraceKind::Parralled: return "parralled";
+        case ETaskTraceKind::Complete: return "complete";
+        }
+        return "unknown";
+    }
+
+    const char* GetLaneName(uint32_t lane)
+    {
+        return lane < uint32_t(ETaskPriority::Count) ? GetTaskPriorityName(ETaskPriority(lane)) : "unknown";
+    }
+
+    // chrome trace wants microseconds
+    double ToUs(uint64_t ns)
+    {
+        return double(ns) / 1000.0;
+    }
+}
+
+void TaskTrace::SetEnabled(bool enabled)
+{
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t TaskTrace::Now()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - GTraceEpoch).count());
+}
+
+void TaskTrace::SetThreadName(const std::string& name)
+{
+    FTraceThread* thread = GetTraceThread();
+    std::lock_guard<std::mutex> lock(GTraceMutex);
+    thread->name = name;
+}
+
+void TaskTrace::Record(const TaskTraceEvent& event)
+{
+    FTraceThread* thread = GetTraceThread();
+    thread->events.Push(event);
+    thread->busyNs.fetch_add(event.endNs - event.beginNs, std::memory_order_relaxed);
+    thread->waitNs.fetch_add(event.waitNs, std::memory_order_relaxed);
+    thread->taskCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TaskTrace::RecordCounters(const TaskTraceCounters& counters)
+{
+    // only the main thread samples counters, so the ring keeps a single writer
+    GTraceCounters.Push(counters);
+}
+
+void TaskTrace::Clear()
+{
+    std::lock_guard<std::mutex> lock(GTraceMutex);
+    for (auto& thread : GTraceThreads)
+    {
+        thread->events.Clear();
+    }
+    GTraceCounters.Clear();
+}
+
+bool TaskTrace::DumpChromeTrace(const std::string& path)
+{
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::vector<TaskTraceEvent> events;
+    std::vector<TaskTraceCounters> counters;
+    bool first = true;
+    auto writeEvent = [&file, &first](const std::string& json)
+    {
+        file << (first ? "\n" : ",\n") << json;
+        first = false;
+    };
+
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    std::lock_guard<std::mutex> lock(GTraceMutex);
+    for (auto& thread : GTraceThreads)
+    {
+        writeEvent(fmt::format(R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}})", thread->tid, thread->name));
+
+        events.clear();
+        thread->events.Snapshot(events);
+        for (const TaskTraceEvent& event : events)
+        {
+            const char* lane = GetLaneName(event.lane);
+            writeEvent(fmt::format(R"({{"name":"{} {}","cat":"{}","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f},"args":{{"task":{},"wait_us":{:.3f},"cancelled":{}}}}})",
+                lane, GetKindName(event.kind), lane, thread->tid, ToUs(event.beginNs), ToUs(event.endNs - event.beginNs),
+                event.taskId, ToUs(event.waitNs), event.cancelled));
+        }
+    }
+
+    GTraceCounters.Snapshot(counters);
+    for (const TaskTraceCounters& counter : counters)
+    {
+        std::string parralled;
+        std::string complete;
+        for (uint32_t lane = 0; lane < counter.laneCount && lane < TaskTraceCounters::MaxLanes; ++lane)
+        {
+            parralled += fmt::format(R"({}"{}":{})", lane ? "," : "", GetLaneName(lane), counter.parralledQueued[lane]);
+            complete += fmt::format(R"({}"{}":{})", lane ? "," : "", GetLaneName(lane), counter.completeQueued[lane]);
+        }
+        writeEvent(fmt::format(R"({{"name":"parralled queue","ph":"C","pid":1,"ts":{:.3f},"args":{{{}}}}})", ToUs(counter.timeNs), parralled));
+        writeEvent(fmt::format(R"({{"name":"complete queue","ph":"C","pid":1,"ts":{:.3f},"args":{{{}}}}})", ToUs(counter.timeNs), complete));
+        writeEvent(fmt::format(R"({{"name":"parralled pending","ph":"C","pid":1,"ts":{:.3f},"args":{{"pending":{}}}}})", ToUs(counter.timeNs), counter.parralledPending));
+    }
+
+    file << "\n]}\n";
+    return file.good();
+}
+
+const std::vector<TaskTrace::ThreadUsage>& TaskTrace::GetThreadUsage()
+{
+    uint64_t now = Now();
+    if (now - GUsageSampleTime < 500'000'000ull && !GUsage.empty())
+    {
+        return GUsage;
+    }
+
+    std::lock_guard<std::mutex> lock(GTraceMutex);
+    float window = float(now - GUsageSampleTime);
+    GUsageSampleTime = now;
+    GUsageSamples.resize(GTraceThreads.size());
+    GUsage.resize(GTraceThreads.size());
+    for (size_t i = 0; i < GTraceThreads.size(); ++i)
+    {
+        FTraceThread& thread = *GTraceThreads[i];
+        FUsageSample current{ thread.busyNs.load(std::memory_order_relaxed), thread.waitNs.load(std::memory_order_relaxed), thread.taskCount.load(std::memory_order_relaxed) };
+        FUsageSample& last = GUsageSamples[i];
+        ThreadUsage& usage = GUsage[i];
+        uint64_t tasks = current.taskCount - last.taskCount;
+        usage.name = thread.name;
+        usage.utilisation = window > 0.f ? std::min(1.f, float(current.busyNs - last.busyNs) / window) : 0.f;
+        usage.avgWaitMs = tasks > 0 ? float(current.waitNs - last.waitNs) / float(tasks) / 1e6f : 0.f;
+        usage.taskCount = tasks;
+        last = current;
+    }
+    return GUsage;
+}
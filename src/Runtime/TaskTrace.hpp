@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// task scheduling timeline. every thread records into its own ring buffer without taking a lock,
+// the oldest events get overwritten. dump as chrome trace json, open in chrome://tracing or ui.perfetto.dev
+enum class ETaskTraceKind : uint8_t
+{
+    Task,           // task_func on a priority thread (or the main thread on apple)
+    Parralled,      // task_func on the parallel pool
+    Complete,       // complete_func on the main thread
+};
+
+struct TaskTraceEvent
+{
+    uint64_t beginNs = 0;
+    uint64_t endNs = 0;
+    // time between submit and begin, for Complete: time spent in the completion queue
+    uint64_t waitNs = 0;
+    uint32_t taskId = 0;
+    ETaskTraceKind kind = ETaskTraceKind::Task;
+    // ETaskPriority
+    uint8_t lane = 0;
+    bool cancelled = false;
+};
+
+// queue depths sampled once per TaskCoordinator::Tick
+struct TaskTraceCounters
+{
+    static constexpr uint32_t MaxLanes = 4;
+
+    uint64_t timeNs = 0;
+    uint32_t laneCount = 0;
+    uint32_t parralledQueued[MaxLanes] = {};
+    uint32_t completeQueued[MaxLanes] = {};
+    uint32_t parralledPending = 0;
+};
+
+// single writer, any reader. slots carry a sequence number, so a reader skips a slot the writer is overwriting
+template<typename T, uint32_t Capacity>
+class TaskTraceRing
+{
+public:
+    void Push(const T& item)
+    {
+        uint64_t index = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[index % Capacity];
+        slot.seq.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.item = item;
+        slot.seq.store(index * 2 + 2, std::memory_order_release);
+        head_.store(index + 1, std::memory_order_release);
+    }
+
+    void Snapshot(std::vector<T>& out) const
+    {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        uint64_t first = head > Capacity ? head - Capacity : 0;
+        for (uint64_t index = first; index < head; ++index)
+        {
+            const Slot& slot = slots_[index % Capacity];
+            if (slot.seq.load(std::memory_order_acquire) != index * 2 + 2)
+            {
+                continue;
+            }
+            T item = slot.item;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == index * 2 + 2)
+            {
+                out.push_back(item);
+            }
+        }
+    }
+
+    void Clear() { head_.store(0, std::memory_order_release); }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq{0};
+        T item{};
+    };
+    Slot slots_[Capacity];
+    std::atomic<uint64_t> head_{0};
+};
+
+class TaskTrace
+{
+public:
+    static constexpr uint32_t EventCapacity = 16384;
+    static constexpr uint32_t CounterCapacity = 4096;
+
+    // busy share of a thread over the last sampling window
+    struct ThreadUsage
+    {
+        std::string name;
+        float utilisation = 0.f;
+        float avgWaitMs = 0.f;
+        uint64_t taskCount = 0;
+    };
+
+    static void SetEnabled(bool enabled);
+    static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // nanoseconds since the trace epoch
+    static uint64_t Now();
+
+    // names the calling thread in the timeline
+    static void SetThreadName(const std::string& name);
+
+    // calling thread's ring, lock free after the first event of a thread
+    static void Record(const TaskTraceEvent& event);
+    static void RecordCounters(const TaskTraceCounters& counters);
+
+    // drops everything recorded so far
+    static void Clear();
+
+    static bool DumpChromeTrace(const std::string& path);
+
+    // refreshed at most twice per second, cheap enough to call every frame from the ui
+    static const std::vector<ThreadUsage>& GetThreadUsage();
+
+private:
+    static std::atomic<bool> enabled_;
+};
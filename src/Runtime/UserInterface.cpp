@@ -406,6 +406,40 @@ void UserInterface::DrawOverlay(const Statistics& statistics, Vulkan::VulkanGpuT
 		uint32_t lowTasks = TaskCoordinator::GetInstance()->GetParralledTaskCount();
 		uint32_t completeTasks = TaskCoordinator::GetInstance()->GetComleteTaskQueueCount();
 		ImGui::Text("Tasks: %d / %d / %d", mainTasks, lowTasks, completeTasks);
+		const TaskTickStats& tickStats = TaskCoordinator::GetInstance()->GetTickStats();
+		ImGui::Text("  - Complete: %.2f / %.2fms", tickStats.usedMs, tickStats.budgetMs);
+		ImGui::Text("  - Main Done/Spill: %d/%d", tickStats.mainThreadTasks, tickStats.mainThreadSpilled);
+		ImGui::Text("  - Done/Spill: %d/%d %d/%d %d/%d", tickStats.processed[0], tickStats.spilled[0], tickStats.processed[1], tickStats.spilled[1], tickStats.processed[2], tickStats.spilled[2]);
+
+		if (ImGui::TreeNode("Task Trace"))
+		{
+			bool recording = TaskTrace::IsEnabled();
+			if (ImGui::Checkbox("Record", &recording))
+			{
+				TaskTrace::SetEnabled(recording);
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Dump"))
+			{
+				auto time = std::time(nullptr);
+				std::string traceFile = fmt::format("tasktrace_{:%Y-%m-%d-%H-%M-%S}.json", *std::localtime(&time));
+				if (TaskTrace::DumpChromeTrace(traceFile))
+				{
+					SPDLOG_INFO("task trace written to {}", traceFile);
+				}
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Clear"))
+			{
+				TaskTrace::Clear();
+			}
+			// busy share per thread and average queue wait of the tasks it ran
+			for (auto& usage : TaskTrace::GetThreadUsage())
+			{
+				ImGui::Text("%-24s %3.0f%% %6.2fms", usage.name.c_str(), usage.utilisation * 100.f, usage.avgWaitMs);
+			}
+			ImGui::TreePop();
+		}
 
 		ImGui::Separator();
 		
@@ -1,8 +1,96 @@
 #include "FileHelper.hpp"
 #include <spdlog/spdlog.h>
 
+#if WIN32
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
 namespace Utilities
 {
+    namespace FileHelper
+    {
+        bool FMappedFile::Open(const std::string& path)
+        {
+            Close();
+#if WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                return false;
+            }
+            LARGE_INTEGER fileSize {};
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+            {
+                CloseHandle(file);
+                return false;
+            }
+            // the mapping keeps the file open, the handle is not needed any more
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (mapping == nullptr)
+            {
+                return false;
+            }
+            void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            if (view == nullptr)
+            {
+                CloseHandle(mapping);
+                return false;
+            }
+            mapping_ = mapping;
+            data_ = static_cast<uint8_t*>(view);
+            size_ = static_cast<size_t>(fileSize.QuadPart);
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return false;
+            }
+            struct stat st {};
+            if (fstat(fd, &st) != 0 || st.st_size <= 0)
+            {
+                close(fd);
+                return false;
+            }
+            // the mapping keeps its own reference to the file
+            void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (view == MAP_FAILED)
+            {
+                return false;
+            }
+            data_ = static_cast<uint8_t*>(view);
+            size_ = static_cast<size_t>(st.st_size);
+#endif
+            return true;
+        }
+
+        void FMappedFile::Close()
+        {
+            if (data_ == nullptr)
+            {
+                return;
+            }
+#if WIN32
+            UnmapViewOfFile(data_);
+            CloseHandle(static_cast<HANDLE>(mapping_));
+            mapping_ = nullptr;
+#else
+            munmap(data_, size_);
+#endif
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
     namespace Package
     {
         FPackageFileSystem* FPackageFileSystem::instance_ = nullptr;
@@ -61,6 +61,31 @@ namespace Utilities
 
             return normlizedPath;
         }
+
+        // whole file mapped read only, pages come in on first touch. the view is copy on write,
+        // a stray write never reaches the file
+        class FMappedFile
+        {
+        public:
+            FMappedFile() = default;
+            FMappedFile(const FMappedFile&) = delete;
+            FMappedFile& operator=(const FMappedFile&) = delete;
+            ~FMappedFile() { Close(); }
+
+            bool Open(const std::string& path);
+            void Close();
+
+            const uint8_t* Data() const { return data_; }
+            uint8_t* Data() { return data_; }
+            size_t Size() const { return size_; }
+
+        private:
+            uint8_t* data_ = nullptr;
+            size_t size_ = 0;
+#if WIN32
+            void* mapping_ = nullptr;
+#endif
+        };
     }
 
     namespace NameHelper